@@ -0,0 +1,507 @@
+/* armor.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "armor.h"
+#include "diag.h"
+
+enum {
+	ARMOR_BEGIN,   /* looking for the header line */
+	ARMOR_HEADERS, /* Key: Value lines up to a blank line */
+	ARMOR_BODY,
+	ARMOR_PAD,     /* rest of the line after base64 padding */
+	ARMOR_TAIL,    /* checksum and footer lines */
+	ARMOR_DONE,
+};
+
+#define CRC24_POLY 0x864CFB
+
+/* set in the table for anything that is not a base64 digit; sits above
+ * the 24 bits of a quad, so four lookups OR'd together show any of them */
+#define B64_BAD 0x01000000
+
+static const char b64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* crc_table[k][i]: CRC-24 of byte i followed by k zero bytes, kept in
+ * the top 24 bits so that eight bytes can be folded in per step */
+static uint32_t crc_table[8][256];
+
+/* b64_table[k][c]: value of digit c shifted into position k of a quad */
+static uint32_t b64_table[4][256];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void make_tables(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = (uint32_t) i << 24;
+		for (k = 0; k < 8; k++)
+			c = (c << 1) ^
+				(c & 0x80000000 ? (uint32_t) CRC24_POLY << 8 : 0);
+		crc_table[0][i] = c;
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_table[k][i] = (crc_table[k - 1][i] << 8) ^
+				crc_table[0][crc_table[k - 1][i] >> 24];
+
+	for (k = 0; k < 4; k++)
+		for (i = 0; i < 256; i++)
+			b64_table[k][i] = B64_BAD;
+	for (i = 0; i < 64; i++)
+		for (k = 0; k < 4; k++)
+			b64_table[k][(u8) b64_digits[i]] = i << (18 - 6 * k);
+}
+
+u32 crc24(u32 crc, const u8 *p, u64 len)
+{
+	uint32_t a, b, c;
+
+	pthread_once(&tables_once, make_tables);
+
+	c = crc << 8;
+	while (len >= 8) {
+		a = c ^ ((uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+		b = (uint32_t) p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+		c = crc_table[7][a >> 24] ^ crc_table[6][(a >> 16) & 0xff] ^
+			crc_table[5][(a >> 8) & 0xff] ^ crc_table[4][a & 0xff] ^
+			crc_table[3][b >> 24] ^ crc_table[2][(b >> 16) & 0xff] ^
+			crc_table[1][(b >> 8) & 0xff] ^ crc_table[0][b & 0xff];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		c = (c << 8) ^ crc_table[0][(c >> 24) ^ *p++];
+	return c >> 8;
+}
+
+int armor_detect(const u8 *data, u64 len)
+{
+	/* every packet header has the top bit set; armor is plain text */
+	return len > 0 && !(data[0] & 0x80);
+}
+
+void armor_init(struct armor *a)
+{
+	pthread_once(&tables_once, make_tables);
+	memset(a, 0, sizeof(*a));
+	a->state = ARMOR_BEGIN;
+	a->crc = CRC24_INIT;
+}
+
+static int starts(const u8 *line, u32 len, const char *prefix)
+{
+	u32 n = strlen(prefix);
+	return len >= n && !memcmp(line, prefix, n);
+}
+
+static int end_line(struct armor *a)
+{
+	u32 n = a->line_len < sizeof(a->line) ? a->line_len : sizeof(a->line);
+	u8 *line = a->line;
+	uint32_t w;
+
+	while (n > 0 && (line[n - 1] == '\r' || line[n - 1] == ' ' ||
+			 line[n - 1] == '\t'))
+		n--;
+
+	switch (a->state) {
+	case ARMOR_BEGIN:
+		/* a cleartext signed message is followed by the armored
+		 * signature, which is the part we want */
+		if (starts(line, n, "-----BEGIN PGP ") &&
+		    !starts(line, n, "-----BEGIN PGP SIGNED MESSAGE-----"))
+			a->state = ARMOR_HEADERS;
+		break;
+	case ARMOR_HEADERS:
+		if (!a->nonblank)
+			a->state = ARMOR_BODY;
+		break;
+	case ARMOR_TAIL:
+		if (n == 0)
+			break;
+		if (starts(line, n, "-----END PGP ")) {
+			a->state = ARMOR_DONE;
+			break;
+		}
+		if (n != 5 || line[0] != '=') {
+			diag("malformed armor");
+			return -1;
+		}
+		w = b64_table[0][line[1]] | b64_table[1][line[2]] |
+			b64_table[2][line[3]] | b64_table[3][line[4]];
+		if (w != a->crc) {
+			diag("armor checksum mismatch");
+			return -1;
+		}
+		break;
+	}
+	a->line_len = 0;
+	a->nonblank = 0;
+	return 0;
+}
+
+/* the slow path through the body, one character at a time
+ * returns 1 if c was used, 0 if out has no room for what it completes,
+ * -1 if it does not belong */
+static int body_char(struct armor *a, u8 c, u8 **out, u8 *oend)
+{
+	uint32_t v = b64_table[3][c];
+	u8 *o = *out;
+
+	if (!(v & B64_BAD)) {
+		if (a->nacc == 3 && oend - o < 3)
+			return 0;
+		a->acc = (a->acc << 6) | v;
+		if (++a->nacc == 4) {
+			o[0] = a->acc >> 16;
+			o[1] = a->acc >> 8;
+			o[2] = a->acc;
+			*out = o + 3;
+			a->acc = 0;
+			a->nacc = 0;
+		}
+		return 1;
+	}
+
+	switch (c) {
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+		return 1;
+	case '=':
+		if (a->nacc == 0)
+			break; /* the checksum line */
+		if (a->nacc == 1)
+			return -1;
+		if (oend - o < 2)
+			return 0;
+		if (a->nacc == 2) {
+			*o++ = a->acc >> 4;
+		} else {
+			*o++ = a->acc >> 10;
+			*o++ = a->acc >> 2;
+		}
+		*out = o;
+		a->acc = 0;
+		a->nacc = 0;
+		a->state = ARMOR_PAD;
+		return 1;
+	case '-':
+		if (a->nacc)
+			return -1;
+		break; /* the footer, with no checksum */
+	default:
+		return -1;
+	}
+
+	a->state = ARMOR_TAIL;
+	a->line[0] = c;
+	a->line_len = 1;
+	a->nonblank = 1;
+	return 1;
+}
+
+int armor_decode_chunk(struct armor *a, const u8 *in, u32 len,
+		       u8 *out, u32 cap, u32 *outlen)
+{
+	const u8 *p = in, *end = in + len;
+	u8 *o = out, *oend = out + cap, *mark = out;
+	uint32_t w0, w1, w2, w3;
+	u8 c;
+	int r;
+
+	while (p < end) {
+		switch (a->state) {
+		case ARMOR_BODY:
+			/* whole quads straight from the input, sixteen
+			 * characters at a time where the line allows */
+			if (a->nacc == 0) {
+				while (end - p >= 16 && oend - o >= 12) {
+					w0 = b64_table[0][p[0]] | b64_table[1][p[1]] |
+						b64_table[2][p[2]] | b64_table[3][p[3]];
+					w1 = b64_table[0][p[4]] | b64_table[1][p[5]] |
+						b64_table[2][p[6]] | b64_table[3][p[7]];
+					w2 = b64_table[0][p[8]] | b64_table[1][p[9]] |
+						b64_table[2][p[10]] | b64_table[3][p[11]];
+					w3 = b64_table[0][p[12]] | b64_table[1][p[13]] |
+						b64_table[2][p[14]] | b64_table[3][p[15]];
+					if ((w0 | w1 | w2 | w3) & B64_BAD)
+						break;
+					o[0] = w0 >> 16; o[1] = w0 >> 8; o[2] = w0;
+					o[3] = w1 >> 16; o[4] = w1 >> 8; o[5] = w1;
+					o[6] = w2 >> 16; o[7] = w2 >> 8; o[8] = w2;
+					o[9] = w3 >> 16; o[10] = w3 >> 8; o[11] = w3;
+					p += 16;
+					o += 12;
+				}
+				while (end - p >= 4 && oend - o >= 3) {
+					w0 = b64_table[0][p[0]] | b64_table[1][p[1]] |
+						b64_table[2][p[2]] | b64_table[3][p[3]];
+					if (w0 & B64_BAD)
+						break;
+					o[0] = w0 >> 16; o[1] = w0 >> 8; o[2] = w0;
+					p += 4;
+					o += 3;
+				}
+				if (p == end)
+					break;
+			}
+			r = body_char(a, *p, &o, oend);
+			if (r < 0) {
+				diag("malformed armor");
+				return -1;
+			}
+			if (r == 0)
+				goto full;
+			p++;
+			break;
+		case ARMOR_PAD:
+			c = *p++;
+			if (c == '\n') {
+				a->state = ARMOR_TAIL;
+			} else if (c != '=' && c != ' ' && c != '\t' && c != '\r') {
+				diag("malformed armor");
+				return -1;
+			}
+			break;
+		case ARMOR_DONE:
+			p = end;
+			break;
+		default:
+			c = *p++;
+			if (c != '\n') {
+				if (a->line_len < sizeof(a->line))
+					a->line[a->line_len] = c;
+				a->line_len++;
+				if (c != ' ' && c != '\t' && c != '\r')
+					a->nonblank = 1;
+				break;
+			}
+			if (a->state == ARMOR_TAIL) {
+				/* bring the checksum up to date first */
+				a->crc = crc24(a->crc, mark, o - mark);
+				mark = o;
+			}
+			if (end_line(a))
+				return -1;
+			break;
+		}
+	}
+
+full:
+	a->crc = crc24(a->crc, mark, o - mark);
+	*outlen = o - out;
+	return p - in;
+}
+
+int armor_finish(struct armor *a)
+{
+	/* the footer line need not end in a newline */
+	if (a->state == ARMOR_TAIL && a->line_len && end_line(a))
+		return -1;
+	if (a->state != ARMOR_DONE) {
+		diag("truncated armor");
+		return -1;
+	}
+	return 0;
+}
+
+int armor_decode(const u8 *data, u64 len, u8 **_out, u64 *outlen)
+{
+	struct armor a;
+	u64 have = 0, max;
+	u32 chunk, n;
+	u8 *out;
+	int r;
+
+	/* at most three bytes for every four characters */
+	max = len / 4 * 3 + 3;
+	out = malloc(max);
+	if (!out)
+		return -1;
+
+	armor_init(&a);
+	while (len > 0) {
+		chunk = len > 0x40000000 ? 0x40000000 : len;
+		r = armor_decode_chunk(&a, data, chunk, out + have,
+				       max - have > 0x40000000 ?
+				       0x40000000 : max - have, &n);
+		if (r <= 0)
+			goto fail;
+		data += r;
+		len -= r;
+		have += n;
+	}
+	if (armor_finish(&a))
+		goto fail;
+
+	*_out = out;
+	*outlen = have;
+	return 0;
+
+fail:
+	free(out);
+	return -1;
+}
+
+/* -- armored or binary input as a source of packets -- */
+
+#define ARMOR_CHUNK (64 * 1024)
+
+struct armor_source {
+	struct source src;
+	struct source *in;
+	struct armor armor;
+	int started;
+	int binary; /* not armored after all: pass it straight through */
+	int eof;
+	u32 pos, end;   /* input read but not yet decoded */
+	u32 opos, oend; /* decoded bytes too many for a small read */
+	u8 buf[ARMOR_CHUNK];
+	u8 obuf[4];
+};
+
+static int armor_fill(struct armor_source *as)
+{
+	int r;
+
+	r = source_read(as->in, as->buf, sizeof(as->buf));
+	if (r < 0)
+		return -1;
+	as->pos = 0;
+	as->end = r;
+	if (r == 0)
+		as->eof = 1;
+	return 0;
+}
+
+static int armor_read(struct source *src, u8 *buf, u32 len)
+{
+	struct armor_source *as = (struct armor_source *) src;
+	u8 *out;
+	u32 n, cap;
+	int r;
+
+	if (!as->started) {
+		if (armor_fill(as))
+			return -1;
+		as->binary = !armor_detect(as->buf, as->end);
+		as->started = 1;
+	}
+
+	if (as->binary) {
+		if (as->pos == as->end)
+			return source_read(as->in, buf, len);
+		n = as->end - as->pos;
+		if (n > len)
+			n = len;
+		memcpy(buf, as->buf + as->pos, n);
+		as->pos += n;
+		return n;
+	}
+
+	if (as->opos < as->oend) {
+		n = as->oend - as->opos;
+		if (n > len)
+			n = len;
+		memcpy(buf, as->obuf + as->opos, n);
+		as->opos += n;
+		return n;
+	}
+
+	/* decode straight into the caller's buffer unless it is too small
+	 * to take a whole quad */
+	if (len < 3) {
+		out = as->obuf;
+		cap = sizeof(as->obuf);
+	} else {
+		out = buf;
+		cap = len;
+	}
+
+	for (;;) {
+		if (as->pos == as->end) {
+			if (!as->eof && armor_fill(as))
+				return -1;
+			if (as->eof)
+				return armor_finish(&as->armor);
+		}
+		r = armor_decode_chunk(&as->armor, as->buf + as->pos,
+				       as->end - as->pos, out, cap, &n);
+		if (r < 0)
+			return -1;
+		as->pos += r;
+		if (n > 0)
+			break;
+	}
+
+	if (out == buf)
+		return n;
+	as->opos = 0;
+	as->oend = n;
+	return armor_read(src, buf, len);
+}
+
+static void armor_close(struct source *src)
+{
+	struct armor_source *as = (struct armor_source *) src;
+
+	source_close(as->in);
+	free(as);
+}
+
+struct source *source_dearmor(struct source *in)
+{
+	struct armor_source *as;
+
+	if (!in)
+		return 0;
+	as = calloc(1, sizeof(*as));
+	if (!as) {
+		source_close(in);
+		return 0;
+	}
+	as->src.read = armor_read;
+	as->src.close = armor_close;
+	as->in = in;
+	armor_init(&as->armor);
+	return &as->src;
+}
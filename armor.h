@@ -0,0 +1,89 @@
+/* armor.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _ARMOR_H_
+#define _ARMOR_H_
+
+#include "crypto.h"
+#include "stream.h"
+
+/* rfc4880 6: ASCII armor, base64 with a CRC-24 over the decoded data */
+
+#define CRC24_INIT 0xB704CE
+
+/* running CRC-24 of data[0:len], starting from crc (CRC24_INIT) */
+u32 crc24(u32 crc, const u8 *data, u64 len);
+
+/* could data be armored rather than binary?  only its first byte is
+ * looked at: every packet header has the top bit set, text does not */
+int armor_detect(const u8 *data, u64 len);
+
+/* push-style decoder for the first armored block of its input that is
+ * not a cleartext signed message: feed it input in pieces of any size */
+struct armor {
+	int state;
+	u32 acc;       /* base64 digits of a partial quad */
+	int nacc;
+	u32 crc;
+	u32 line_len;  /* of the current header or trailer line */
+	int nonblank;
+	u8 line[80];   /* its start, which is all we ever need to look at */
+};
+
+void armor_init(struct armor *a);
+
+/* decode from in[0:len] into at most cap bytes of out, setting *outlen
+ * returns the number of input bytes consumed, or -1 if malformed */
+int armor_decode_chunk(struct armor *a, const u8 *in, u32 len,
+		       u8 *out, u32 cap, u32 *outlen);
+
+/* at end of input: 0 if a complete block with a good checksum was seen */
+int armor_finish(struct armor *a);
+
+/* decode armored data[0:len] into a malloc'd buffer */
+int armor_decode(const u8 *data, u64 len, u8 **out, u64 *outlen);
+
+/* binary packets from src whether or not it is armored; src is closed
+ * along with the result */
+struct source *source_dearmor(struct source *src);
+
+/* does data start with a cleartext signed message (rfc4880 7)? */
+int armor_is_cleartext(const u8 *data, u32 len);
+
+/* read a cleartext signed message from src: its dash-escaped text is
+ * canonicalized as it streams past, hashed into ctx (which this sets
+ * up) and handed to out if given; the armored signature at the end is
+ * loaded into *signature.  the text is never held in memory */
+int armor_read_cleartext(struct source *src, struct rfc4880_verify_ctx *ctx,
+			 struct rsa_signature **signature,
+			 void (*out)(void *cookie, const u8 *data, u32 len),
+			 void *cookie);
+
+#endif
@@ -0,0 +1,945 @@
+/* benchmark.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "crypto.h"
+#include "stream.h"
+#include "armor.h"
+#include "inflate.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64 cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* ask the kernel to drop the file from the page cache */
+static void drop_cache(const char *fn)
+{
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static int load_read(const char *fn, struct rfc4880_verify_ctx *ctx)
+{
+	static u8 buf[64 * 1024];
+	ssize_t r;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		rfc4880_verify_update(ctx, buf, r);
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+static int load_mmap(const char *fn, struct rfc4880_verify_ctx *ctx,
+		     unsigned flags)
+{
+	struct file_map fm;
+
+	if (file_map_open(fn, &fm, flags))
+		return -1;
+	rfc4880_verify_update(ctx, fm.data, fm.size);
+	file_map_close(&fm);
+	return 0;
+}
+
+static int load_pipeline(const char *fn, struct rfc4880_verify_ctx *ctx)
+{
+	static u8 buf[64 * 1024];
+	struct source *src;
+	int fd, r;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	src = source_pipeline(fd, 4, 1024 * 1024);
+	if (!src) {
+		close(fd);
+		return -1;
+	}
+	while ((r = source_read(src, buf, sizeof(buf))) > 0)
+		rfc4880_verify_update(ctx, buf, r);
+	source_close(src);
+	close(fd);
+	return r;
+}
+
+#define LOAD_READ	0
+#define LOAD_MMAP	1
+#define LOAD_PIPELINE	2
+
+static struct {
+	const char *name;
+	int how;
+	unsigned flags;
+} load_modes[] = {
+	{ "read",          LOAD_READ,     0 },
+	{ "mmap",          LOAD_MMAP,     0 },
+	{ "mmap+populate", LOAD_MMAP,     FMAP_POPULATE },
+	{ "mmap+hugepage", LOAD_MMAP,     FMAP_HUGEPAGE },
+	{ "pipeline",      LOAD_PIPELINE, 0 },
+};
+
+/* time hashing a file through each input path, cold and warm cache */
+static int bench_load(const char *fn)
+{
+	struct rfc4880_verify_ctx ctx;
+	struct file_map fm;
+	double t0, t1;
+	int i, cold;
+	u64 size;
+
+	if (file_map_open(fn, &fm, 0)) {
+		fprintf(stderr,"cannot map '%s'\n", fn);
+		return -1;
+	}
+	size = fm.size;
+	file_map_close(&fm);
+
+	printf("load: %s, %llu bytes\n", fn, (unsigned long long) size);
+	for (i = 0; i < sizeof(load_modes) / sizeof(load_modes[0]); i++) {
+		for (cold = 1; cold >= 0; cold--) {
+			if (cold)
+				drop_cache(fn);
+			t0 = now();
+			rfc4880_verify_init(&ctx);
+			switch (load_modes[i].how) {
+			case LOAD_READ:
+				load_read(fn, &ctx);
+				break;
+			case LOAD_MMAP:
+				load_mmap(fn, &ctx, load_modes[i].flags);
+				break;
+			case LOAD_PIPELINE:
+				load_pipeline(fn, &ctx);
+				break;
+			}
+			t1 = now();
+			printf("  %-14s %-4s %8.3f s %8.1f MB/s\n",
+			       load_modes[i].name, cold ? "cold" : "warm",
+			       t1 - t0, size / (t1 - t0) / 1e6);
+		}
+	}
+	return 0;
+}
+
+/* sha1.c picks its transform at compile time */
+#if defined(HAVE_ENDIAN_H) && defined(HAVE_LITTLE_ENDIAN)
+#define SHA_KERNEL "bswap-unrolled"
+#else
+#define SHA_KERNEL "generic"
+#endif
+
+#define SHA_TRIALS	5
+#define SHA_MIN_BYTES	(16 * 1024 * 1024)	/* per trial */
+
+static const u32 sha_sizes[] = {
+	64, 1024, 64 * 1024, 16 * 1024 * 1024, 1024 * 1024 * 1024,
+};
+static const u32 sha_aligns[] = { 0, 1, 4, 8 };
+
+/* SHA_init + SHA_update + SHA_final over size bytes at each alignment,
+ * one warmup pass and SHA_TRIALS timed passes per point */
+static int bench_sha(const char *json, u64 max)
+{
+	double gbps[SHA_TRIALS], cpb[SHA_TRIALS];
+	unsigned i, j, t, iters;
+	FILE *out = 0;
+	u8 digest[SHA_DIGEST_SIZE];
+	u8 *buf, *p;
+	double t0, t1;
+	u64 c0, c1;
+	u32 size;
+	int first = 1;
+
+	if (json) {
+		out = fopen(json, "w");
+		if (!out) {
+			fprintf(stderr,"cannot write '%s'\n", json);
+			return -1;
+		}
+		fprintf(out, "{\n  \"kernel\": \"%s\",\n  \"tsc\": %s,\n"
+			"  \"sha\": [", SHA_KERNEL, cycles() ? "true" : "false");
+	}
+
+	printf("sha: kernel %s\n", SHA_KERNEL);
+	printf("  %10s %5s %8s %10s %10s %10s\n", "size", "align",
+	       "iters", "best GB/s", "med GB/s", "cyc/byte");
+	for (i = 0; i < sizeof(sha_sizes) / sizeof(sha_sizes[0]); i++) {
+		size = sha_sizes[i];
+		if (size > max)
+			continue;
+		buf = malloc(size + 64);
+		if (!buf) {
+			fprintf(stderr,"cannot allocate %lu bytes\n", size);
+			continue;
+		}
+		memset(buf, 0xa5, size + 64);
+		iters = SHA_MIN_BYTES / size;
+		if (iters == 0)
+			iters = 1;
+
+		for (j = 0; j < sizeof(sha_aligns) / sizeof(sha_aligns[0]); j++) {
+			/* one aligned pass is plenty for the largest sizes */
+			if (sha_aligns[j] && size > SHA_MIN_BYTES)
+				break;
+			p = buf + sha_aligns[j];
+
+			for (t = 0; t <= SHA_TRIALS; t++) {
+				unsigned n;
+				t0 = now();
+				c0 = cycles();
+				for (n = 0; n < iters; n++)
+					SHA(p, size, digest);
+				c1 = cycles();
+				t1 = now();
+				/* trial 0 is the warmup */
+				if (t == 0)
+					continue;
+				gbps[t - 1] = (double) size * iters / (t1 - t0) / 1e9;
+				cpb[t - 1] = (double) (c1 - c0) / size / iters;
+			}
+			qsort(gbps, SHA_TRIALS, sizeof(double), cmp_double);
+			qsort(cpb, SHA_TRIALS, sizeof(double), cmp_double);
+
+			printf("  %10lu %5lu %8u %10.3f %10.3f %10.2f\n",
+			       size, sha_aligns[j], iters,
+			       gbps[SHA_TRIALS - 1], gbps[SHA_TRIALS / 2],
+			       cpb[SHA_TRIALS / 2]);
+			if (out) {
+				fprintf(out, "%s\n    { \"size\": %lu, \"align\": %lu, "
+					"\"iters\": %u, \"trials\": %d, "
+					"\"best_gbps\": %.4f, \"median_gbps\": %.4f, "
+					"\"cycles_per_byte\": ",
+					first ? "" : ",", size, sha_aligns[j],
+					iters, SHA_TRIALS,
+					gbps[SHA_TRIALS - 1], gbps[SHA_TRIALS / 2]);
+				if (cycles())
+					fprintf(out, "%.3f }", cpb[SHA_TRIALS / 2]);
+				else
+					fprintf(out, "null }");
+				first = 0;
+			}
+		}
+		free(buf);
+	}
+
+	if (out) {
+		fprintf(out, "\n  ]\n}\n");
+		fclose(out);
+	}
+	return 0;
+}
+
+#define ARMOR_TRIALS 5
+
+/* base64 decode + CRC-24 check of mb MiB of armored data, and CRC-24
+ * on its own, best of ARMOR_TRIALS */
+static int bench_armor(u32 mb)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	u64 len = (u64) mb * 1024 * 1024, alen, olen, i;
+	u8 *data, *text, *p, *out;
+	double t0, t1, best_dec = 1e9, best_crc = 1e9;
+	u32 crc = 0, w, col = 0;
+	unsigned t;
+
+	len -= len % 3;
+	data = malloc(len);
+	text = malloc(len / 3 * 4 + len / 48 + 128);
+	if (!data || !text)
+		return -1;
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+
+	p = text + sprintf((char *) text, "-----BEGIN PGP MESSAGE-----\n\n");
+	for (i = 0; i < len; i += 3) {
+		w = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+		*p++ = digits[(w >> 18) & 63];
+		*p++ = digits[(w >> 12) & 63];
+		*p++ = digits[(w >> 6) & 63];
+		*p++ = digits[w & 63];
+		if (++col == 16) {
+			*p++ = '\n';
+			col = 0;
+		}
+	}
+	w = crc24(CRC24_INIT, data, len);
+	p += sprintf((char *) p, "\n=%c%c%c%c\n-----END PGP MESSAGE-----\n",
+		     digits[(w >> 18) & 63], digits[(w >> 12) & 63],
+		     digits[(w >> 6) & 63], digits[w & 63]);
+	alen = p - text;
+
+	for (t = 0; t < ARMOR_TRIALS; t++) {
+		t0 = now();
+		if (armor_decode(text, alen, &out, &olen)) {
+			fprintf(stderr,"armor decode failed\n");
+			return -1;
+		}
+		t1 = now();
+		if (olen != len || memcmp(out, data, len)) {
+			fprintf(stderr,"armor decode mismatch\n");
+			return -1;
+		}
+		free(out);
+		if (t1 - t0 < best_dec)
+			best_dec = t1 - t0;
+
+		t0 = now();
+		crc ^= crc24(CRC24_INIT, data, len);
+		t1 = now();
+		if (t1 - t0 < best_crc)
+			best_crc = t1 - t0;
+	}
+
+	printf("armor: %lu MiB\n", mb);
+	printf("  decode+crc      %8.3f GB/s of text\n", alen / best_dec / 1e9);
+	printf("  crc24           %8.3f GB/s (%06lx)\n", len / best_crc / 1e9,
+	       crc & 0xffffff);
+
+	free(text);
+	free(data);
+	return 0;
+}
+
+#define INFLATE_TRIALS 3
+
+/* just enough of a deflate encoder to feed the inflate benchmark: greedy
+ * LZ77 with a one-entry hash and the fixed Huffman codes (rfc1951 3.2.6) */
+struct deflate_out {
+	u8 *p;
+	u64 bitbuf;
+	unsigned bitcnt;
+};
+
+static void put_bits(struct deflate_out *d, u32 val, unsigned n)
+{
+	d->bitbuf |= (u64) val << d->bitcnt;
+	d->bitcnt += n;
+	while (d->bitcnt >= 8) {
+		*d->p++ = d->bitbuf;
+		d->bitbuf >>= 8;
+		d->bitcnt -= 8;
+	}
+}
+
+/* Huffman codes go out most significant bit first */
+static void put_code(struct deflate_out *d, u32 code, unsigned n)
+{
+	u32 rev = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		rev |= ((code >> i) & 1) << (n - 1 - i);
+	put_bits(d, rev, n);
+}
+
+static void put_symbol(struct deflate_out *d, unsigned sym)
+{
+	if (sym < 144)
+		put_code(d, 0x30 + sym, 8);
+	else if (sym < 256)
+		put_code(d, 0x190 + sym - 144, 9);
+	else if (sym < 280)
+		put_code(d, sym - 256, 7);
+	else
+		put_code(d, 0xc0 + sym - 280, 8);
+}
+
+static void put_match(struct deflate_out *d, unsigned len, unsigned dist)
+{
+	static const u16 lbase[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const u8 lextra[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const u16 dbase[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577 };
+	static const u8 dextra[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	unsigned i = 28, j = 29;
+
+	while (lbase[i] > len)
+		i--;
+	put_symbol(d, 257 + i);
+	put_bits(d, len - lbase[i], lextra[i]);
+	while (dbase[j] > dist)
+		j--;
+	put_code(d, j, 5);
+	put_bits(d, dist - dbase[j], dextra[j]);
+}
+
+/* compress data[0:len] into a single fixed-code block, returning its size */
+static u64 deflate_fixed(const u8 *data, u64 len, u8 *out)
+{
+	struct deflate_out d = { out, 0, 0 };
+	u32 *head = calloc(1 << 15, sizeof(u32));
+	u64 i = 0, m;
+	u32 h, cand;
+
+	put_bits(&d, 1 | (1 << 1), 3); /* final block, fixed codes */
+	while (i < len) {
+		if (i + 3 <= len) {
+			h = ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2])
+				& 0x7fff;
+			cand = head[h];
+			head[h] = i + 1;
+			if (cand && i + 1 - cand <= 32768) {
+				cand--;
+				for (m = 0; m < 258 && i + m < len &&
+					     data[cand + m] == data[i + m]; m++)
+					;
+				if (m >= 3) {
+					put_match(&d, m, i - cand);
+					i += m;
+					continue;
+				}
+			}
+		}
+		put_symbol(&d, data[i++]);
+	}
+	put_symbol(&d, 256);
+	put_bits(&d, 0, 7);
+	free(head);
+	return d.p - out;
+}
+
+struct mem_source {
+	struct source src;
+	const u8 *data;
+	u64 left;
+};
+
+static int mem_read(struct source *src, u8 *buf, u32 len)
+{
+	struct mem_source *ms = (struct mem_source *) src;
+
+	if (len > ms->left)
+		len = ms->left;
+	memcpy(buf, ms->data, len);
+	ms->data += len;
+	ms->left -= len;
+	return len;
+}
+
+static void mem_close(struct source *src)
+{
+	free(src);
+}
+
+static struct source *source_mem(const u8 *data, u64 len)
+{
+	struct mem_source *ms = malloc(sizeof(*ms));
+
+	ms->src.read = mem_read;
+	ms->src.close = mem_close;
+	ms->data = data;
+	ms->left = len;
+	return &ms->src;
+}
+
+/* inflate and hash a stream, optionally with the inflate on its own
+ * thread (as rfc4880_read_inline does); returns seconds, or -1 */
+static double inflate_hash(const u8 *z, u64 zlen, u64 len, int hash,
+			   int threaded, u8 *digest)
+{
+	struct source *src;
+	SHA_CTX ctx;
+	u8 *buf = malloc(65536);
+	u64 total = 0;
+	double t0;
+	int r;
+
+	t0 = now();
+	src = source_inflate(source_mem(z, zlen), INFLATE_RAW);
+	if (threaded)
+		src = source_thread(src, 4, 65536);
+	SHA_init(&ctx);
+	while ((r = source_read(src, buf, 65536)) > 0) {
+		if (hash)
+			SHA_update(&ctx, buf, r);
+		total += r;
+	}
+	source_close(src);
+	t0 = now() - t0;
+	free(buf);
+	if (r < 0 || total != len)
+		return -1;
+	if (hash)
+		memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+	return t0;
+}
+
+/* inflate on its own, SHA-1 on its own, and the two together, serially
+ * and overlapped on two threads, over mb MiB of compressible text */
+static int bench_inflate(u32 mb)
+{
+	static const char *words[] = {
+		"the", "signature", "packet", "of", "a", "key", "and", "is",
+		"to", "message", "data", "with", "hash", "public", "in",
+		"literal", "which", "compressed", "trust", "for", "subkey",
+	};
+	u64 len = (u64) mb * 1024 * 1024, zlen, i = 0;
+	double best[4] = { 1e9, 1e9, 1e9, 1e9 }, t;
+	u8 digest[SHA_DIGEST_SIZE], ref[SHA_DIGEST_SIZE], *data, *z;
+	const char *w;
+	SHA_CTX ctx;
+	unsigned k, col = 0;
+
+	data = malloc(len);
+	z = malloc(len + len / 4 + 64);
+	if (!data || !z)
+		return -1;
+	while (i < len) {
+		w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+		while (*w && i < len)
+			data[i++] = *w++;
+		if (i < len)
+			data[i++] = (col += 8) > 64 ? (col = 0, '\n') : ' ';
+	}
+	zlen = deflate_fixed(data, len, z);
+
+	for (k = 0; k < INFLATE_TRIALS; k++) {
+		t = inflate_hash(z, zlen, len, 0, 0, digest);
+		if (t < 0) {
+			fprintf(stderr,"inflate failed\n");
+			return -1;
+		}
+		if (t < best[0])
+			best[0] = t;
+
+		t = now();
+		SHA_init(&ctx);
+		SHA_update(&ctx, data, len);
+		memcpy(ref, SHA_final(&ctx), SHA_DIGEST_SIZE);
+		t = now() - t;
+		if (t < best[1])
+			best[1] = t;
+
+		if ((t = inflate_hash(z, zlen, len, 1, 0, digest)) < 0 ||
+		    memcmp(digest, ref, SHA_DIGEST_SIZE)) {
+			fprintf(stderr,"inflate mismatch\n");
+			return -1;
+		}
+		if (t < best[2])
+			best[2] = t;
+
+		if ((t = inflate_hash(z, zlen, len, 1, 1, digest)) < 0 ||
+		    memcmp(digest, ref, SHA_DIGEST_SIZE)) {
+			fprintf(stderr,"threaded inflate mismatch\n");
+			return -1;
+		}
+		if (t < best[3])
+			best[3] = t;
+	}
+
+	printf("inflate: %lu MiB text, %.1f%% compressed\n", mb,
+	       100.0 * zlen / len);
+	printf("  inflate         %8.3f GB/s\n", len / best[0] / 1e9);
+	printf("  sha1            %8.3f GB/s\n", len / best[1] / 1e9);
+	printf("  inflate+sha1    %8.3f GB/s serial\n", len / best[2] / 1e9);
+	printf("  inflate+sha1    %8.3f GB/s overlapped\n", len / best[3] / 1e9);
+
+	free(z);
+	free(data);
+	return 0;
+}
+
+/* synthesize count 2048-bit v4 RSA public key packets */
+static u8 *make_keys(u32 count, u64 *len)
+{
+	u32 plen = 6 + 2 + 256 + 2 + 3;
+	u8 *data, *p;
+	u32 n, i;
+
+	data = malloc((u64) count * (plen + 3));
+	if (!data)
+		return 0;
+
+	p = data;
+	for (n = 0; n < count; n++) {
+		*p++ = 0x99;
+		*p++ = plen >> 8;
+		*p++ = plen;
+		*p++ = 4;
+		*p++ = n >> 24;
+		*p++ = n >> 16;
+		*p++ = n >> 8;
+		*p++ = n;
+		*p++ = 1;
+		*p++ = 2048 >> 8;
+		*p++ = 2048 & 0xff;
+		for (i = 0; i < 256; i++)
+			*p++ = rand();
+		p[-256] |= 0x80;
+		*p++ = 0;
+		*p++ = 17;
+		*p++ = 0x01;
+		*p++ = 0x00;
+		*p++ = 0x01;
+	}
+	*len = p - data;
+	return data;
+}
+
+#define KEYRING_LOOKUPS 1000000
+
+#define KEYCACHE_FILE "bench.keycache"
+#define PREPARE_KEYS 1000
+
+/* what the prepared key cache buys: per-key rsa_prepare on first use
+ * against borrowing the same key straight out of a mapped cache */
+static void bench_keycache(struct keyring *kr, u32 count)
+{
+	struct rsa_prepared_key prepared;
+	struct rsa_signature signature;
+	struct keyring_key *key;
+	struct keycache *kc;
+	double t0, t1;
+	u32 n, hits;
+
+	t0 = now();
+	for (n = 0; n < PREPARE_KEYS; n++) {
+		key = keyring_get(kr, (n * 2654435761u) % count);
+		if (rsa_prepare(&prepared, &key->public) == 0)
+			rsa_prepared_clear(&prepared);
+	}
+	t1 = now();
+	printf("  rsa_prepare     %8.0f ns/key\n",
+	       (t1 - t0) * 1e9 / PREPARE_KEYS);
+
+	t0 = now();
+	if (keycache_write(KEYCACHE_FILE, kr, 0)) {
+		fprintf(stderr,"keycache write failed\n");
+		return;
+	}
+	t1 = now();
+	printf("  cache write     %8.3f s\n", t1 - t0);
+
+	t0 = now();
+	kc = keycache_open(KEYCACHE_FILE, 0);
+	t1 = now();
+	unlink(KEYCACHE_FILE);
+	if (!kc || keycache_count(kc) != count) {
+		fprintf(stderr,"keycache open failed\n");
+		keycache_close(kc);
+		return;
+	}
+	printf("  cache open      %8.0f ns\n", (t1 - t0) * 1e9);
+
+	memset(&signature, 0, sizeof(signature));
+	signature.has_issuer_fpr = 1;
+	t0 = now();
+	for (n = hits = 0; n < KEYRING_LOOKUPS; n++) {
+		key = keyring_get(kr, (n * 2654435761u) % count);
+		memcpy(signature.issuer_fpr, key->fingerprint, 20);
+		hits += keycache_find_signer(kc, &signature, &prepared) == 0 &&
+			prepared.n_sz == key->public.n_sz;
+	}
+	t1 = now();
+	printf("  cache signer    %8.0f ns/lookup (%lu/%d hits)\n",
+	       (t1 - t0) * 1e9 / KEYRING_LOOKUPS, hits, KEYRING_LOOKUPS);
+
+	keycache_close(kc);
+}
+
+/* keyring indexing time and lookup cost by key ID and fingerprint */
+static int bench_keyring(u32 count)
+{
+	struct keyring_key *key;
+	struct keyring *kr;
+	u8 keyid[8], *data;
+	double t0, t1;
+	u32 n, hits;
+	u64 len;
+
+	data = make_keys(count, &len);
+	if (!data)
+		return -1;
+
+	t0 = now();
+	kr = keyring_load(data, len);
+	t1 = now();
+	if (!kr || keyring_count(kr) != count) {
+		fprintf(stderr,"keyring load failed\n");
+		return -1;
+	}
+	printf("keyring: %lu keys\n", count);
+	printf("  load+index      %8.3f s %8.0f ns/key\n",
+	       t1 - t0, (t1 - t0) * 1e9 / count);
+
+	t0 = now();
+	for (n = hits = 0; n < KEYRING_LOOKUPS; n++) {
+		key = keyring_get(kr, (n * 2654435761u) % count);
+		hits += keyring_find_keyid(kr, key->keyid) == key;
+	}
+	t1 = now();
+	printf("  find by keyid   %8.0f ns/lookup (%lu/%d hits)\n",
+	       (t1 - t0) * 1e9 / KEYRING_LOOKUPS, hits, KEYRING_LOOKUPS);
+
+	t0 = now();
+	for (n = hits = 0; n < KEYRING_LOOKUPS; n++) {
+		key = keyring_get(kr, (n * 2654435761u) % count);
+		hits += keyring_find_fingerprint(kr, key->fingerprint) == key;
+	}
+	t1 = now();
+	printf("  find by fpr     %8.0f ns/lookup (%lu/%d hits)\n",
+	       (t1 - t0) * 1e9 / KEYRING_LOOKUPS, hits, KEYRING_LOOKUPS);
+
+	t0 = now();
+	for (n = hits = 0; n < KEYRING_LOOKUPS; n++) {
+		memset(keyid, 0, 8);
+		memcpy(keyid, &n, sizeof(n));
+		hits += keyring_find_keyid(kr, keyid) != 0;
+	}
+	t1 = now();
+	printf("  miss by keyid   %8.0f ns/lookup (%lu false hits)\n",
+	       (t1 - t0) * 1e9 / KEYRING_LOOKUPS, hits);
+
+	bench_keycache(kr, count);
+
+	keyring_free(kr);
+	free(data);
+	return 0;
+}
+
+#define RSA_SIGNED 16
+#define RSA_MAX_BATCH 1024
+#define RSA_MIN_TIME 0.2
+
+static const u32 rsa_batches[] = { 1, 8, 64, 1024 };
+
+/* seconds per signature for rounds of batch checks by method: 0 one
+ * rsa_verify each, 1 rsa_verify_prepared with the key prepared once,
+ * 2 rsa_verify_batch */
+static double rsa_round(int method, u32 batch, struct rsa_public_key **keys,
+			const u8 **digests, const u8 **sigs, const u32 *slens,
+			u8 *ok)
+{
+	struct rsa_prepared_key prepared;
+	double t0, t;
+	u32 n, rounds = 0, good = 0;
+
+	if (method == 1 && rsa_prepare(&prepared, keys[0]))
+		return -1;
+	t0 = now();
+	do {
+		switch (method) {
+		case 0:
+			for (n = 0; n < batch; n++)
+				good += !rsa_verify(keys[n], digests[n], sigs[n],
+						    slens[n]);
+			break;
+		case 1:
+			for (n = 0; n < batch; n++)
+				good += !rsa_verify_prepared(&prepared, digests[n],
+							     sigs[n], slens[n]);
+			break;
+		default:
+			good += rsa_verify_batch(keys, digests, sigs, slens,
+						 batch, ok);
+			break;
+		}
+		rounds++;
+		t = now() - t0;
+	} while (t < RSA_MIN_TIME);
+	if (method == 1)
+		rsa_prepared_clear(&prepared);
+	if (good != rounds * batch) {
+		fprintf(stderr,"rsa: %lu of %lu failed\n",
+			rounds * batch - good, rounds * batch);
+		return -1;
+	}
+	return t / (rounds * batch);
+}
+
+/* signature checks one at a time against rsa_verify_batch, for batches
+ * of signatures by one key made with the private key in fn, whatever
+ * its size */
+static int bench_rsa(const char *fn)
+{
+	struct rsa_private_key *private = 0;
+	struct rsa_public_key *public = 0;
+	struct rsa_public_key *keys[RSA_MAX_BATCH];
+	const u8 *digests[RSA_MAX_BATCH], *sigs[RSA_MAX_BATCH];
+	u32 slens[RSA_MAX_BATCH], n, i;
+	u8 digest[RSA_SIGNED][SHA_DIGEST_SIZE], bad[SHA_DIGEST_SIZE];
+	u8 *sig[RSA_SIGNED], ok[RSA_MAX_BATCH / 8], *data, *mem;
+	double t[3];
+	u32 len;
+	int m, r;
+
+	data = load_file(fn, &len);
+	if (!data || rfc4880_load_private_key(data, len, &private, &public)) {
+		fprintf(stderr,"cannot load private key '%s'\n", fn);
+		return -1;
+	}
+	mem = malloc(RSA_SIGNED * public->n_sz);
+	if (!mem)
+		return -1;
+	for (n = 0; n < RSA_SIGNED; n++) {
+		for (i = 0; i < SHA_DIGEST_SIZE; i++)
+			digest[n][i] = rand();
+		sig[n] = mem + n * public->n_sz;
+		if (rsa_sign(private, digest[n], sig[n])) {
+			fprintf(stderr,"rsa_sign failed\n");
+			return -1;
+		}
+	}
+	for (n = 0; n < RSA_MAX_BATCH; n++) {
+		keys[n] = public;
+		digests[n] = digest[n % RSA_SIGNED];
+		sigs[n] = sig[n % RSA_SIGNED];
+		slens[n] = public->n_sz;
+	}
+
+	/* every good one passes, and only those */
+	memcpy(bad, digest[0], SHA_DIGEST_SIZE);
+	bad[0] ^= 1;
+	digests[5] = bad;
+	r = rsa_verify_batch(keys, digests, sigs, slens, RSA_MAX_BATCH, ok);
+	digests[5] = digest[5];
+	if (r != RSA_MAX_BATCH - 1 || (ok[0] & 0x20) || ok[0] != 0xdf) {
+		fprintf(stderr,"rsa_verify_batch: wrong results\n");
+		return -1;
+	}
+
+	printf("rsa: %lu-bit key, us per signature\n", public->n_sz * 8);
+	printf("  batch  rsa_verify   prepared      batch  vs prepared\n");
+	for (n = 0; n < sizeof(rsa_batches) / sizeof(rsa_batches[0]); n++) {
+		for (m = 0; m < 3; m++) {
+			t[m] = rsa_round(m, rsa_batches[n], keys, digests, sigs,
+					 slens, ok);
+			if (t[m] < 0)
+				return -1;
+		}
+		/* against the best one at a time: a key prepared once */
+		printf("  %5lu  %10.1f  %9.1f  %9.1f  %10.2fx\n",
+		       rsa_batches[n], t[0] * 1e6, t[1] * 1e6, t[2] * 1e6,
+		       t[1] / t[2]);
+	}
+
+	free(mem);
+	free(private);
+	free(public);
+	free(data);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: benchmark load <file>\n"
+		"       benchmark sha [-o <json>] [-m <max-size>]\n"
+		"       benchmark keyring <count>\n"
+		"       benchmark armor <mb>\n"
+		"       benchmark inflate <mb>\n"
+		"       benchmark rsa <private-key>...\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *json = 0;
+	u64 max = ~0ULL;
+	int i;
+
+	if (argc == 3 && !strcmp(argv[1], "load"))
+		return bench_load(argv[2]);
+
+	if (argc == 3 && !strcmp(argv[1], "keyring") && atoi(argv[2]) > 0)
+		return bench_keyring(strtoul(argv[2], 0, 0));
+
+	if (argc == 3 && !strcmp(argv[1], "armor") && atoi(argv[2]) > 0)
+		return bench_armor(strtoul(argv[2], 0, 0));
+
+	if (argc == 3 && !strcmp(argv[1], "inflate") && atoi(argv[2]) > 0)
+		return bench_inflate(strtoul(argv[2], 0, 0));
+
+	if (argc >= 3 && !strcmp(argv[1], "rsa")) {
+		for (i = 2; i < argc; i++)
+			if (bench_rsa(argv[i]))
+				return -1;
+		return 0;
+	}
+
+	if (argc >= 2 && !strcmp(argv[1], "sha")) {
+		for (i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "-o") && i + 1 < argc)
+				json = argv[++i];
+			else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+				max = strtoull(argv[++i], 0, 0);
+			else
+				goto fail;
+		}
+		return bench_sha(json, max);
+	}
+
+fail:
+	usage();
+	return -1;
+}
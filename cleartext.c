@@ -0,0 +1,320 @@
+/* cleartext.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "armor.h"
+#include "diag.h"
+#include "rfc4880.h"
+
+/* rfc4880 7: the cleartext signature framework */
+
+#define CLEARTEXT_BUF (64 * 1024)
+
+/* enough to tell a dash-escaped line from the signature's header */
+#define CLEARTEXT_LOOKAHEAD 64
+
+/* largest armored signature we are willing to decode */
+#define MAX_SIGNATURE (1024 * 1024)
+
+/* most blanks we hold back at the end of a line before it goes on; more
+ * than this and the message is refused rather than held in memory */
+#define MAX_BLANKS (64 * 1024)
+
+#define CLEARTEXT_BEGIN "-----BEGIN PGP SIGNED MESSAGE-----"
+#define SIGNATURE_BEGIN "-----BEGIN PGP SIGNATURE-----"
+
+static int starts(const u8 *line, u32 len, const char *prefix)
+{
+	u32 n = strlen(prefix);
+	return len >= n && !memcmp(line, prefix, n);
+}
+
+struct cleartext {
+	struct source *src;
+	struct rfc4880_verify_ctx *ctx;
+	void (*out)(void *cookie, const u8 *data, u32 len);
+	void *cookie;
+	u8 *buf;
+	u32 pos, end;
+	int eof;
+	u8 *blanks; /* trailing blanks held back until the line goes on */
+	u32 nblanks;
+	u32 max_blanks;
+};
+
+int armor_is_cleartext(const u8 *data, u32 len)
+{
+	return starts(data, len, CLEARTEXT_BEGIN);
+}
+
+static void emit(struct cleartext *ct, const u8 *data, u32 len)
+{
+	if (len == 0)
+		return;
+	rfc4880_verify_update(ct->ctx, data, len);
+	if (ct->out)
+		ct->out(ct->cookie, data, len);
+}
+
+static int hold(struct cleartext *ct, const u8 *data, u32 len)
+{
+	u32 max = ct->max_blanks;
+	u8 *p;
+
+	if (len > MAX_BLANKS - ct->nblanks) {
+		diag("too much trailing whitespace in cleartext line");
+		return -1;
+	}
+	while (ct->nblanks + len > max)
+		max = max ? max * 2 : 256;
+	if (max != ct->max_blanks) {
+		p = realloc(ct->blanks, max);
+		if (!p)
+			return -1;
+		ct->blanks = p;
+		ct->max_blanks = max;
+	}
+	memcpy(ct->blanks + ct->nblanks, data, len);
+	ct->nblanks += len;
+	return 0;
+}
+
+/* have at least want bytes buffered, unless the input ends first */
+static int ct_fill(struct cleartext *ct, u32 want)
+{
+	int r;
+
+	if (ct->end - ct->pos >= want || ct->eof)
+		return 0;
+	memmove(ct->buf, ct->buf + ct->pos, ct->end - ct->pos);
+	ct->end -= ct->pos;
+	ct->pos = 0;
+	while (ct->end < want && !ct->eof) {
+		r = source_read(ct->src, ct->buf + ct->end,
+				CLEARTEXT_BUF - ct->end);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			ct->eof = 1;
+		ct->end += r;
+	}
+	return 0;
+}
+
+/* the next whole line, for the armor headers: 1 if found, 0 at end */
+static int ct_line(struct cleartext *ct, const u8 **line, u32 *len)
+{
+	u8 *p, *nl;
+	u32 n;
+
+	for (;;) {
+		p = ct->buf + ct->pos;
+		n = ct->end - ct->pos;
+		nl = memchr(p, '\n', n);
+		if (nl || ct->eof)
+			break;
+		if (n == CLEARTEXT_BUF) {
+			diag("armor header line too long");
+			return -1;
+		}
+		if (ct_fill(ct, n + 1))
+			return -1;
+	}
+	if (!nl && n == 0)
+		return 0;
+	*line = p;
+	*len = nl ? nl - p : n;
+	ct->pos += nl ? *len + 1 : n;
+	return 1;
+}
+
+static int is_blank(u8 c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* hash the dash-escaped text up to the signature: escapes and trailing
+ * blanks are dropped, lines are joined with CR LF and the last line
+ * ending belongs to the signature's armor rather than the text */
+static int ct_text(struct cleartext *ct)
+{
+	u8 *p, *e, *q, *nl;
+	int first = 1;
+
+	for (;;) {
+		if (ct_fill(ct, CLEARTEXT_LOOKAHEAD))
+			return -1;
+		p = ct->buf + ct->pos;
+		if (ct->pos == ct->end) {
+			diag("missing signature");
+			return -1;
+		}
+		if (starts(p, ct->end - ct->pos, SIGNATURE_BEGIN))
+			return 0;
+		if (starts(p, ct->end - ct->pos, "- "))
+			ct->pos += 2;
+
+		if (!first)
+			emit(ct, (const u8 *) "\r\n", 2);
+		first = 0;
+		ct->nblanks = 0;
+
+		/* the rest of the line, a buffer at a time */
+		for (;;) {
+			p = ct->buf + ct->pos;
+			e = ct->buf + ct->end;
+			nl = memchr(p, '\n', e - p);
+			q = nl ? nl : e;
+			while (q > p && is_blank(q[-1]))
+				q--;
+			if (q > p) {
+				emit(ct, ct->blanks, ct->nblanks);
+				ct->nblanks = 0;
+				emit(ct, p, q - p);
+			}
+			if (nl) {
+				ct->pos = nl + 1 - ct->buf;
+				break;
+			}
+			if (hold(ct, q, e - q))
+				return -1;
+			ct->pos = ct->end;
+			if (ct_fill(ct, 1))
+				return -1;
+			if (ct->pos == ct->end) {
+				diag("missing signature");
+				return -1;
+			}
+		}
+	}
+}
+
+/* decode the armored signature that follows the text */
+static int ct_signature(struct cleartext *ct, struct rsa_signature **signature)
+{
+	struct armor a;
+	u32 have = 0, n;
+	u8 *sig;
+	int r = -1;
+
+	sig = malloc(MAX_SIGNATURE);
+	if (!sig)
+		return -1;
+	armor_init(&a);
+	for (;;) {
+		while (ct->pos < ct->end) {
+			r = armor_decode_chunk(&a, ct->buf + ct->pos,
+					       ct->end - ct->pos, sig + have,
+					       MAX_SIGNATURE - have, &n);
+			if (r < 0)
+				goto done;
+			if (r == 0) {
+				diag("signature too large");
+				r = -1;
+				goto done;
+			}
+			ct->pos += r;
+			have += n;
+		}
+		if (ct->eof)
+			break;
+		r = -1;
+		if (ct_fill(ct, 1))
+			goto done;
+	}
+	r = -1;
+	if (armor_finish(&a))
+		goto done;
+	r = rfc4880_load_signature(sig, have, signature);
+done:
+	free(sig);
+	return r;
+}
+
+int armor_read_cleartext(struct source *src, struct rfc4880_verify_ctx *ctx,
+			 struct rsa_signature **signature,
+			 void (*out)(void *cookie, const u8 *data, u32 len),
+			 void *cookie)
+{
+	struct cleartext ct;
+	const u8 *line;
+	u32 len;
+	int r = -1;
+
+	*signature = 0;
+	memset(&ct, 0, sizeof(ct));
+	ct.src = src;
+	ct.ctx = ctx;
+	ct.out = out;
+	ct.cookie = cookie;
+	ct.buf = malloc(CLEARTEXT_BUF);
+	if (!ct.buf)
+		return -1;
+
+	/* the header line, then Hash: headers up to a blank line; the
+	 * signature says which hash it used, so they are not needed */
+	while ((r = ct_line(&ct, &line, &len)) > 0)
+		if (starts(line, len, CLEARTEXT_BEGIN))
+			break;
+	while (r > 0 && (r = ct_line(&ct, &line, &len)) > 0) {
+		while (len > 0 && is_blank(line[len - 1]))
+			len--;
+		if (len == 0)
+			break;
+	}
+	if (r <= 0) {
+		if (r == 0)
+			diag("malformed cleartext signed message");
+		r = -1;
+		goto done;
+	}
+
+	/* the text is canonical by the time it reaches the hash */
+	rfc4880_verify_init(ctx);
+	r = ct_text(&ct);
+	if (r == 0)
+		r = ct_signature(&ct, signature);
+	if (r == 0 && (*signature)->type != SIG_CANONICAL_TEXT_DOC) {
+		/* rfc4880 7: the text was hashed as text, whatever the
+		 * signature says */
+		diag("cleartext signature is not a text signature");
+		free(*signature);
+		*signature = 0;
+		r = -1;
+	}
+
+done:
+	free(ct.blanks);
+	free(ct.buf);
+	return r;
+}
@@ -31,9 +31,14 @@
 #ifndef _CRYPTO_H_
 #define _CRYPTO_H_
 
+#include "sha1.h"
+#include "imath.h"
+#include "montkey.h"
+
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned long u32;
+typedef unsigned long long u64;
 
 struct rsa_public_key {
 	u32 n_sz;
@@ -53,11 +58,21 @@ struct rsa_signature {
 	u32 s_sz;
 	u32 h_sz;
 	u32 left16;
+	u32 type; /* SIG_BINARY_DOC, SIG_CANONICAL_TEXT_DOC, ... */
 	u8 *s; /* signature */
-	u8 *h; /* extra hash data */
+	u8 *h; /* hashed signature header and subpackets */
+	u8 trailer[6]; /* v4 hash trailer, hashed after h */
+
+	/* from the subpackets, where present */
+	u32 created; /* creation time, 0 if unknown */
+	u32 expires; /* seconds after creation, 0 for never */
+	int has_issuer;
+	int has_issuer_fpr;
+	u8 issuer[8]; /* key ID of the signing key */
+	u8 issuer_fpr[20];
 };
 
-/* load from byte array */
+/* load from byte array, binary or ASCII armored */
 int rfc4880_load_public_key(u8 *data, u32 len,
 			    struct rsa_public_key **public);
 int rfc4880_load_private_key(u8 *data, u32 len,
@@ -66,7 +81,14 @@ int rfc4880_load_private_key(u8 *data, u32 len,
 int rfc4880_load_signature(u8 *data, u32 len,
 			   struct rsa_signature **signature);
 
-/* read from file */
+/* borrowed views: n, e, s and h point into data, which must outlive
+ * the view; nothing is allocated or copied, so data must be binary */
+int rfc4880_view_public_key(u8 *data, u32 len,
+			    struct rsa_public_key *public);
+int rfc4880_view_signature(u8 *data, u32 len,
+			   struct rsa_signature *signature);
+
+/* read from file, binary or ASCII armored */
 int rfc4880_open_public_key(const char *fn,
 			    struct rsa_public_key **public);
 int rfc4880_open_signature(const char *fn,
@@ -77,7 +99,104 @@ int rfc4880_verify(u8 *data, u32 len,
 		   struct rsa_public_key *public,
 		   struct rsa_signature *signature);
 
-/* create signature for digest */
+/* hash data[0:len] into ctx, producing a midstate that can be checked
+ * against any number of signatures over the same message */
+void rfc4880_hash_message(SHA_CTX *ctx, u8 *data, u32 len);
+
+/* verify a message midstate against signature (0=verified)
+ * ctx is not modified, so it may be reused for further signatures */
+int rfc4880_verify_midstate(const SHA_CTX *ctx,
+			    struct rsa_public_key *public,
+			    struct rsa_signature *signature);
+
+/* incremental verification for messages too large to hold in memory:
+ * feed the message through update in pieces of any size, then check
+ * it against one or more signatures with final (0=verified) */
+struct rfc4880_verify_ctx {
+	SHA_CTX sha;
+	int text; /* canonical text: line endings are hashed as CR LF */
+	int cr;   /* text: the last byte seen was a CR */
+};
+
+void rfc4880_verify_init(struct rfc4880_verify_ctx *ctx);
+
+/* for SIG_CANONICAL_TEXT_DOC signatures */
+void rfc4880_verify_init_text(struct rfc4880_verify_ctx *ctx);
+void rfc4880_verify_update(struct rfc4880_verify_ctx *ctx,
+			   const u8 *data, u64 len);
+int rfc4880_verify_final(const struct rfc4880_verify_ctx *ctx,
+			 struct rsa_public_key *public,
+			 struct rsa_signature *signature);
+
+/* read all of fd (from its current offset if it is not a regular file)
+ * once, feeding it to each of the n initialized contexts; large files
+ * are read ahead.  a regular file is read up to its size when called,
+ * and fails if it turns out shorter */
+int rfc4880_hash_fd(int fd, struct rfc4880_verify_ctx **ctx, int n,
+		    unsigned flags);
+
+/* hash small files in place through a mapping.  faster, but a file that
+ * is truncated meanwhile raises SIGBUS: only for files we trust */
+#define HASH_FD_MAP	1
+
+struct source;
+
+/* read a message that carries its own signature from src, binary or
+ * armored: one-pass signed (rfc4880 11.3: one-pass signature, literal
+ * data, signature), possibly compressed, or cleartext signed (rfc4880 7).  the signed data
+ * is hashed as it streams past and each piece of it is handed to out,
+ * if given; the payload is never held in memory.  on success (0) ctx
+ * holds the message midstate for rfc4880_verify_final or
+ * rfc4880_verify_keyring and *signature the trailing signature */
+int rfc4880_read_inline(struct source *src, struct rfc4880_verify_ctx *ctx,
+			struct rsa_signature **signature,
+			void (*out)(void *cookie, const u8 *data, u32 len),
+			void *cookie);
+
+/* a set of public keys and subkeys indexed by key ID and fingerprint */
+struct keyring_key {
+	struct rsa_public_key public; /* borrowed view into the keyring data */
+	u8 fingerprint[SHA_DIGEST_SIZE];
+	u8 keyid[8]; /* low 64 bits of the fingerprint */
+	int subkey;
+};
+
+struct keyring;
+
+/* index every RSA key and subkey in the binary packets data[0:len];
+ * data must outlive the keyring */
+struct keyring *keyring_load(u8 *data, u64 len);
+
+/* map a keyring file and index it (armored keyrings are decoded) */
+struct keyring *keyring_open(const char *fn);
+
+void keyring_free(struct keyring *kr);
+
+u32 keyring_count(struct keyring *kr);
+struct keyring_key *keyring_get(struct keyring *kr, u32 n);
+
+/* O(1) lookups, returning 0 if there is no such key */
+struct keyring_key *keyring_find_keyid(struct keyring *kr, const u8 *keyid);
+struct keyring_key *keyring_find_fingerprint(struct keyring *kr,
+					     const u8 *fingerprint);
+
+/* the key that made signature, from its issuer fingerprint or key ID,
+ * or 0 if the signature does not say or the key is not in the ring */
+struct keyring_key *keyring_find_signer(struct keyring *kr,
+					struct rsa_signature *signature);
+
+/* work out every key's bignums up front (rsa_prepare), so that each
+ * rfc4880_verify_keyring need not; the ring is read-only afterwards and
+ * may be used from any number of threads at once */
+int keyring_prepare(struct keyring *kr);
+
+/* verify a message midstate against signature with whichever key in
+ * the ring made it (0=verified) */
+int rfc4880_verify_keyring(const struct rfc4880_verify_ctx *ctx,
+			   struct keyring *kr,
+			   struct rsa_signature *signature);
+
+/* create signature for digest, as many bytes as the modulus has */
 int rsa_sign(struct rsa_private_key *private,
 	     const u8 *digest, u8 *signature_out);
 
@@ -85,7 +204,132 @@ int rsa_sign(struct rsa_private_key *private,
 int rsa_verify(struct rsa_public_key *public,
 	       const u8 *digest, const u8 *signature, u32 slen);
 
+/* check count (key, digest, signature) triples at once, setting bit i
+ * (i % 8 of byte i / 8) of ok for each one that verifies.  items are
+ * grouped by key, so each distinct key is set up once, and a group's
+ * exponentiations run MONT_LANES at a time (see mont.h).  returns how
+ * many verified, or -1 if out of memory */
+int rsa_verify_batch(struct rsa_public_key **keys, const u8 **digests,
+		     const u8 **signatures, const u32 *slens,
+		     u32 count, u8 *ok);
+
+/* a public key with its Montgomery constants worked out once; read-only
+ * after rsa_prepare, so it may be shared between threads.  borrowed
+ * keys have limbs owned by someone else (keycache) */
+struct rsa_prepared_key {
+	u32 n_sz;
+	int borrowed;
+	struct mont mont;
+};
+
+int rsa_prepare(struct rsa_prepared_key *key, struct rsa_public_key *public);
+void rsa_prepared_clear(struct rsa_prepared_key *key);
+int rsa_verify_prepared(struct rsa_prepared_key *key,
+			const u8 *digest, const u8 *signature, u32 slen);
+
+/* rfc4880_verify_final with a prepared key (0=verified) */
+int rfc4880_verify_prepared(const struct rfc4880_verify_ctx *ctx,
+			    struct rsa_prepared_key *key,
+			    struct rsa_signature *signature);
+
+/* a keyring's prepared keys saved in a form that can be mapped and used
+ * in place, so start-up does not pay for parsing and rsa_prepare */
+struct keycache;
+
+/* save every key in kr to fn, remembering which keyring_fn it was
+ * built from (may be 0); the file is replaced atomically */
+int keycache_write(const char *fn, struct keyring *kr,
+		   const char *keyring_fn);
+
+/* map a cache, returning 0 if it is missing, damaged, built for another
+ * machine, or keyring_fn (if given) has changed since it was written */
+struct keycache *keycache_open(const char *fn, const char *keyring_fn);
+void keycache_close(struct keycache *kc);
+
+u32 keycache_count(struct keycache *kc);
+
+/* point key at the limbs of the key that made signature (0=found); the
+ * key is borrowed and valid until the cache is closed */
+int keycache_find_signer(struct keycache *kc,
+			 struct rsa_signature *signature,
+			 struct rsa_prepared_key *key);
+
+/* the fingerprint of the key that made signature (0=found) */
+int keycache_signer_fingerprint(struct keycache *kc,
+				struct rsa_signature *signature, u8 *fpr);
+
+/* rfc4880_verify_keyring against a cache (0=verified) */
+int rfc4880_verify_keycache(const struct rfc4880_verify_ctx *ctx,
+			    struct keycache *kc,
+			    struct rsa_signature *signature);
+
+/* a record of messages already found to be good, so that files which
+ * have not changed since need not be hashed again.  a result is keyed by
+ * the message file's identity (device, inode, size, mtime and ctime to
+ * the nanosecond), a digest of the signature and the fingerprint of the
+ * key that made it, so it stops matching as soon as any of those change.
+ * the table is a fixed-size file mapped shared, so any number of threads
+ * and processes may use it at once; when it fills up, old results are
+ * overwritten.  only successes are recorded */
+struct resultcache;
+
+struct resultcache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	u8 signature[SHA_DIGEST_SIZE];
+	u8 fingerprint[SHA_DIGEST_SIZE];
+};
+
+/* map the cache at fn, creating it (or starting it over, if it is
+ * damaged or from another version) with room for slots results */
+struct resultcache *resultcache_open(const char *fn, u32 slots);
+void resultcache_close(struct resultcache *rc);
+
+/* the key for checking the message open on fd against signature made
+ * by the key with fingerprint; -1 if fd is not a regular file */
+int resultcache_key(struct resultcache_key *key, int fd,
+		    struct rsa_signature *signature, const u8 *fingerprint);
+
+/* 1 if key was recorded as verified */
+int resultcache_lookup(struct resultcache *rc,
+		       const struct resultcache_key *key);
+
+/* record key as verified; files changed in the last few seconds are not
+ * recorded, since a further change within the same clock tick could go
+ * unnoticed */
+void resultcache_store(struct resultcache *rc,
+		       const struct resultcache_key *key);
+
+/* lookups that hit and missed, by this process and by everyone since
+ * the cache was created */
+struct resultcache_stats {
+	u64 hits;
+	u64 misses;
+	u64 total_hits;
+	u64 total_misses;
+};
+
+void resultcache_stats(struct resultcache *rc, struct resultcache_stats *st);
+
 /* useful utility */
 u8 *load_file(const char *fn, u32 *sz);
 
+/* read-only mapping of an entire file, for inputs too large to copy */
+struct file_map {
+	u8 *data;
+	u64 size;
+};
+
+#define FMAP_POPULATE	1	/* prefault the whole mapping up front */
+#define FMAP_HUGEPAGE	2	/* request transparent huge pages */
+
+int file_map_open(const char *fn, struct file_map *fm, unsigned flags);
+
+/* the same for a file that is already open; fd may be closed afterwards */
+int file_map_fd(int fd, struct file_map *fm, unsigned flags);
+void file_map_close(struct file_map *fm);
+
 #endif
@@ -0,0 +1,583 @@
+/* inflate.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inflate.h"
+#include "diag.h"
+
+/* rfc1951: DEFLATE, decoded one symbol at a time so that it can stop
+ * whenever the reader's buffer is full and carry on with the next read */
+
+#define WINDOW_SIZE	32768
+#define WINDOW_MASK	(WINDOW_SIZE - 1)
+#define INPUT_SIZE	(64 * 1024)
+
+#define MAX_BITS	15
+#define MAX_LCODES	286
+#define MAX_DCODES	30
+#define FIXED_LCODES	288
+
+/* codes up to FAST_BITS long decode with a single table lookup */
+#define FAST_BITS	10
+#define FAST_MASK	((1 << FAST_BITS) - 1)
+
+enum {
+	INF_HEADER,	/* zlib header */
+	INF_BLOCK,	/* next block header */
+	INF_STORED,
+	INF_CODES,
+	INF_COPY,	/* rest of a match */
+	INF_TRAILER,	/* zlib adler32 */
+	INF_DONE,
+};
+
+struct huffman {
+	u16 count[MAX_BITS + 1];	/* number of codes of each length */
+	u16 symbol[FIXED_LCODES];	/* symbols in canonical order */
+	u16 fast[1 << FAST_BITS];	/* length << 9 | symbol, 0 = slow */
+};
+
+struct inflate_source {
+	struct source src;
+	struct source *in;
+	int format;
+	int state;
+	int last;		/* the current block is the final one */
+
+	u64 bitbuf;
+	int bitcnt;
+	u32 ipos, iend;
+
+	u32 stored;		/* bytes left in a stored block */
+	u32 copy_len;
+	u32 copy_dist;
+	u64 total;		/* bytes produced so far */
+	u32 adler_a, adler_b;
+
+	struct huffman lit;
+	struct huffman dist;
+
+	u8 window[WINDOW_SIZE];
+	u8 input[INPUT_SIZE];
+};
+
+static const u16 length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const u8 length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const u16 dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577,
+};
+static const u8 dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+/* -- bit input, least significant bit first -- */
+
+/* have at least n bits in bitbuf: 0, or -1 if the input ends first */
+static int refill(struct inflate_source *is, int n)
+{
+	int r;
+
+	while (is->bitcnt < n) {
+		if (is->ipos == is->iend) {
+			r = source_read(is->in, is->input, sizeof(is->input));
+			if (r <= 0)
+				return -1;
+			is->ipos = 0;
+			is->iend = r;
+		}
+		/* take as much as is buffered while we are here */
+		while (is->bitcnt <= 56 && is->ipos < is->iend) {
+			is->bitbuf |= (u64) is->input[is->ipos++] << is->bitcnt;
+			is->bitcnt += 8;
+		}
+	}
+	return 0;
+}
+
+static inline int need(struct inflate_source *is, int n)
+{
+	return is->bitcnt < n ? refill(is, n) : 0;
+}
+
+static inline void drop(struct inflate_source *is, int n)
+{
+	is->bitbuf >>= n;
+	is->bitcnt -= n;
+}
+
+/* n bits as a number, or -1 at end of input */
+static int bits(struct inflate_source *is, int n)
+{
+	int v;
+
+	if (need(is, n))
+		return -1;
+	v = is->bitbuf & ((1U << n) - 1);
+	drop(is, n);
+	return v;
+}
+
+/* -- Huffman codes -- */
+
+/* build canonical codes from a list of code lengths; returns -1 if the
+ * lengths over-subscribe the code space */
+static int build(struct huffman *h, const u8 *length, int n)
+{
+	u16 offs[MAX_BITS + 1], code[MAX_BITS + 1];
+	int len, sym, left, i;
+	u32 c, rev;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (sym = 0; sym < n; sym++)
+		h->count[length[sym]]++;
+
+	left = 1;
+	for (len = 1; len <= MAX_BITS; len++) {
+		left = (left << 1) - h->count[len];
+		if (left < 0)
+			return -1;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (sym = 0; sym < n; sym++)
+		if (length[sym])
+			h->symbol[offs[length[sym]]++] = sym;
+
+	/* the fast table is indexed by the next FAST_BITS input bits,
+	 * which hold codes bit-reversed */
+	memset(h->fast, 0, sizeof(h->fast));
+	c = 0;
+	h->count[0] = 0;
+	for (len = 1; len <= MAX_BITS; len++) {
+		c = (c + h->count[len - 1]) << 1;
+		code[len] = c;
+	}
+	for (sym = 0; sym < n; sym++) {
+		len = length[sym];
+		if (len == 0 || len > FAST_BITS) {
+			if (len)
+				code[len]++;
+			continue;
+		}
+		c = code[len]++;
+		for (rev = 0, i = 0; i < len; i++)
+			rev |= ((c >> i) & 1) << (len - 1 - i);
+		for (i = rev; i < (1 << FAST_BITS); i += 1 << len)
+			h->fast[i] = (len << 9) | sym;
+	}
+	return 0;
+}
+
+/* codes longer than FAST_BITS, the long way: a bit at a time */
+static int decode_slow(struct inflate_source *is, const struct huffman *h)
+{
+	int code, first, index, count, len;
+
+	code = first = index = 0;
+	for (len = 1; len <= MAX_BITS; len++) {
+		if (need(is, 1))
+			return -1;
+		code |= is->bitbuf & 1;
+		drop(is, 1);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+/* next symbol, or -1 on bad or truncated input */
+static inline int decode(struct inflate_source *is, const struct huffman *h)
+{
+	int e;
+
+	/* near the end of input there may be fewer than MAX_BITS left */
+	need(is, MAX_BITS);
+
+	e = h->fast[is->bitbuf & FAST_MASK];
+	if (e && (e >> 9) <= is->bitcnt) {
+		drop(is, e >> 9);
+		return e & 511;
+	}
+	return decode_slow(is, h);
+}
+
+static int fixed_tables(struct inflate_source *is)
+{
+	u8 length[FIXED_LCODES];
+	int sym;
+
+	for (sym = 0; sym < 144; sym++)
+		length[sym] = 8;
+	for (; sym < 256; sym++)
+		length[sym] = 9;
+	for (; sym < 280; sym++)
+		length[sym] = 7;
+	for (; sym < FIXED_LCODES; sym++)
+		length[sym] = 8;
+	if (build(&is->lit, length, FIXED_LCODES))
+		return -1;
+
+	for (sym = 0; sym < MAX_DCODES; sym++)
+		length[sym] = 5;
+	return build(&is->dist, length, MAX_DCODES);
+}
+
+static int dynamic_tables(struct inflate_source *is)
+{
+	static const u8 order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+	};
+	u8 length[MAX_LCODES + MAX_DCODES];
+	int nlen, ndist, ncode, index, sym, len, rep;
+
+	nlen = bits(is, 5);
+	ndist = bits(is, 5);
+	ncode = bits(is, 4);
+	if (nlen < 0 || ndist < 0 || ncode < 0)
+		return -1;
+	nlen += 257;
+	ndist += 1;
+	ncode += 4;
+	if (nlen > MAX_LCODES || ndist > MAX_DCODES)
+		return -1;
+
+	memset(length, 0, 19);
+	for (index = 0; index < ncode; index++) {
+		if ((len = bits(is, 3)) < 0)
+			return -1;
+		length[order[index]] = len;
+	}
+	if (build(&is->lit, length, 19))
+		return -1;
+
+	for (index = 0; index < nlen + ndist; ) {
+		sym = decode(is, &is->lit);
+		if (sym < 0)
+			return -1;
+		if (sym < 16) {
+			length[index++] = sym;
+			continue;
+		}
+		len = 0;
+		if (sym == 16) {
+			if (index == 0)
+				return -1;
+			len = length[index - 1];
+			rep = bits(is, 2);
+			rep = rep < 0 ? -1 : rep + 3;
+		} else if (sym == 17) {
+			rep = bits(is, 3);
+			rep = rep < 0 ? -1 : rep + 3;
+		} else {
+			rep = bits(is, 7);
+			rep = rep < 0 ? -1 : rep + 11;
+		}
+		if (rep < 0 || index + rep > nlen + ndist)
+			return -1;
+		while (rep--)
+			length[index++] = len;
+	}
+
+	/* a block with no end code could never finish */
+	if (length[256] == 0)
+		return -1;
+	if (build(&is->lit, length, nlen) ||
+	    build(&is->dist, length + nlen, ndist))
+		return -1;
+	return 0;
+}
+
+/* -- output -- */
+
+/* byte dist back from out[n], whether it is in this read or before it */
+static inline u8 back(struct inflate_source *is, u8 *out, u32 n, u32 dist)
+{
+	if (dist <= n)
+		return out[n - dist];
+	return is->window[(is->total - (dist - n)) & WINDOW_MASK];
+}
+
+/* remember the last WINDOW_SIZE bytes of out[0:n] once the read is done */
+static void update_window(struct inflate_source *is, const u8 *out, u32 n)
+{
+	u32 pos, chunk;
+
+	if (n > WINDOW_SIZE) {
+		out += n - WINDOW_SIZE;
+		is->total += n - WINDOW_SIZE;
+		n = WINDOW_SIZE;
+	}
+	while (n > 0) {
+		pos = is->total & WINDOW_MASK;
+		chunk = WINDOW_SIZE - pos;
+		if (chunk > n)
+			chunk = n;
+		memcpy(is->window + pos, out, chunk);
+		out += chunk;
+		n -= chunk;
+		is->total += chunk;
+	}
+}
+
+static void adler32(struct inflate_source *is, const u8 *data, u32 len)
+{
+	u32 a = is->adler_a, b = is->adler_b, n;
+
+	while (len > 0) {
+		/* the most bytes before b can overflow 32 bits */
+		n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	is->adler_a = a;
+	is->adler_b = b;
+}
+
+static int inflate_read(struct source *src, u8 *buf, u32 len)
+{
+	struct inflate_source *is = (struct inflate_source *) src;
+	u32 n = 0, chunk;
+	int sym, v, cmf, flg;
+	u32 check;
+
+	while (n < len) {
+		switch (is->state) {
+		case INF_HEADER:
+			cmf = bits(is, 8);
+			flg = bits(is, 8);
+			if (cmf < 0 || flg < 0 || (cmf & 15) != 8 ||
+			    ((cmf << 8) | flg) % 31 || (flg & 0x20))
+				goto bad;
+			is->state = INF_BLOCK;
+			break;
+
+		case INF_BLOCK:
+			if (is->last) {
+				is->state = is->format == INFLATE_ZLIB ?
+					INF_TRAILER : INF_DONE;
+				break;
+			}
+			if ((v = bits(is, 3)) < 0)
+				goto bad;
+			is->last = v & 1;
+			switch (v >> 1) {
+			case 0:
+				/* stored: LEN and NLEN from the next byte */
+				drop(is, is->bitcnt & 7);
+				v = bits(is, 16);
+				if (v < 0 || bits(is, 16) != (~v & 0xffff))
+					goto bad;
+				is->stored = v;
+				is->state = INF_STORED;
+				break;
+			case 1:
+				if (fixed_tables(is))
+					goto bad;
+				is->state = INF_CODES;
+				break;
+			case 2:
+				if (dynamic_tables(is))
+					goto bad;
+				is->state = INF_CODES;
+				break;
+			default:
+				goto bad;
+			}
+			break;
+
+		case INF_STORED:
+			if (is->stored == 0) {
+				is->state = INF_BLOCK;
+				break;
+			}
+			/* whole bytes may still be sitting in bitbuf */
+			if (is->bitcnt) {
+				buf[n++] = is->bitbuf;
+				drop(is, 8);
+				is->stored--;
+				break;
+			}
+			if (is->ipos == is->iend) {
+				/* refill by way of bitbuf, drained above */
+				if (need(is, 8))
+					goto bad;
+				break;
+			}
+			chunk = is->iend - is->ipos;
+			if (chunk > is->stored)
+				chunk = is->stored;
+			if (chunk > len - n)
+				chunk = len - n;
+			memcpy(buf + n, is->input + is->ipos, chunk);
+			is->ipos += chunk;
+			is->stored -= chunk;
+			n += chunk;
+			break;
+
+		case INF_CODES:
+			/* literals run in a tight loop until a match or
+			 * the end of the block */
+			while (n < len) {
+				sym = decode(is, &is->lit);
+				if (sym < 256) {
+					if (sym < 0)
+						goto bad;
+					buf[n++] = sym;
+					continue;
+				}
+				if (sym == 256) {
+					is->state = INF_BLOCK;
+					break;
+				}
+				sym -= 257;
+				if (sym >= 29 ||
+				    (v = bits(is, length_extra[sym])) < 0)
+					goto bad;
+				is->copy_len = length_base[sym] + v;
+				sym = decode(is, &is->dist);
+				if (sym < 0 || sym >= 30 ||
+				    (v = bits(is, dist_extra[sym])) < 0)
+					goto bad;
+				is->copy_dist = dist_base[sym] + v;
+				if (is->copy_dist > is->total + n)
+					goto bad;
+				is->state = INF_COPY;
+				break;
+			}
+			break;
+
+		case INF_COPY:
+			/* the usual case is a match within this read */
+			if (is->copy_dist <= n && is->copy_len <= len - n) {
+				u8 *d = buf + n, *f = d - is->copy_dist;
+				u32 c = is->copy_len;
+
+				n += c;
+				while (c--)
+					*d++ = *f++;
+				is->copy_len = 0;
+			}
+			while (is->copy_len && n < len) {
+				buf[n] = back(is, buf, n, is->copy_dist);
+				n++;
+				is->copy_len--;
+			}
+			if (is->copy_len == 0)
+				is->state = INF_CODES;
+			break;
+
+		case INF_TRAILER:
+			drop(is, is->bitcnt & 7);
+			check = 0;
+			for (v = 0; v < 4; v++) {
+				if ((sym = bits(is, 8)) < 0)
+					goto bad;
+				check = (check << 8) | sym;
+			}
+			adler32(is, buf, n);
+			if (check != ((is->adler_b << 16) | is->adler_a)) {
+				diag("decompressed data corrupt");
+				return -1;
+			}
+			update_window(is, buf, n);
+			is->state = INF_DONE;
+			return n;
+
+		case INF_DONE:
+			goto out;
+		}
+	}
+
+out:
+	if (is->format == INFLATE_ZLIB)
+		adler32(is, buf, n);
+	update_window(is, buf, n);
+	return n;
+
+bad:
+	diag("invalid compressed data");
+	return -1;
+}
+
+static void inflate_close(struct source *src)
+{
+	struct inflate_source *is = (struct inflate_source *) src;
+
+	source_close(is->in);
+	free(is);
+}
+
+struct source *source_inflate(struct source *in, int format)
+{
+	struct inflate_source *is;
+
+	if (!in)
+		return 0;
+	if (format != INFLATE_RAW && format != INFLATE_ZLIB) {
+		source_close(in);
+		return 0;
+	}
+	is = calloc(1, sizeof(*is));
+	if (!is) {
+		source_close(in);
+		return 0;
+	}
+	is->src.read = inflate_read;
+	is->src.close = inflate_close;
+	is->in = in;
+	is->format = format;
+	is->state = format == INFLATE_ZLIB ? INF_HEADER : INF_BLOCK;
+	is->adler_a = 1;
+	return &is->src;
+}
@@ -0,0 +1,449 @@
+/* keycache.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "crypto.h"
+
+/* On-disk layout, all in native byte order (the cache is a local
+ * artifact, not an interchange format):
+ *
+ *   header | entries[count] | keyid index | fingerprint index | data
+ *
+ * The indexes are open addressed tables of index_size entries holding
+ * entry number + 1 (0 = empty).  Each entry holds its key's Montgomery
+ * constants (struct mont) and points into the data area for the rest:
+ * the modulus and R^2 mod n as limbs, and the exponent as big-endian
+ * bytes.  Everything is 8-byte aligned so limbs can be used in place
+ * from a mapping.
+ */
+
+#define KEYCACHE_MAGIC		"PGPKEYC"
+#define KEYCACHE_VERSION	2
+#define KEYCACHE_BYTE_ORDER	0x01020304
+
+struct keycache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t digit_size;
+	uint32_t count;
+	uint32_t index_size;
+	uint32_t reserved;
+	/* the keyring file this was built from */
+	uint64_t src_dev;
+	uint64_t src_ino;
+	uint64_t src_size;
+	int64_t src_mtime_ns;
+	uint64_t file_size;
+	uint64_t entries_off;
+	uint64_t keyid_off;
+	uint64_t fpr_off;
+};
+
+struct keycache_entry {
+	uint8_t fingerprint[20];
+	uint8_t keyid[8];
+	uint32_t subkey;
+	uint32_t n_sz;
+	uint32_t len;    /* limbs in n and rr */
+	uint32_t bytes;  /* significant bytes of n */
+	uint32_t e_sz;
+	uint32_t reserved;
+	uint64_t n0inv;
+	uint64_t n_limbs;
+	uint64_t rr_limbs;
+	uint64_t e_off;
+};
+
+struct keycache {
+	struct file_map fm;
+	struct keycache_header *hdr;
+	struct keycache_entry *entries;
+	uint32_t *by_keyid;
+	uint32_t *by_fpr;
+	uint32_t mask;
+};
+
+static u32 hash4(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static void insert(uint32_t *index, u32 mask, u32 hash, u32 n)
+{
+	while (index[hash & mask])
+		hash++;
+	index[hash & mask] = n + 1;
+}
+
+struct outbuf {
+	u8 *data;
+	u64 len;
+	u64 max;
+};
+
+/* append len bytes at the next 8-byte boundary, returning the offset
+ * (0 on failure: the header is always at offset 0, so data never is) */
+static u64 append(struct outbuf *out, const void *data, u64 len)
+{
+	u64 off = (out->len + 7) & ~7ULL;
+	u64 max = out->max;
+	u8 *p;
+
+	while (off + len > max)
+		max = max ? max * 2 : 4096;
+	if (max != out->max) {
+		p = realloc(out->data, max);
+		if (!p)
+			return 0;
+		out->data = p;
+		out->max = max;
+	}
+	memset(out->data + out->len, 0, off - out->len);
+	memcpy(out->data + off, data, len);
+	out->len = off + len;
+	return off;
+}
+
+static int source_stat(const char *fn, struct keycache_header *hdr)
+{
+	struct stat s;
+
+	if (stat(fn, &s))
+		return -1;
+	hdr->src_dev = s.st_dev;
+	hdr->src_ino = s.st_ino;
+	hdr->src_size = s.st_size;
+	hdr->src_mtime_ns = (int64_t) s.st_mtim.tv_sec * 1000000000 +
+		s.st_mtim.tv_nsec;
+	return 0;
+}
+
+static int write_file(const char *fn, const u8 *data, u64 len)
+{
+	char tmp[4096];
+	ssize_t r;
+	int fd;
+
+	/* a fresh name next to the cache, created by us alone: in a shared
+	 * directory, a name someone else can guess could be a symlink */
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fn) >= (int) sizeof(tmp))
+		return -1;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	if (fchmod(fd, 0644))
+		goto fail;
+	while (len > 0) {
+		r = write(fd, data, len);
+		if (r <= 0)
+			goto fail;
+		data += r;
+		len -= r;
+	}
+	/* on disk before the name points at it, or a crash could leave
+	 * the cache empty */
+	if (fsync(fd))
+		goto fail;
+	if (close(fd))
+		goto fail_closed;
+	/* readers see either the old cache or the new one, never half */
+	if (rename(tmp, fn))
+		goto fail_closed;
+	return 0;
+
+fail:
+	close(fd);
+fail_closed:
+	unlink(tmp);
+	return -1;
+}
+
+int keycache_write(const char *fn, struct keyring *kr, const char *keyring_fn)
+{
+	struct keycache_header hdr;
+	struct keycache_entry *entry;
+	struct rsa_prepared_key key;
+	struct keyring_key *k;
+	struct outbuf out;
+	uint32_t *by_keyid, *by_fpr;
+	u32 n, count = keyring_count(kr);
+	u32 size = 16;
+	int r = -1;
+
+	while (size < count * 2)
+		size *= 2;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, KEYCACHE_MAGIC, sizeof(KEYCACHE_MAGIC));
+	hdr.version = KEYCACHE_VERSION;
+	hdr.byte_order = KEYCACHE_BYTE_ORDER;
+	hdr.digit_size = sizeof(limb);
+	hdr.count = count;
+	hdr.index_size = size;
+	if (keyring_fn && source_stat(keyring_fn, &hdr))
+		return -1;
+
+	/* lay out the fixed part up front, then fill it in place */
+	hdr.entries_off = (sizeof(hdr) + 7) & ~7ULL;
+	hdr.keyid_off = hdr.entries_off + (u64) count * sizeof(*entry);
+	hdr.fpr_off = hdr.keyid_off + (u64) size * sizeof(uint32_t);
+	out.len = hdr.fpr_off + (u64) size * sizeof(uint32_t);
+	out.max = out.len;
+	out.data = calloc(1, out.len);
+	if (!out.data)
+		return -1;
+
+	for (n = 0; n < count; n++) {
+		struct keycache_entry e;
+
+		k = keyring_get(kr, n);
+		if (rsa_prepare(&key, &k->public))
+			goto done;
+
+		memset(&e, 0, sizeof(e));
+		memcpy(e.fingerprint, k->fingerprint, 20);
+		memcpy(e.keyid, k->keyid, 8);
+		e.subkey = k->subkey;
+		e.n_sz = k->public.n_sz;
+		e.len = key.mont.len;
+		e.bytes = key.mont.bytes;
+		e.e_sz = key.mont.e_sz;
+		e.n0inv = key.mont.n0inv;
+		e.n_limbs = append(&out, key.mont.n, e.len * sizeof(limb));
+		e.rr_limbs = append(&out, key.mont.rr, e.len * sizeof(limb));
+		e.e_off = append(&out, key.mont.e, e.e_sz);
+		rsa_prepared_clear(&key);
+		if (!e.n_limbs || !e.rr_limbs || !e.e_off)
+			goto done;
+
+		entry = (struct keycache_entry *) (out.data + hdr.entries_off);
+		entry[n] = e;
+	}
+
+	entry = (struct keycache_entry *) (out.data + hdr.entries_off);
+	by_keyid = (uint32_t *) (out.data + hdr.keyid_off);
+	by_fpr = (uint32_t *) (out.data + hdr.fpr_off);
+	for (n = 0; n < count; n++) {
+		insert(by_keyid, size - 1, hash4(entry[n].keyid + 4), n);
+		insert(by_fpr, size - 1, hash4(entry[n].fingerprint), n);
+	}
+
+	hdr.file_size = out.len;
+	memcpy(out.data, &hdr, sizeof(hdr));
+	r = write_file(fn, out.data, out.len);
+
+done:
+	free(out.data);
+	return r;
+}
+
+struct keycache *keycache_open(const char *fn, const char *keyring_fn)
+{
+	struct keycache_header *hdr, src;
+	struct keycache *kc;
+	u64 size;
+
+	kc = calloc(1, sizeof(*kc));
+	if (!kc)
+		return 0;
+	if (file_map_open(fn, &kc->fm, 0))
+		goto fail;
+
+	size = kc->fm.size;
+	hdr = (struct keycache_header *) kc->fm.data;
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, KEYCACHE_MAGIC, sizeof(KEYCACHE_MAGIC)) ||
+	    hdr->version != KEYCACHE_VERSION ||
+	    hdr->byte_order != KEYCACHE_BYTE_ORDER ||
+	    hdr->digit_size != sizeof(limb) ||
+	    hdr->file_size != size)
+		goto fail;
+
+	/* the index size is a power of two, so this also rules out 0;
+	 * a full index would leave misses nowhere to stop */
+	if (hdr->index_size & (hdr->index_size - 1) ||
+	    hdr->index_size <= hdr->count ||
+	    hdr->entries_off + (u64) hdr->count *
+	    sizeof(struct keycache_entry) > size ||
+	    hdr->keyid_off + (u64) hdr->index_size * 4 > size ||
+	    hdr->fpr_off + (u64) hdr->index_size * 4 > size ||
+	    (hdr->entries_off | hdr->keyid_off | hdr->fpr_off) & 7)
+		goto fail;
+
+	if (keyring_fn) {
+		if (source_stat(keyring_fn, &src) ||
+		    src.src_dev != hdr->src_dev ||
+		    src.src_ino != hdr->src_ino ||
+		    src.src_size != hdr->src_size ||
+		    src.src_mtime_ns != hdr->src_mtime_ns)
+			goto fail;
+	}
+
+	kc->hdr = hdr;
+	kc->entries = (struct keycache_entry *)
+		(kc->fm.data + hdr->entries_off);
+	kc->by_keyid = (uint32_t *) (kc->fm.data + hdr->keyid_off);
+	kc->by_fpr = (uint32_t *) (kc->fm.data + hdr->fpr_off);
+	kc->mask = hdr->index_size - 1;
+	return kc;
+
+fail:
+	keycache_close(kc);
+	return 0;
+}
+
+void keycache_close(struct keycache *kc)
+{
+	if (!kc)
+		return;
+	file_map_close(&kc->fm);
+	free(kc);
+}
+
+u32 keycache_count(struct keycache *kc)
+{
+	return kc->hdr->count;
+}
+
+static int limbs_ok(struct keycache *kc, u64 off, u32 len)
+{
+	return len > 0 && !(off % sizeof(limb)) &&
+		off + (u64) len * sizeof(limb) <= kc->fm.size;
+}
+
+/* point a prepared key at the limbs of entry n + 1 (0 = none) */
+static int entry_key(struct keycache *kc, u32 n, struct rsa_prepared_key *key)
+{
+	struct keycache_entry *e;
+
+	if (n == 0 || n > kc->hdr->count)
+		return -1;
+	e = kc->entries + n - 1;
+
+	/* the header was checked at open; entries are checked as used,
+	 * as far as the arithmetic needs: in bounds, n odd, e nonzero */
+	if (!limbs_ok(kc, e->n_limbs, e->len) ||
+	    !limbs_ok(kc, e->rr_limbs, e->len) ||
+	    e->bytes == 0 || e->bytes > e->len * sizeof(limb) ||
+	    e->e_sz == 0 || e->e_off + e->e_sz > kc->fm.size ||
+	    !(kc->fm.data[e->n_limbs] & 1) || kc->fm.data[e->e_off] == 0)
+		return -1;
+
+	key->n_sz = e->n_sz;
+	key->borrowed = 1;
+	key->mont.len = e->len;
+	key->mont.bytes = e->bytes;
+	key->mont.n0inv = e->n0inv;
+	key->mont.n = (limb *) (kc->fm.data + e->n_limbs);
+	key->mont.rr = (limb *) (kc->fm.data + e->rr_limbs);
+	key->mont.e = kc->fm.data + e->e_off;
+	key->mont.e_sz = e->e_sz;
+	return 0;
+}
+
+/* entry number of the key that made signature, or 0.  probes never
+ * go round the table more than once, whatever a damaged index holds */
+static u32 find_signer(struct keycache *kc, struct rsa_signature *signature)
+{
+	u32 hash, n, i;
+
+	if (signature->has_issuer_fpr) {
+		hash = hash4(signature->issuer_fpr);
+		for (i = 0; i <= kc->mask; i++, hash++) {
+			n = kc->by_fpr[hash & kc->mask];
+			if (n == 0)
+				break;
+			if (n <= kc->hdr->count &&
+			    !memcmp(kc->entries[n - 1].fingerprint,
+				    signature->issuer_fpr, 20))
+				return n;
+		}
+	}
+	if (signature->has_issuer) {
+		hash = hash4(signature->issuer + 4);
+		for (i = 0; i <= kc->mask; i++, hash++) {
+			n = kc->by_keyid[hash & kc->mask];
+			if (n == 0)
+				break;
+			if (n <= kc->hdr->count &&
+			    !memcmp(kc->entries[n - 1].keyid,
+				    signature->issuer, 8))
+				return n;
+		}
+	}
+	return 0;
+}
+
+int keycache_find_signer(struct keycache *kc, struct rsa_signature *signature,
+			 struct rsa_prepared_key *key)
+{
+	return entry_key(kc, find_signer(kc, signature), key);
+}
+
+int keycache_signer_fingerprint(struct keycache *kc,
+				struct rsa_signature *signature, u8 *fpr)
+{
+	u32 n = find_signer(kc, signature);
+
+	if (n == 0)
+		return -1;
+	memcpy(fpr, kc->entries[n - 1].fingerprint, SHA_DIGEST_SIZE);
+	return 0;
+}
+
+int rfc4880_verify_keycache(const struct rfc4880_verify_ctx *ctx,
+			    struct keycache *kc,
+			    struct rsa_signature *signature)
+{
+	struct rsa_prepared_key key;
+	u32 n;
+
+	if (signature->has_issuer || signature->has_issuer_fpr) {
+		if (keycache_find_signer(kc, signature, &key))
+			return -1;
+		return rfc4880_verify_prepared(ctx, &key, signature);
+	}
+
+	/* no issuer subpacket: nothing for it but to try them all */
+	for (n = 1; n <= kc->hdr->count; n++)
+		if (!entry_key(kc, n, &key) &&
+		    !rfc4880_verify_prepared(ctx, &key, signature))
+			return 0;
+	return -1;
+}
@@ -0,0 +1,332 @@
+/* keyring.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfc4880.h"
+#include "crypto.h"
+#include "packet.h"
+#include "armor.h"
+#include "diag.h"
+
+struct keyring {
+	struct file_map fm; /* backing store for keyring_open */
+	u8 *decoded;        /* or the packets of an armored keyring */
+	u32 count;
+	u32 max;
+	struct keyring_key *keys;
+	struct rsa_prepared_key *prepared; /* per key, after keyring_prepare */
+
+	/* open addressed indexes holding key number + 1, 0 = empty */
+	u32 mask;
+	u32 *by_keyid;
+	u32 *by_fpr;
+};
+
+/* key IDs and fingerprints are SHA-1 output, so any 4 bytes will do */
+static u32 hash4(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static void fingerprint(u8 *body, u32 len, u8 *out)
+{
+	SHA_CTX ctx;
+	u8 hdr[3];
+
+	/* rfc4880 12.2: hashed as an old-format public key packet */
+	hdr[0] = 0x99;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+
+	SHA_init(&ctx);
+	SHA_update(&ctx, hdr, 3);
+	SHA_update(&ctx, body, len);
+	memcpy(out, SHA_final(&ctx), SHA_DIGEST_SIZE);
+}
+
+static int add_key(struct keyring *kr, u8 *body, u32 len, int subkey)
+{
+	struct keyring_key *key;
+
+	/* quietly pass over keys we cannot use */
+	if (len < 6 || len > 0xffff || body[0] != 4)
+		return 0;
+	switch (body[5]) {
+	case ALGO_RSA_ENCRYPT_OR_SIGN:
+	case ALGO_RSA_ENCRYPT_ONLY:
+	case ALGO_RSA_SIGN_ONLY:
+		break;
+	default:
+		return 0;
+	}
+
+	if (kr->count == kr->max) {
+		u32 max = kr->max ? kr->max * 2 : 64;
+		key = realloc(kr->keys, max * sizeof(*key));
+		if (!key)
+			return -1;
+		kr->keys = key;
+		kr->max = max;
+	}
+
+	key = kr->keys + kr->count;
+	if (rfc4880_key_view(body, len, &key->public, 0))
+		return -1;
+	fingerprint(body, len, key->fingerprint);
+	memcpy(key->keyid, key->fingerprint + SHA_DIGEST_SIZE - 8, 8);
+	key->subkey = subkey;
+	kr->count++;
+	return 0;
+}
+
+static void insert(u32 *index, u32 mask, u32 hash, u32 n)
+{
+	while (index[hash & mask])
+		hash++;
+	index[hash & mask] = n + 1;
+}
+
+static int build_index(struct keyring *kr)
+{
+	struct keyring_key *key;
+	u32 size = 16, n;
+
+	/* keep the tables at most half full */
+	while (size < kr->count * 2)
+		size *= 2;
+
+	kr->mask = size - 1;
+	kr->by_keyid = calloc(size, sizeof(u32));
+	kr->by_fpr = calloc(size, sizeof(u32));
+	if (!kr->by_keyid || !kr->by_fpr)
+		return -1;
+
+	for (n = 0; n < kr->count; n++) {
+		key = kr->keys + n;
+		insert(kr->by_keyid, kr->mask, hash4(key->keyid + 4), n);
+		insert(kr->by_fpr, kr->mask, hash4(key->fingerprint), n);
+	}
+	return 0;
+}
+
+struct keyring *keyring_load(u8 *data, u64 len)
+{
+	struct packet_header hdr;
+	struct keyring *kr;
+	u8 *body;
+	int r;
+
+	kr = calloc(1, sizeof(*kr));
+	if (!kr)
+		return 0;
+
+	while ((r = packet_walk(&data, &len, &hdr, &body)) > 0) {
+		if (!body)
+			continue;
+		if (hdr.tag != 6 && hdr.tag != 14)
+			continue;
+		if (add_key(kr, body, hdr.len, hdr.tag == 14))
+			goto fail;
+	}
+	if (r < 0)
+		goto fail;
+
+	if (build_index(kr))
+		goto fail;
+	return kr;
+
+fail:
+	keyring_free(kr);
+	return 0;
+}
+
+struct keyring *keyring_open(const char *fn)
+{
+	struct keyring *kr;
+	struct file_map fm;
+	int r;
+
+	if (file_map_open(fn, &fm, 0)) {
+		diag("failed to open '%s'", fn);
+		return 0;
+	}
+	if (armor_detect(fm.data, fm.size)) {
+		u8 *data;
+		u64 len;
+
+		r = armor_decode(fm.data, fm.size, &data, &len);
+		file_map_close(&fm);
+		if (r)
+			return 0;
+		kr = keyring_load(data, len);
+		if (!kr) {
+			free(data);
+			return 0;
+		}
+		kr->decoded = data;
+		return kr;
+	}
+
+	kr = keyring_load(fm.data, fm.size);
+	if (!kr) {
+		file_map_close(&fm);
+		return 0;
+	}
+	kr->fm = fm;
+	return kr;
+}
+
+void keyring_free(struct keyring *kr)
+{
+	if (!kr)
+		return;
+	file_map_close(&kr->fm);
+	free(kr->decoded);
+	free(kr->by_keyid);
+	free(kr->by_fpr);
+	if (kr->prepared) {
+		u32 n;
+		for (n = 0; n < kr->count; n++)
+			rsa_prepared_clear(&kr->prepared[n]);
+		free(kr->prepared);
+	}
+	free(kr->keys);
+	free(kr);
+}
+
+int keyring_prepare(struct keyring *kr)
+{
+	struct rsa_prepared_key *prepared;
+	u32 n;
+
+	if (kr->prepared)
+		return 0;
+	prepared = calloc(kr->count ? kr->count : 1, sizeof(*prepared));
+	if (!prepared)
+		return -1;
+	for (n = 0; n < kr->count; n++) {
+		if (rsa_prepare(&prepared[n], &kr->keys[n].public)) {
+			while (n-- > 0)
+				rsa_prepared_clear(&prepared[n]);
+			free(prepared);
+			return -1;
+		}
+	}
+	kr->prepared = prepared;
+	return 0;
+}
+
+static int verify_key(const struct rfc4880_verify_ctx *ctx,
+		      struct keyring *kr, struct keyring_key *key,
+		      struct rsa_signature *signature)
+{
+	if (kr->prepared)
+		return rfc4880_verify_prepared(ctx,
+					       &kr->prepared[key - kr->keys],
+					       signature);
+	return rfc4880_verify_final(ctx, &key->public, signature);
+}
+
+u32 keyring_count(struct keyring *kr)
+{
+	return kr->count;
+}
+
+struct keyring_key *keyring_get(struct keyring *kr, u32 n)
+{
+	return n < kr->count ? kr->keys + n : 0;
+}
+
+struct keyring_key *keyring_find_keyid(struct keyring *kr, const u8 *keyid)
+{
+	u32 hash = hash4(keyid + 4);
+	u32 n;
+
+	while ((n = kr->by_keyid[hash & kr->mask])) {
+		if (!memcmp(kr->keys[n - 1].keyid, keyid, 8))
+			return kr->keys + n - 1;
+		hash++;
+	}
+	return 0;
+}
+
+struct keyring_key *keyring_find_fingerprint(struct keyring *kr,
+					     const u8 *fingerprint)
+{
+	u32 hash = hash4(fingerprint);
+	u32 n;
+
+	while ((n = kr->by_fpr[hash & kr->mask])) {
+		if (!memcmp(kr->keys[n - 1].fingerprint, fingerprint,
+			    SHA_DIGEST_SIZE))
+			return kr->keys + n - 1;
+		hash++;
+	}
+	return 0;
+}
+
+struct keyring_key *keyring_find_signer(struct keyring *kr,
+					struct rsa_signature *signature)
+{
+	struct keyring_key *key;
+
+	if (signature->has_issuer_fpr) {
+		key = keyring_find_fingerprint(kr, signature->issuer_fpr);
+		if (key)
+			return key;
+	}
+	if (signature->has_issuer)
+		return keyring_find_keyid(kr, signature->issuer);
+	return 0;
+}
+
+int rfc4880_verify_keyring(const struct rfc4880_verify_ctx *ctx,
+			   struct keyring *kr,
+			   struct rsa_signature *signature)
+{
+	struct keyring_key *key;
+	u32 n;
+
+	if (signature->has_issuer || signature->has_issuer_fpr) {
+		key = keyring_find_signer(kr, signature);
+		if (!key)
+			return -1;
+		return verify_key(ctx, kr, key, signature);
+	}
+
+	/* no issuer subpacket: nothing for it but to try them all */
+	for (n = 0; n < kr->count; n++)
+		if (!verify_key(ctx, kr, &kr->keys[n], signature))
+			return 0;
+	return -1;
+}
@@ -0,0 +1,336 @@
+/* mont.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mont.h"
+
+static void load(limb *x, u32 len, const u8 *data, u32 n)
+{
+	u32 i;
+
+	memset(x, 0, len * sizeof(limb));
+	for (i = 0; i < n && i < len * sizeof(limb); i++)
+		x[i / sizeof(limb)] |= (limb) data[n - 1 - i] <<
+			(8 * (i % sizeof(limb)));
+}
+
+static void store(u8 *data, u32 n, const limb *x)
+{
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		data[n - 1 - i] = x[i / sizeof(limb)] >>
+			(8 * (i % sizeof(limb)));
+}
+
+/* x < n */
+static int less(const limb *x, const limb *n, u32 len)
+{
+	while (len-- > 0)
+		if (x[len] != n[len])
+			return x[len] < n[len];
+	return 0;
+}
+
+/* r[l] = a[l] * b[l] / R mod n for each lane, by coarsely integrated
+ * operand scanning.  every loop over the lanes is innermost, and lanes
+ * and len are constants wherever this is inlined, so the compiler sees
+ * independent carry chains side by side.  t holds lanes * (len + 2)
+ * limbs of scratch; r may be a or b */
+static inline __attribute__((always_inline))
+void mont_mul(const limb *n, limb n0inv, const u32 len, const int lanes,
+	      limb **r, limb **a, limb **b, limb *t)
+{
+	limb c[MONT_LANES], q[MONT_LANES], bi[MONT_LANES];
+	limb *tl[MONT_LANES];
+	dlimb p;
+	u32 i, j;
+	int l;
+
+	for (l = 0; l < lanes; l++) {
+		tl[l] = t + l * (len + 2);
+		memset(tl[l], 0, (len + 2) * sizeof(limb));
+	}
+	for (i = 0; i < len; i++) {
+		for (l = 0; l < lanes; l++) {
+			bi[l] = b[l][i];
+			c[l] = 0;
+		}
+		/* unrolled a little, which -O2 does not do by itself */
+#pragma GCC unroll 4
+		for (j = 0; j < len; j++) {
+			for (l = 0; l < lanes; l++) {
+				p = (dlimb) a[l][j] * bi[l] + tl[l][j] + c[l];
+				tl[l][j] = p;
+				c[l] = p >> LIMB_BITS;
+			}
+		}
+		for (l = 0; l < lanes; l++) {
+			p = (dlimb) tl[l][len] + c[l];
+			tl[l][len] = p;
+			tl[l][len + 1] = p >> LIMB_BITS;
+			q[l] = tl[l][0] * n0inv;
+			p = (dlimb) q[l] * n[0] + tl[l][0];
+			c[l] = p >> LIMB_BITS;
+		}
+#pragma GCC unroll 4
+		for (j = 1; j < len; j++) {
+			for (l = 0; l < lanes; l++) {
+				p = (dlimb) q[l] * n[j] + tl[l][j] + c[l];
+				tl[l][j - 1] = p;
+				c[l] = p >> LIMB_BITS;
+			}
+		}
+		for (l = 0; l < lanes; l++) {
+			p = (dlimb) tl[l][len] + c[l];
+			tl[l][len - 1] = p;
+			tl[l][len] = tl[l][len + 1] + (p >> LIMB_BITS);
+		}
+	}
+
+	/* the result is below 2n: one subtraction at most */
+	for (l = 0; l < lanes; l++) {
+		if (tl[l][len] || !less(tl[l], n, len)) {
+			limb borrow = 0, x;
+			for (j = 0; j < len; j++) {
+				x = tl[l][j] - n[j] - borrow;
+				borrow = (tl[l][j] < n[j]) ||
+					(tl[l][j] == n[j] && borrow);
+				r[l][j] = x;
+			}
+		} else {
+			memcpy(r[l], tl[l], len * sizeof(limb));
+		}
+	}
+}
+
+/* x = s^e mod n, left to right over the bits of e; a and x hold lanes
+ * numbers each, one holds the constant one */
+static inline __attribute__((always_inline))
+void mont_pow(const struct mont *m, const u32 len, const int lanes,
+	      limb **x, limb **a, limb *one, limb *t)
+{
+	limb *rr[MONT_LANES], *ones[MONT_LANES];
+	const u8 *e = m->e;
+	int l, bit, top;
+	u32 i;
+
+	for (l = 0; l < lanes; l++) {
+		rr[l] = m->rr;
+		ones[l] = one;
+	}
+
+	/* into Montgomery form: a = s R */
+	mont_mul(m->n, m->n0inv, len, lanes, a, a, rr, t);
+	for (l = 0; l < lanes; l++)
+		memcpy(x[l], a[l], len * sizeof(limb));
+
+	for (top = 7; !(e[0] >> top & 1); top--)
+		;
+	for (i = 0; i < m->e_sz; i++) {
+		for (bit = i ? 7 : top - 1; bit >= 0; bit--) {
+			mont_mul(m->n, m->n0inv, len, lanes, x, x, x, t);
+			if (e[i] >> bit & 1)
+				mont_mul(m->n, m->n0inv, len, lanes, x, x, a, t);
+		}
+	}
+
+	/* and out again */
+	mont_mul(m->n, m->n0inv, len, lanes, x, x, ones, t);
+}
+
+/* x = 2x mod n, for x < n */
+static void mod_double(limb *x, const limb *n, u32 len)
+{
+	limb carry = 0, top, borrow, d;
+	u32 j;
+
+	for (j = 0; j < len; j++) {
+		top = x[j] >> (LIMB_BITS - 1);
+		x[j] = x[j] << 1 | carry;
+		carry = top;
+	}
+	if (!carry && less(x, n, len))
+		return;
+	for (j = borrow = 0; j < len; j++) {
+		d = x[j] - n[j] - borrow;
+		borrow = x[j] < n[j] || (x[j] == n[j] && borrow);
+		x[j] = d;
+	}
+}
+
+/* R^2 mod n without a long division: doubling from just below n gives
+ * 2^a R mod n, which is 2^a in Montgomery form, and s Montgomery
+ * squarings of that make 2^(a 2^s) R = R^2 when a 2^s = log2 R */
+static int mont_rr(struct mont *m)
+{
+	u32 bits, total = LIMB_BITS * m->len, a, s, i;
+	limb *x[1] = { m->rr }, *t;
+
+	t = malloc((m->len + 2) * sizeof(limb));
+	if (!t)
+		return -1;
+	for (bits = total; !(m->n[(bits - 1) / LIMB_BITS] >>
+			     ((bits - 1) % LIMB_BITS) & 1); bits--)
+		;
+	for (s = 0; s < 5 && !(total >> s & 1); s++)
+		;
+	a = total >> s;
+
+	memset(m->rr, 0, m->len * sizeof(limb));
+	m->rr[(bits - 1) / LIMB_BITS] = (limb) 1 << ((bits - 1) % LIMB_BITS);
+	for (i = bits - 1; i < total + a; i++)
+		mod_double(m->rr, m->n, m->len);
+	for (i = 0; i < s; i++)
+		mont_mul(m->n, m->n0inv, m->len, 1, x, x, x, t);
+	free(t);
+	return 0;
+}
+
+int mont_init(struct mont *m, const u8 *n, u32 n_sz, const u8 *e, u32 e_sz)
+{
+	limb inv;
+	int i;
+
+	/* so that mont_clear is safe whatever happens */
+	m->n = 0;
+	while (n_sz > 0 && n[0] == 0) {
+		n++;
+		n_sz--;
+	}
+	while (e_sz > 0 && e[0] == 0) {
+		e++;
+		e_sz--;
+	}
+	if (n_sz == 0 || e_sz == 0 || !(n[n_sz - 1] & 1))
+		return -1;
+
+	m->bytes = n_sz;
+	m->len = (n_sz + sizeof(limb) - 1) / sizeof(limb);
+	m->e_sz = e_sz;
+	m->n = malloc(2 * m->len * sizeof(limb) + e_sz);
+	if (!m->n)
+		return -1;
+	m->rr = m->n + m->len;
+	m->e = (u8 *) (m->rr + m->len);
+	memcpy(m->e, e, e_sz);
+	load(m->n, m->len, n, n_sz);
+
+	/* Newton's iteration doubles the good low bits of an inverse each
+	 * time, and any odd number is its own inverse mod 8 */
+	inv = m->n[0];
+	for (i = 0; i < 6; i++)
+		inv *= 2 - m->n[0] * inv;
+	m->n0inv = -inv;
+
+	if (mont_rr(m)) {
+		free(m->n);
+		m->n = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void mont_clear(struct mont *m)
+{
+	free(m->n);
+	m->n = 0;
+}
+
+#define POW(len) do {						\
+	if (MONT_LANES == 1 || lanes == 1)			\
+		mont_pow(m, len, 1, x, a, one, t);		\
+	else							\
+		mont_pow(m, len, MONT_LANES, x, a, one, t);	\
+} while (0)
+
+/* the usual key sizes get kernels of their own, where the limb count is
+ * a constant: the loops over the limbs have known trip counts and fixed
+ * offsets into t.  anything else runs the same code with len a variable */
+static void pow_lanes(const struct mont *m, int lanes,
+		      limb **x, limb **a, limb *one, limb *t)
+{
+	switch (m->len) {
+	case 2048 / LIMB_BITS:
+		POW(2048 / LIMB_BITS);
+		break;
+	case 3072 / LIMB_BITS:
+		POW(3072 / LIMB_BITS);
+		break;
+	case 4096 / LIMB_BITS:
+		POW(4096 / LIMB_BITS);
+		break;
+	default:
+		POW(m->len);
+		break;
+	}
+}
+
+int mont_exp(const struct mont *m, const u8 **in, const u32 *in_len,
+	     u8 **out, int lanes)
+{
+	limb *x[MONT_LANES], *a[MONT_LANES], *one, *t, *mem;
+	u32 len = m->len;
+	int l, valid = 0;
+
+	if (lanes < 1 || lanes > MONT_LANES)
+		return -1;
+	mem = malloc((lanes * (3 * len + 2) + len) * sizeof(limb));
+	if (!mem)
+		return -1;
+	one = mem;
+	t = one + len;
+	for (l = 0; l < lanes; l++) {
+		a[l] = t + lanes * (len + 2) + 2 * l * len;
+		x[l] = a[l] + len;
+	}
+	memset(one, 0, len * sizeof(limb));
+	one[0] = 1;
+
+	for (l = 0; l < lanes; l++) {
+		if (in_len[l] <= len * sizeof(limb)) {
+			load(a[l], len, in[l], in_len[l]);
+			if (less(a[l], m->n, len)) {
+				valid |= 1 << l;
+				continue;
+			}
+		}
+		memset(a[l], 0, len * sizeof(limb));
+	}
+
+	pow_lanes(m, lanes, x, a, one, t);
+
+	for (l = 0; l < lanes; l++)
+		store(out[l], m->bytes, x[l]);
+	free(mem);
+	return valid;
+}
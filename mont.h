@@ -0,0 +1,61 @@
+/* mont.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MONT_H_
+#define _MONT_H_
+
+#include "crypto.h"
+#include "montkey.h"
+
+/* Montgomery arithmetic for the RSA public key operation.  mont_exp can
+ * run a few exponentiations by the same key in lockstep, their carry
+ * chains interleaved, for machines where one chain leaves the
+ * multiplier idle */
+
+/* the most exponentiations mont_exp runs at once.  on x86-64 the loop
+ * is bound by multiply and add throughput rather than latency, so a
+ * second lane gains nothing: two ran about 10% slower per exponentiation
+ * than one at 2048 to 4096 bits */
+#define MONT_LANES 1
+
+/* work out the constants for modulus n and exponent e (big endian);
+ * n must be odd */
+int mont_init(struct mont *m, const u8 *n, u32 n_sz, const u8 *e, u32 e_sz);
+void mont_clear(struct mont *m);
+
+/* out[l] = in[l]^e mod n for each of lanes (1 to MONT_LANES) inputs of
+ * in_len[l] big-endian bytes, written as m->bytes big-endian bytes.
+ * returns a mask of the lanes whose input was less than n, as it must
+ * be; the output of the others is meaningless.  -1 if out of memory
+ * or lanes is out of range */
+int mont_exp(const struct mont *m, const u8 **in, const u32 *in_len,
+	     u8 **out, int lanes);
+
+#endif
@@ -0,0 +1,59 @@
+/* montkey.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MONTKEY_H_
+#define _MONTKEY_H_
+
+#include <stdint.h>
+
+/* a public key in Montgomery form, with nothing else needed to declare
+ * it, so that crypto.h can embed it in prepared keys; the arithmetic is
+ * in mont.h.  numbers are fixed-length arrays of little-endian limbs */
+#ifdef __SIZEOF_INT128__
+typedef uint64_t limb;
+typedef unsigned __int128 dlimb;
+#else
+typedef uint32_t limb;
+typedef uint64_t dlimb;
+#endif
+
+#define LIMB_BITS (sizeof(limb) * 8)
+
+struct mont {
+	uint32_t len;     /* limbs in n */
+	uint32_t bytes;   /* significant bytes of n */
+	limb n0inv;       /* -1 / n mod 2^LIMB_BITS */
+	limb *n;
+	limb *rr;         /* R^2 mod n, where R = 2^(LIMB_BITS * len) */
+	uint8_t *e;       /* public exponent, big endian */
+	uint32_t e_sz;
+};
+
+#endif
@@ -0,0 +1,324 @@
+/* packet.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "packet.h"
+#include "diag.h"
+
+int packet_length(const u8 *data, u32 len, struct packet_header *hdr)
+{
+	u8 c;
+
+	if (len < 1)
+		return 0;
+
+	c = data[0];
+	hdr->partial = 0;
+	if (c < 192) {
+		hdr->len = c;
+		return 1;
+	}
+	if (c < 224) {
+		if (len < 2)
+			return 0;
+		hdr->len = ((c - 192) << 8) + data[1] + 192;
+		return 2;
+	}
+	if (c == 255) {
+		if (len < 5)
+			return 0;
+		hdr->len = ((u64) data[1] << 24) | (data[2] << 16) |
+			(data[3] << 8) | data[4];
+		return 5;
+	}
+	/* partial body length, rfc4880 4.2.2.4 */
+	hdr->len = 1 << (c & 0x1f);
+	hdr->partial = 1;
+	return 1;
+}
+
+int packet_header(const u8 *data, u32 len, struct packet_header *hdr)
+{
+	u8 x;
+	int r;
+
+	if (len < 1)
+		return 0;
+
+	x = data[0];
+	if (!(x & 0x80))
+		return -1;
+
+	hdr->partial = 0;
+	hdr->indeterminate = 0;
+
+	if (x & 0x40) {
+		hdr->tag = x & 0x3f;
+		r = packet_length(data + 1, len - 1, hdr);
+		return r > 0 ? r + 1 : r;
+	}
+
+	hdr->tag = (x >> 2) & 15;
+	switch (x & 3) {
+	case 0:
+		if (len < 2)
+			return 0;
+		hdr->len = data[1];
+		return 2;
+	case 1:
+		if (len < 3)
+			return 0;
+		hdr->len = (data[1] << 8) | data[2];
+		return 3;
+	case 2:
+		if (len < 5)
+			return 0;
+		hdr->len = ((u64) data[1] << 24) | (data[2] << 16) |
+			(data[3] << 8) | data[4];
+		return 5;
+	default:
+		hdr->len = 0;
+		hdr->indeterminate = 1;
+		return 1;
+	}
+}
+
+int packet_walk(u8 **data, u64 *len, struct packet_header *hdr, u8 **body)
+{
+	u8 *p = *data;
+	u64 left = *len;
+	int n;
+
+	if (left == 0)
+		return 0;
+
+	n = packet_header(p, left > 6 ? 6 : left, hdr);
+	if (n <= 0) {
+		diag("invalid packet header %02x", p[0]);
+		return -1;
+	}
+	p += n;
+	left -= n;
+
+	if (hdr->indeterminate)
+		hdr->len = left;
+
+	*body = p;
+	if (hdr->partial) {
+		/* only data packets are split, and no caller of this wants
+		 * their contents: step over each chunk */
+		*body = 0;
+		for (;;) {
+			if (hdr->len > left)
+				return -1;
+			p += hdr->len;
+			left -= hdr->len;
+			if (!hdr->partial)
+				break;
+			n = packet_length(p, left > 5 ? 5 : left, hdr);
+			if (n <= 0)
+				return -1;
+			p += n;
+			left -= n;
+		}
+	} else {
+		if (hdr->len > left)
+			return -1;
+		p += hdr->len;
+		left -= hdr->len;
+	}
+
+	*data = p;
+	*len = left;
+	return 1;
+}
+
+void packet_reader_init(struct packet_reader *pr, struct source *src)
+{
+	pr->src = src;
+	pr->left = 0;
+	pr->active = 0;
+}
+
+/* pull header bytes one at a time until decode() is satisfied */
+static int read_header(struct packet_reader *pr,
+		       int (*decode)(const u8 *, u32, struct packet_header *),
+		       int eof_ok)
+{
+	u8 buf[6];
+	u32 n = 0;
+	int r;
+
+	for (;;) {
+		r = decode(buf, n, &pr->hdr);
+		if (r)
+			return r < 0 ? -1 : 1;
+		if (n == sizeof(buf))
+			return -1;
+		r = source_read(pr->src, buf + n, 1);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			return (n == 0 && eof_ok) ? 0 : -1;
+		n++;
+	}
+}
+
+int packet_next(struct packet_reader *pr)
+{
+	int r;
+
+	if (pr->active && packet_skip(pr))
+		return -1;
+
+	r = read_header(pr, packet_header, 1);
+	if (r <= 0)
+		return r;
+
+	pr->left = pr->hdr.len;
+	pr->active = 1;
+	return 1;
+}
+
+int packet_read(struct packet_reader *pr, u8 *buf, u32 len)
+{
+	int r;
+
+	while (pr->active) {
+		if (pr->hdr.indeterminate) {
+			r = source_read(pr->src, buf, len);
+			if (r == 0)
+				pr->active = 0;
+			return r;
+		}
+		if (pr->left) {
+			if (len > pr->left)
+				len = pr->left;
+			r = source_read(pr->src, buf, len);
+			if (r <= 0) {
+				diag("truncated packet body");
+				return -1;
+			}
+			pr->left -= r;
+			return r;
+		}
+		if (!pr->hdr.partial) {
+			pr->active = 0;
+			break;
+		}
+		if (read_header(pr, packet_length, 0) != 1) {
+			diag("bad partial body length");
+			return -1;
+		}
+		pr->left = pr->hdr.len;
+	}
+	return 0;
+}
+
+int packet_read_full(struct packet_reader *pr, u8 *buf, u32 len)
+{
+	u32 have = 0;
+	int r;
+
+	while (have < len) {
+		r = packet_read(pr, buf + have, len - have);
+		if (r <= 0)
+			return -1;
+		have += r;
+	}
+	return len;
+}
+
+int packet_skip(struct packet_reader *pr)
+{
+	u8 buf[4096];
+	int r;
+
+	while ((r = packet_read(pr, buf, sizeof(buf))) > 0)
+		;
+	return r;
+}
+
+int packet_skip_by(struct packet_reader *pr,
+		   int (*skip)(void *cookie, u64 len), void *cookie)
+{
+	while (pr->active) {
+		/* no length to skip: it runs to end of input */
+		if (pr->hdr.indeterminate)
+			return packet_skip(pr);
+		if (pr->left) {
+			if (skip(cookie, pr->left))
+				return -1;
+			pr->left = 0;
+		}
+		if (!pr->hdr.partial) {
+			pr->active = 0;
+			break;
+		}
+		if (read_header(pr, packet_length, 0) != 1) {
+			diag("bad partial body length");
+			return -1;
+		}
+		pr->left = pr->hdr.len;
+	}
+	return 0;
+}
+
+struct packet_body_source {
+	struct source src;
+	struct packet_reader *pr;
+};
+
+static int body_read(struct source *src, u8 *buf, u32 len)
+{
+	struct packet_body_source *bs = (struct packet_body_source *) src;
+
+	return packet_read(bs->pr, buf, len);
+}
+
+static void body_close(struct source *src)
+{
+	free(src);
+}
+
+struct source *packet_source(struct packet_reader *pr)
+{
+	struct packet_body_source *bs;
+
+	bs = malloc(sizeof(*bs));
+	if (!bs)
+		return 0;
+	bs->src.read = body_read;
+	bs->src.close = body_close;
+	bs->pr = pr;
+	return &bs->src;
+}
@@ -0,0 +1,93 @@
+/* packet.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include "crypto.h"
+#include "stream.h"
+
+/* packet header per rfc4880 4.2, old or new format */
+struct packet_header {
+	unsigned tag;
+	u64 len;           /* length of the (first) body chunk */
+	int partial;       /* another length header follows len bytes of body */
+	int indeterminate; /* old format type 3: body runs to end of input */
+};
+
+/* decode a packet header at data[0:len]
+ * returns the header size, 0 if more bytes are needed, -1 if invalid */
+int packet_header(const u8 *data, u32 len, struct packet_header *hdr);
+
+/* decode the length header of the next partial body chunk (same
+ * return convention); only len and partial are updated */
+int packet_length(const u8 *data, u32 len, struct packet_header *hdr);
+
+/* step over the next packet of an in-memory buffer: returns 1 with hdr
+ * set and *body pointing at its contents, 0 at end, -1 if malformed
+ * partial-length packets are stepped over with *body = 0 */
+int packet_walk(u8 **data, u64 *len, struct packet_header *hdr, u8 **body);
+
+/* walks the packets of a source one at a time, without ever needing
+ * more than the current chunk of a body in memory */
+struct packet_reader {
+	struct source *src;
+	struct packet_header hdr;
+	u64 left;    /* unread bytes of the current body chunk */
+	int active;  /* a packet body is open */
+};
+
+void packet_reader_init(struct packet_reader *pr, struct source *src);
+
+/* skip whatever remains of the current packet and read the next header
+ * returns 1 with pr->hdr filled in, 0 at end of input, -1 on error */
+int packet_next(struct packet_reader *pr);
+
+/* read body bytes of the current packet, crossing partial chunk
+ * boundaries: returns count, 0 at end of body, -1 on error */
+int packet_read(struct packet_reader *pr, u8 *buf, u32 len);
+
+/* read exactly len body bytes: returns len, or -1 on error or short body */
+int packet_read_full(struct packet_reader *pr, u8 *buf, u32 len);
+
+/* discard the rest of the current body */
+int packet_skip(struct packet_reader *pr);
+
+/* discard the rest of the current body without reading it: skip(cookie,
+ * n) must step over n bytes of the underlying input by other means, such
+ * as lseek on a file.  only chunk length headers are read */
+int packet_skip_by(struct packet_reader *pr,
+		   int (*skip)(void *cookie, u64 len), void *cookie);
+
+/* the rest of the current body as a source, for packets that hold
+ * further packets (pr is not closed by source_close) */
+struct source *packet_source(struct packet_reader *pr);
+
+#endif
@@ -0,0 +1,524 @@
+/* pgpverify.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pgpverify.h"
+#include "crypto.h"
+#include "rfc4880.h"
+#include "stream.h"
+#include "armor.h"
+#include "pool.h"
+#include "diag.h"
+
+/* keys from a prepared key cache, or from the keyring itself with its
+ * keys prepared; either way nothing is written after open */
+struct pgpverify {
+	struct keyring *kr;
+	struct keycache *kc;
+	u8 *data; /* pgpverify_load's copy, which kr points into */
+};
+
+struct pgpverify_stream {
+	struct pgpverify *pv;
+	struct rsa_signature *signature;
+	struct rfc4880_verify_ctx ctx;
+};
+
+/* a library must not write on its caller's stderr: diagnostics are
+ * kept for pgpverify_error instead */
+static void __attribute__((constructor)) quiet(void)
+{
+	diag_quiet();
+}
+
+const char *pgpverify_error(void)
+{
+	return diag_last();
+}
+
+/* the parsers say what exactly was wrong, where they can: only fall
+ * back on what we were doing at the time */
+static void fail(const char *what)
+{
+	if (!diag_last()[0])
+		diag("%s", what);
+}
+
+static struct pgpverify *prepared(struct pgpverify *pv)
+{
+	if (!pv->kc && (!pv->kr || !keyring_count(pv->kr) ||
+			keyring_prepare(pv->kr))) {
+		pgpverify_close(pv);
+		return 0;
+	}
+	return pv;
+}
+
+struct pgpverify *pgpverify_open(const char *keyring, const char *keycache)
+{
+	struct pgpverify *pv;
+
+	diag_clear();
+	pv = calloc(1, sizeof(*pv));
+	if (!pv)
+		return 0;
+	if (keycache) {
+		pv->kc = keycache_open(keycache, keyring);
+		if (pv->kc && keycache_count(pv->kc))
+			return pv;
+		keycache_close(pv->kc);
+		pv->kc = 0;
+	}
+	pv->kr = keyring_open(keyring);
+	if (pv->kr && keycache && keycache_write(keycache, pv->kr, keyring))
+		diag("warning: cannot write key cache '%s'", keycache);
+	return prepared(pv);
+}
+
+struct pgpverify *pgpverify_load(const void *keyring, size_t len)
+{
+	struct pgpverify *pv;
+	u64 n = len;
+
+	diag_clear();
+	pv = calloc(1, sizeof(*pv));
+	if (!pv)
+		return 0;
+	if (armor_detect(keyring, len)) {
+		if (armor_decode(keyring, len, &pv->data, &n)) {
+			free(pv);
+			return 0;
+		}
+	} else {
+		pv->data = malloc(len ? len : 1);
+		if (!pv->data) {
+			free(pv);
+			return 0;
+		}
+		memcpy(pv->data, keyring, len);
+	}
+	pv->kr = keyring_load(pv->data, n);
+	return prepared(pv);
+}
+
+void pgpverify_close(struct pgpverify *pv)
+{
+	if (!pv)
+		return;
+	keyring_free(pv->kr);
+	keycache_close(pv->kc);
+	free(pv->data);
+	free(pv);
+}
+
+unsigned pgpverify_key_count(struct pgpverify *pv)
+{
+	return pv->kc ? keycache_count(pv->kc) : keyring_count(pv->kr);
+}
+
+static int check(struct pgpverify *pv, struct rfc4880_verify_ctx *ctx,
+		 struct rsa_signature *signature)
+{
+	int r;
+
+	if (pv->kc)
+		r = rfc4880_verify_keycache(ctx, pv->kc, signature);
+	else
+		r = rfc4880_verify_keyring(ctx, pv->kr, signature);
+	return r ? PGPVERIFY_FAILED : PGPVERIFY_OK;
+}
+
+/* parse sig, and set ctx up for the kind of document it signs */
+static struct rsa_signature *load_signature(const void *sig, size_t sig_len,
+					    struct rfc4880_verify_ctx *ctx)
+{
+	struct rsa_signature *signature = 0;
+
+	diag_clear();
+	if (sig_len > INT_MAX ||
+	    rfc4880_load_signature((u8 *) sig, sig_len, &signature)) {
+		fail("failed to load signature");
+		free(signature);
+		return 0;
+	}
+	if (signature->type == SIG_CANONICAL_TEXT_DOC)
+		rfc4880_verify_init_text(ctx);
+	else
+		rfc4880_verify_init(ctx);
+	return signature;
+}
+
+int pgpverify_detached(struct pgpverify *pv, const void *msg, size_t len,
+		       const void *sig, size_t sig_len)
+{
+	struct rsa_signature *signature;
+	struct rfc4880_verify_ctx ctx;
+	int r;
+
+	signature = load_signature(sig, sig_len, &ctx);
+	if (!signature)
+		return PGPVERIFY_ERROR;
+	rfc4880_verify_update(&ctx, msg, len);
+	r = check(pv, &ctx, signature);
+	free(signature);
+	return r;
+}
+
+int pgpverify_detached_fd(struct pgpverify *pv, int fd,
+			  const void *sig, size_t sig_len)
+{
+	struct rsa_signature *signature;
+	struct rfc4880_verify_ctx ctx, *p = &ctx;
+	int r;
+
+	signature = load_signature(sig, sig_len, &ctx);
+	if (!signature)
+		return PGPVERIFY_ERROR;
+	if (rfc4880_hash_fd(fd, &p, 1, 0)) {
+		fail("failed to read message");
+		r = PGPVERIFY_ERROR;
+	} else {
+		r = check(pv, &ctx, signature);
+	}
+	free(signature);
+	return r;
+}
+
+int pgpverify_inline_fd(struct pgpverify *pv, int fd)
+{
+	struct rsa_signature *signature;
+	struct rfc4880_verify_ctx ctx;
+	struct source *src;
+	int r;
+
+	diag_clear();
+	src = source_pipeline(fd, PIPELINE_DEPTH, PIPELINE_SIZE);
+	if (!src)
+		return PGPVERIFY_ERROR;
+	r = rfc4880_read_inline(src, &ctx, &signature, 0, 0);
+	source_close(src);
+	if (r) {
+		fail("failed to read signed message");
+		return PGPVERIFY_ERROR;
+	}
+	r = check(pv, &ctx, signature);
+	free(signature);
+	return r;
+}
+
+struct pgpverify_stream *pgpverify_stream_new(struct pgpverify *pv,
+					      const void *sig, size_t sig_len)
+{
+	struct pgpverify_stream *st;
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		return 0;
+	st->pv = pv;
+	st->signature = load_signature(sig, sig_len, &st->ctx);
+	if (!st->signature) {
+		free(st);
+		return 0;
+	}
+	return st;
+}
+
+void pgpverify_stream_update(struct pgpverify_stream *st,
+			     const void *data, size_t len)
+{
+	rfc4880_verify_update(&st->ctx, data, len);
+}
+
+int pgpverify_stream_final(struct pgpverify_stream *st)
+{
+	int r;
+
+	diag_clear();
+	r = check(st->pv, &st->ctx, st->signature);
+	free(st->signature);
+	free(st);
+	return r;
+}
+
+/* -- asynchronous checks -- */
+
+struct async_job {
+	struct pgpverify_async *as;
+	struct pgpverify *pv;
+	const void *msg;
+	size_t len;
+	const void *sig;
+	size_t sig_len;
+	void (*done)(void *cookie, int status);
+	void *cookie;
+	int status;
+	char error[PGPVERIFY_ERROR_MAX];
+	struct async_job *next; /* on the free or finished list */
+};
+
+/* every job slot is allocated up front, so the depth limit is simply
+ * the free list running dry */
+struct pgpverify_async {
+	struct pool *pool;
+	struct async_job *jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t room;
+	struct async_job *free;
+	struct async_job *finished;
+	struct async_job **finished_tail;
+	int rfd; /* the same eventfd twice, or the ends of a pipe */
+	int wfd;
+};
+
+#define ASYNC_DEPTH_PER_WORKER 4
+
+static int notify_open(struct pgpverify_async *as)
+{
+	int fd[2];
+
+#ifdef __linux__
+	fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd[0] >= 0) {
+		as->rfd = as->wfd = fd[0];
+		return 0;
+	}
+#endif
+	if (pipe(fd))
+		return -1;
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, O_NONBLOCK);
+	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+	as->rfd = fd[0];
+	as->wfd = fd[1];
+	return 0;
+}
+
+/* an eventfd takes a count of 8 bytes, a pipe anything; either way a
+ * full one is already readable, so a failed write loses nothing */
+static void notify(struct pgpverify_async *as)
+{
+	uint64_t one = 1;
+	ssize_t r;
+
+	r = write(as->wfd, &one, as->rfd == as->wfd ? sizeof(one) : 1);
+	(void) r;
+}
+
+static void notify_clear(struct pgpverify_async *as)
+{
+	u8 buf[64];
+
+	while (read(as->rfd, buf, sizeof(buf)) > 0)
+		;
+}
+
+struct pgpverify_async *pgpverify_async_new(unsigned threads,
+					    unsigned depth)
+{
+	struct pgpverify_async *as;
+	unsigned n;
+
+	if (threads == 0)
+		threads = pool_cpus();
+	if (depth == 0)
+		depth = threads * ASYNC_DEPTH_PER_WORKER;
+
+	as = calloc(1, sizeof(*as));
+	if (!as)
+		return 0;
+	as->jobs = calloc(depth, sizeof(*as->jobs));
+	if (!as->jobs || notify_open(as)) {
+		free(as->jobs);
+		free(as);
+		return 0;
+	}
+	as->pool = pool_create(threads);
+	if (!as->pool) {
+		close(as->rfd);
+		if (as->wfd != as->rfd)
+			close(as->wfd);
+		free(as->jobs);
+		free(as);
+		return 0;
+	}
+	for (n = 0; n < depth; n++) {
+		as->jobs[n].as = as;
+		as->jobs[n].next = as->free;
+		as->free = &as->jobs[n];
+	}
+	as->finished_tail = &as->finished;
+	pthread_mutex_init(&as->lock, 0);
+	pthread_cond_init(&as->room, 0);
+	return as;
+}
+
+void pgpverify_async_free(struct pgpverify_async *as)
+{
+	if (!as)
+		return;
+	pool_destroy(as->pool);
+	close(as->rfd);
+	if (as->wfd != as->rfd)
+		close(as->wfd);
+	pthread_mutex_destroy(&as->lock);
+	pthread_cond_destroy(&as->room);
+	free(as->jobs);
+	free(as);
+}
+
+/* with as->lock held */
+static void release(struct pgpverify_async *as, struct async_job *job)
+{
+	job->next = as->free;
+	as->free = job;
+	pthread_cond_signal(&as->room);
+}
+
+static void async_run(struct pool *pool, void *arg)
+{
+	struct async_job *job = arg;
+	struct pgpverify_async *as = job->as;
+
+	job->status = pgpverify_detached(job->pv, job->msg, job->len,
+					 job->sig, job->sig_len);
+	snprintf(job->error, sizeof(job->error), "%s", diag_last());
+	if (job->done) {
+		job->done(job->cookie, job->status);
+		pthread_mutex_lock(&as->lock);
+		release(as, job);
+		pthread_mutex_unlock(&as->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&as->lock);
+	job->next = 0;
+	*as->finished_tail = job;
+	as->finished_tail = &job->next;
+	pthread_mutex_unlock(&as->lock);
+	notify(as);
+}
+
+static int submit(struct pgpverify_async *as, struct pgpverify *pv,
+		  const void *msg, size_t len, const void *sig, size_t sig_len,
+		  void (*done)(void *cookie, int status), void *cookie,
+		  int wait)
+{
+	struct async_job *job;
+
+	pthread_mutex_lock(&as->lock);
+	while (!as->free && wait)
+		pthread_cond_wait(&as->room, &as->lock);
+	job = as->free;
+	if (job)
+		as->free = job->next;
+	pthread_mutex_unlock(&as->lock);
+	if (!job) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	job->pv = pv;
+	job->msg = msg;
+	job->len = len;
+	job->sig = sig;
+	job->sig_len = sig_len;
+	job->done = done;
+	job->cookie = cookie;
+	if (pool_spawn(as->pool, async_run, job)) {
+		pthread_mutex_lock(&as->lock);
+		release(as, job);
+		pthread_mutex_unlock(&as->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+int pgpverify_submit(struct pgpverify_async *as, struct pgpverify *pv,
+		     const void *msg, size_t len,
+		     const void *sig, size_t sig_len,
+		     void (*done)(void *cookie, int status), void *cookie)
+{
+	return submit(as, pv, msg, len, sig, sig_len, done, cookie, 1);
+}
+
+int pgpverify_try_submit(struct pgpverify_async *as, struct pgpverify *pv,
+			 const void *msg, size_t len,
+			 const void *sig, size_t sig_len,
+			 void (*done)(void *cookie, int status), void *cookie)
+{
+	return submit(as, pv, msg, len, sig, sig_len, done, cookie, 0);
+}
+
+int pgpverify_async_fd(struct pgpverify_async *as)
+{
+	return as->rfd;
+}
+
+int pgpverify_async_reap(struct pgpverify_async *as,
+			 struct pgpverify_result *out, int max)
+{
+	struct async_job *job;
+	int n = 0;
+
+	/* clear first: a result finishing after this re-arms it */
+	notify_clear(as);
+	pthread_mutex_lock(&as->lock);
+	while (n < max && (job = as->finished)) {
+		as->finished = job->next;
+		if (!as->finished)
+			as->finished_tail = &as->finished;
+		out[n].cookie = job->cookie;
+		out[n].status = job->status;
+		memcpy(out[n].error, job->error, sizeof(out[n].error));
+		n++;
+		release(as, job);
+	}
+	job = as->finished;
+	pthread_mutex_unlock(&as->lock);
+
+	/* results left over: stay readable */
+	if (job)
+		notify(as);
+	return n;
+}
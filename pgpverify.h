@@ -0,0 +1,149 @@
+/* pgpverify.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PGPVERIFY_H_
+#define _PGPVERIFY_H_
+
+#include <stddef.h>
+
+/* libpgpverify: checking OpenPGP RSA signatures against a set of trusted
+ * keys, for programs that link the verifier in rather than run verify.
+ *
+ * thread safety: a struct pgpverify is read-only from the moment
+ * pgpverify_open or pgpverify_load returns until pgpverify_close, and
+ * the library keeps no global mutable state beyond each thread's last
+ * error, so any number of threads may make any of the calls below on
+ * one context at the same time without locking.  a struct
+ * pgpverify_stream belongs to whichever one thread is using it.
+ * pgpverify_close must not race with other calls on the same context.
+ *
+ * the verify calls return one of these.  nothing is ever printed: what
+ * went wrong is described by pgpverify_error */
+#define PGPVERIFY_OK		0
+#define PGPVERIFY_FAILED	1	/* bad signature, or not by a key we have */
+#define PGPVERIFY_ERROR		2	/* unreadable input, or out of memory */
+
+/* why the calling thread's latest call failed, "" if it gave no reason
+ * (a signature that simply does not check out).  valid until that
+ * thread's next call into the library */
+const char *pgpverify_error(void);
+
+#define PGPVERIFY_ERROR_MAX	128
+
+struct pgpverify;
+
+/* trust every RSA key and subkey in keyring (a file, binary or armored),
+ * with their bignums worked out once up front.  if keycache is given,
+ * keys are mapped from that prepared key cache when it is current, and
+ * it is rebuilt when it is not */
+struct pgpverify *pgpverify_open(const char *keyring, const char *keycache);
+
+/* the same for a keyring in memory, which is copied */
+struct pgpverify *pgpverify_load(const void *keyring, size_t len);
+
+void pgpverify_close(struct pgpverify *pv);
+
+unsigned pgpverify_key_count(struct pgpverify *pv);
+
+/* msg[0:len] against a detached signature, binary or armored */
+int pgpverify_detached(struct pgpverify *pv, const void *msg, size_t len,
+		       const void *sig, size_t sig_len);
+
+/* everything read from fd (a file, pipe or socket) against a detached
+ * signature; fd is left open.  files are read, never mapped, so one cut
+ * short meanwhile is an error rather than a SIGBUS.  a regular file is
+ * taken whole, and only up to the size it has at the call */
+int pgpverify_detached_fd(struct pgpverify *pv, int fd,
+			  const void *sig, size_t sig_len);
+
+/* a message read from fd that carries its own signature: one-pass
+ * signed, possibly compressed, or cleartext signed */
+int pgpverify_inline_fd(struct pgpverify *pv, int fd);
+
+/* a message fed in pieces of any size against a detached signature:
+ * final returns the result and frees the stream */
+struct pgpverify_stream;
+
+struct pgpverify_stream *pgpverify_stream_new(struct pgpverify *pv,
+					      const void *sig, size_t sig_len);
+void pgpverify_stream_update(struct pgpverify_stream *st,
+			     const void *data, size_t len);
+int pgpverify_stream_final(struct pgpverify_stream *st);
+
+/* checks run on a pool of worker threads, for callers such as event
+ * loops that must not block on one.  msg and sig are not copied: they
+ * must stay valid until the check completes.  at most depth checks may
+ * be outstanding at once (queued, running, or finished and waiting to
+ * be reaped); past that, pgpverify_submit waits for room and
+ * pgpverify_try_submit fails with EAGAIN.
+ *
+ * a check with a done callback reports by calling done(cookie, status)
+ * on a worker thread, where pgpverify_error gives the reason for a
+ * failure; it must not wait in pgpverify_submit, since the slot it
+ * holds is only given back once it returns.  a check without a callback
+ * reports through pgpverify_async_fd, which polls readable while
+ * results wait for pgpverify_async_reap.
+ *
+ * submit, try_submit and reap may be called from any threads at once;
+ * pgpverify_async_free waits for every check still queued or running,
+ * drops unreaped results, and must not race with the others */
+struct pgpverify_async;
+
+struct pgpverify_result {
+	void *cookie;
+	int status;
+	char error[PGPVERIFY_ERROR_MAX]; /* as pgpverify_error */
+};
+
+/* threads workers (0 for one per CPU), depth outstanding checks (0 for
+ * a few per worker) */
+struct pgpverify_async *pgpverify_async_new(unsigned threads,
+					    unsigned depth);
+void pgpverify_async_free(struct pgpverify_async *as);
+
+/* 0 once queued, -1 if it cannot be (errno EAGAIN if there is no room) */
+int pgpverify_submit(struct pgpverify_async *as, struct pgpverify *pv,
+		     const void *msg, size_t len,
+		     const void *sig, size_t sig_len,
+		     void (*done)(void *cookie, int status), void *cookie);
+int pgpverify_try_submit(struct pgpverify_async *as, struct pgpverify *pv,
+			 const void *msg, size_t len,
+			 const void *sig, size_t sig_len,
+			 void (*done)(void *cookie, int status), void *cookie);
+
+/* an eventfd (a pipe where there are none), readable while results of
+ * checks without a callback are waiting; owned by as */
+int pgpverify_async_fd(struct pgpverify_async *as);
+
+/* take up to max waiting results without blocking: returns how many */
+int pgpverify_async_reap(struct pgpverify_async *as,
+			 struct pgpverify_result *out, int max);
+
+#endif
@@ -0,0 +1,339 @@
+/* pool.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "diag.h"
+
+struct pool_for {
+	u64 next; /* the next item to hand out */
+	u64 count;
+	void (*fn)(void *arg, u64 i);
+	void *arg;
+};
+
+unsigned pool_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool_for *pf = arg;
+	u64 i;
+
+	while ((i = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) <
+	       pf->count)
+		pf->fn(pf->arg, i);
+	return 0;
+}
+
+int pool_for(unsigned threads, u64 count,
+	     void (*fn)(void *arg, u64 i), void *arg)
+{
+	struct pool_for pf;
+	pthread_t *tids;
+	unsigned n, started = 0;
+
+	if (threads == 0)
+		threads = pool_cpus();
+	if (threads > count)
+		threads = count ? count : 1;
+
+	pf.next = 0;
+	pf.count = count;
+	pf.fn = fn;
+	pf.arg = arg;
+
+	tids = malloc(threads * sizeof(*tids));
+	if (!tids)
+		return -1;
+	for (n = 1; n < threads; n++) {
+		if (pthread_create(&tids[n], 0, pool_worker, &pf))
+			break;
+		started++;
+	}
+	if (started + 1 < threads)
+		diag("pool: started %u of %u threads", started + 1, threads);
+
+	/* the caller works too, so even no threads at all gets it done */
+	pool_worker(&pf);
+	for (n = 1; n <= started; n++)
+		pthread_join(tids[n], 0);
+	free(tids);
+	return 0;
+}
+
+/* -- work stealing -- */
+
+struct task {
+	void (*fn)(struct pool *, void *);
+	void *arg;
+};
+
+/* the owner pushes and pops at the bottom, thieves take from the top;
+ * a lock per deque is only ever contended by a steal */
+struct deque {
+	pthread_mutex_t lock;
+	struct task *tasks;
+	u32 mask; /* ring of mask + 1 slots */
+	u64 top, bottom;
+};
+
+struct worker {
+	struct pool *pool;
+	struct deque dq;
+	pthread_t tid;
+	u32 seed; /* for picking victims */
+};
+
+struct pool {
+	struct worker *workers;
+	unsigned count;
+	unsigned next;      /* round robin for tasks spawned from outside */
+
+	u64 queued;         /* tasks sitting in deques */
+	u64 pending;        /* spawned and not yet finished */
+	unsigned sleepers;
+	int stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* queued became non-zero, or stop */
+	pthread_cond_t done; /* pending reached zero */
+};
+
+static __thread struct worker *self;
+
+static int deque_push(struct deque *dq, struct task *t)
+{
+	struct task *tasks;
+	u64 n;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom - dq->top > dq->mask) {
+		/* full: unroll the ring into one twice the size */
+		tasks = malloc(2 * (dq->mask + 1) * sizeof(*tasks));
+		if (!tasks) {
+			pthread_mutex_unlock(&dq->lock);
+			return -1;
+		}
+		for (n = dq->top; n < dq->bottom; n++)
+			tasks[n - dq->top] = dq->tasks[n & dq->mask];
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->bottom -= dq->top;
+		dq->top = 0;
+		dq->mask = 2 * dq->mask + 1;
+	}
+	dq->tasks[dq->bottom++ & dq->mask] = *t;
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+static int deque_take(struct deque *dq, struct task *t, int steal)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->top < dq->bottom) {
+		if (steal)
+			*t = dq->tasks[dq->top++ & dq->mask];
+		else
+			*t = dq->tasks[--dq->bottom & dq->mask];
+		r = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return r;
+}
+
+static int find_task(struct worker *w, struct task *t)
+{
+	struct pool *pool = w->pool;
+	unsigned n, start;
+
+	if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0)
+		return 0;
+	if (deque_take(&w->dq, t, 0))
+		goto found;
+
+	/* start somewhere random so that thieves spread out */
+	w->seed = w->seed * 1103515245 + 12345;
+	start = (w->seed >> 16) % pool->count;
+	for (n = 0; n < pool->count; n++) {
+		struct worker *victim = &pool->workers[(start + n) % pool->count];
+		if (victim != w && deque_take(&victim->dq, t, 1))
+			goto found;
+	}
+	return 0;
+
+found:
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+static void *steal_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *pool = w->pool;
+	struct task t;
+
+	self = w;
+	for (;;) {
+		if (find_task(w, &t)) {
+			t.fn(pool, t.arg);
+			if (__atomic_sub_fetch(&pool->pending, 1,
+					       __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->done);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+
+		/* announce ourselves before the last look at queued, so a
+		 * spawner either sees us asleep or we see its task */
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (!pool->stop &&
+		       __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+int pool_spawn(struct pool *pool, void (*fn)(struct pool *, void *),
+	       void *arg)
+{
+	struct task t = { fn, arg };
+	struct worker *w = self;
+
+	if (!w || w->pool != pool)
+		w = &pool->workers[__atomic_fetch_add(&pool->next, 1,
+						      __ATOMIC_RELAXED) %
+				   pool->count];
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	if (deque_push(&w->dq, &t)) {
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+struct pool *pool_create(unsigned threads)
+{
+	struct pool *pool;
+	unsigned n;
+
+	if (threads == 0)
+		threads = pool_cpus();
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return 0;
+	pool->workers = calloc(threads, sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return 0;
+	}
+	pthread_mutex_init(&pool->lock, 0);
+	pthread_cond_init(&pool->work, 0);
+	pthread_cond_init(&pool->done, 0);
+
+	for (n = 0; n < threads; n++) {
+		struct worker *w = &pool->workers[n];
+		w->pool = pool;
+		w->seed = n + 1;
+		pthread_mutex_init(&w->dq.lock, 0);
+		w->dq.mask = 63;
+		w->dq.tasks = malloc((w->dq.mask + 1) * sizeof(struct task));
+		if (!w->dq.tasks)
+			break;
+	}
+	pool->count = n;
+	for (n = 0; n < pool->count; n++)
+		if (pthread_create(&pool->workers[n].tid, 0, steal_worker,
+				   &pool->workers[n]))
+			break;
+	if (n < threads)
+		diag("pool: started %u of %u threads", n, threads);
+	/* no going back once some are running: make do with those */
+	while (pool->count > n)
+		free(pool->workers[--pool->count].dq.tasks);
+	if (pool->count == 0) {
+		free(pool->workers);
+		free(pool);
+		return 0;
+	}
+	return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	unsigned n;
+
+	if (!pool)
+		return;
+	pool_wait(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (n = 0; n < pool->count; n++) {
+		pthread_join(pool->workers[n].tid, 0);
+		free(pool->workers[n].dq.tasks);
+	}
+	free(pool->workers);
+	free(pool);
+}
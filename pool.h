@@ -0,0 +1,66 @@
+/* pool.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "crypto.h"
+
+/* the number of CPUs this process may run on */
+unsigned pool_cpus(void);
+
+/* call fn(arg, i) for every i in [0, count) from threads workers (0 for
+ * one per CPU), the caller being one of them; items are handed out in
+ * order, one at a time, so slow items do not hold up the rest.  returns
+ * 0 once every call has returned */
+int pool_for(unsigned threads, u64 count,
+	     void (*fn)(void *arg, u64 i), void *arg);
+
+/* a work-stealing pool for tasks that spawn further tasks: each worker
+ * keeps its own deque, running the newest of its own tasks first and
+ * stealing the oldest of someone else's when it runs dry, so a task that
+ * takes a long time holds up nothing but its own worker */
+struct pool;
+
+struct pool *pool_create(unsigned threads); /* 0 for one per CPU */
+
+/* queue fn(pool, arg): on the calling worker's own deque when called
+ * from a task, otherwise on each worker's in turn */
+int pool_spawn(struct pool *pool, void (*fn)(struct pool *, void *),
+	       void *arg);
+
+/* return once every task spawned so far, and every task they spawn,
+ * has finished */
+void pool_wait(struct pool *pool);
+
+/* wait, then stop the workers */
+void pool_destroy(struct pool *pool);
+
+#endif
@@ -0,0 +1,290 @@
+/* resultcache.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR 
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crypto.h"
+
+/* On-disk layout, in native byte order:
+ *
+ *   header | slots[slot_count]
+ *
+ * A slot is a run of 64-bit words: the key, then a check word that is
+ * a hash of the key and never 0 in a used slot.  Slots are read and
+ * written a word at a time with no lock: a writer stores the check word
+ * last, a reader takes the check word before and after the key, and a
+ * slot only matches if the key and both check words do.  A torn read
+ * can only ever turn a hit into a miss.
+ */
+
+#define RESULTCACHE_MAGIC	"PGPRESC"
+#define RESULTCACHE_VERSION	1
+#define RESULTCACHE_BYTE_ORDER	0x01020304
+
+/* slots a key may live in, starting from its hash */
+#define PROBES 8
+
+/* files younger than this are not recorded */
+#define RACY_NS (2 * 1000000000LL)
+
+#define KEY_WORDS (sizeof(struct resultcache_key) / 8)
+
+struct resultcache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t slot_count; /* a power of two */
+	uint32_t key_words;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+};
+
+struct slot {
+	uint64_t key[KEY_WORDS];
+	uint64_t check;
+};
+
+struct resultcache {
+	struct resultcache_header *hdr;
+	struct slot *slots;
+	u64 size;
+	u64 hits;
+	u64 misses;
+};
+
+static int header_ok(struct resultcache_header *hdr, u64 size)
+{
+	return !memcmp(hdr->magic, RESULTCACHE_MAGIC, sizeof(RESULTCACHE_MAGIC)) &&
+		hdr->version == RESULTCACHE_VERSION &&
+		hdr->byte_order == RESULTCACHE_BYTE_ORDER &&
+		hdr->key_words == KEY_WORDS &&
+		hdr->slot_count && !(hdr->slot_count & (hdr->slot_count - 1)) &&
+		size == sizeof(*hdr) + (u64) hdr->slot_count * sizeof(struct slot);
+}
+
+struct resultcache *resultcache_open(const char *fn, u32 slots)
+{
+	struct resultcache_header *hdr, fresh;
+	struct resultcache *rc;
+	struct stat st;
+	u32 count = 64;
+	void *p;
+	int fd;
+
+	while (count < slots && count < (1U << 30))
+		count <<= 1;
+
+	fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return 0;
+
+	/* whoever gets here first sets it up; the rest just use it */
+	if (flock(fd, LOCK_EX) || fstat(fd, &st))
+		goto fail;
+	if (st.st_size >= (off_t) sizeof(fresh) &&
+	    pread(fd, &fresh, sizeof(fresh), 0) == sizeof(fresh) &&
+	    header_ok(&fresh, st.st_size)) {
+		count = fresh.slot_count;
+	} else {
+		memset(&fresh, 0, sizeof(fresh));
+		memcpy(fresh.magic, RESULTCACHE_MAGIC, sizeof(RESULTCACHE_MAGIC));
+		fresh.version = RESULTCACHE_VERSION;
+		fresh.byte_order = RESULTCACHE_BYTE_ORDER;
+		fresh.slot_count = count;
+		fresh.key_words = KEY_WORDS;
+		/* truncating to nothing first clears every old slot */
+		if (ftruncate(fd, 0) ||
+		    ftruncate(fd, sizeof(fresh) + (u64) count * sizeof(struct slot)) ||
+		    pwrite(fd, &fresh, sizeof(fresh), 0) != sizeof(fresh))
+			goto fail;
+	}
+
+	rc = calloc(1, sizeof(*rc));
+	if (!rc)
+		goto fail;
+	rc->size = sizeof(fresh) + (u64) count * sizeof(struct slot);
+	p = mmap(0, rc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		free(rc);
+		goto fail;
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	hdr = p;
+	rc->hdr = hdr;
+	rc->slots = (struct slot *) (hdr + 1);
+	return rc;
+
+fail:
+	close(fd);
+	return 0;
+}
+
+void resultcache_close(struct resultcache *rc)
+{
+	if (!rc)
+		return;
+	munmap(rc->hdr, rc->size);
+	free(rc);
+}
+
+int resultcache_key(struct resultcache_key *key, int fd,
+		    struct rsa_signature *signature, const u8 *fingerprint)
+{
+	struct stat st;
+	SHA_CTX ctx;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	memset(key, 0, sizeof(*key));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	key->ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+
+	/* everything that goes into checking the signature */
+	SHA_init(&ctx);
+	SHA_update(&ctx, signature->h, signature->h_sz);
+	SHA_update(&ctx, signature->trailer, sizeof(signature->trailer));
+	SHA_update(&ctx, signature->s, signature->s_sz);
+	memcpy(key->signature, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+	memcpy(key->fingerprint, fingerprint, SHA_DIGEST_SIZE);
+	return 0;
+}
+
+static uint64_t key_hash(const uint64_t *w)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	u32 n;
+
+	for (n = 0; n < KEY_WORDS; n++) {
+		h ^= w[n];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return h ? h : 1;
+}
+
+static int slot_matches(struct slot *s, const uint64_t *w, uint64_t check)
+{
+	u32 n;
+
+	if (__atomic_load_n(&s->check, __ATOMIC_ACQUIRE) != check)
+		return 0;
+	for (n = 0; n < KEY_WORDS; n++)
+		if (__atomic_load_n(&s->key[n], __ATOMIC_RELAXED) != w[n])
+			return 0;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->check, __ATOMIC_RELAXED) == check;
+}
+
+int resultcache_lookup(struct resultcache *rc,
+		       const struct resultcache_key *key)
+{
+	uint64_t w[KEY_WORDS], check;
+	u32 n, mask = rc->hdr->slot_count - 1;
+
+	memcpy(w, key, sizeof(w));
+	check = key_hash(w);
+	for (n = 0; n < PROBES; n++) {
+		if (slot_matches(&rc->slots[(check + n) & mask], w, check)) {
+			__atomic_add_fetch(&rc->hits, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&rc->hdr->hits, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	__atomic_add_fetch(&rc->misses, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&rc->hdr->misses, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void resultcache_store(struct resultcache *rc,
+		       const struct resultcache_key *key)
+{
+	uint64_t w[KEY_WORDS], check;
+	u32 n, mask = rc->hdr->slot_count - 1;
+	struct timespec now;
+	struct slot *s;
+	int64_t now_ns;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+	if (now_ns - key->mtime_ns < RACY_NS ||
+	    now_ns - key->ctime_ns < RACY_NS)
+		return;
+
+	memcpy(w, key, sizeof(w));
+	check = key_hash(w);
+
+	/* an empty slot if there is one, otherwise evict whichever of the
+	 * candidates this store happens to land on */
+	s = &rc->slots[(check + (check >> 32) % PROBES) & mask];
+	for (n = 0; n < PROBES; n++) {
+		struct slot *t = &rc->slots[(check + n) & mask];
+		uint64_t c = __atomic_load_n(&t->check, __ATOMIC_RELAXED);
+		if (c == check && slot_matches(t, w, check))
+			return;
+		if (c == 0) {
+			s = t;
+			break;
+		}
+	}
+
+	/* take the slot out of use while it holds a mix of keys */
+	__atomic_store_n(&s->check, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (n = 0; n < KEY_WORDS; n++)
+		__atomic_store_n(&s->key[n], w[n], __ATOMIC_RELAXED);
+	__atomic_store_n(&s->check, check, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&rc->hdr->stores, 1, __ATOMIC_RELAXED);
+}
+
+void resultcache_stats(struct resultcache *rc, struct resultcache_stats *st)
+{
+	st->hits = __atomic_load_n(&rc->hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&rc->misses, __ATOMIC_RELAXED);
+	st->total_hits = __atomic_load_n(&rc->hdr->hits, __ATOMIC_RELAXED);
+	st->total_misses = __atomic_load_n(&rc->hdr->misses, __ATOMIC_RELAXED);
+}
@@ -33,12 +33,20 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "rfc4880.h"
 #include "crypto.h"
 #include "sha1.h"
+#include "stream.h"
+#include "packet.h"
+#include "armor.h"
+#include "inflate.h"
+#include "stats.h"
+#include "diag.h"
 
 struct mpi {
 	u32 size;
@@ -70,16 +78,18 @@ static int parse_mpi(u8 **_data, int *_dlen, struct mpi *mpi)
 	return 0;
 }
 
-static int parse_key(u8 *data, int dlen,
-		     struct rsa_public_key **_public,
-		     struct rsa_private_key **_private)
+/* fill in borrowed views of the key material in data[0:dlen] */
+int rfc4880_key_view(u8 *data, int dlen,
+		     struct rsa_public_key *public,
+		     struct rsa_private_key *private)
 {
-	struct rsa_public_key *public;
-	struct rsa_private_key *private;
 	struct mpi n, e, d, p, q, u;
 
+	if (dlen < 6)
+		return -1;
+
 	if (data[0] != 4) {
-		fprintf(stderr,"unsupported key version %d\n", data[0]);
+		diag("unsupported key version %d", data[0]);
 		return -1;
 	}
 
@@ -89,7 +99,7 @@ static int parse_key(u8 *data, int dlen,
 	case ALGO_RSA_SIGN_ONLY:
 		break;
 	default:
-		fprintf(stderr,"unsupported algorithm %d\n", data[5]);
+		diag("unsupported algorithm %d", data[5]);
 		return -1;
 	}
 
@@ -101,11 +111,11 @@ static int parse_key(u8 *data, int dlen,
 	if (parse_mpi(&data, &dlen, &e))
 		return -1;
 
-	if (_private) {
+	if (private) {
 		if (dlen < 1)
 			return -1;
 		if (data[0] != 0x00) {
-			fprintf(stderr,"unsupported encrypted key\n");
+			diag("unsupported encrypted key");
 			return -1;
 		}
 		data++;
@@ -120,35 +130,59 @@ static int parse_key(u8 *data, int dlen,
 			return -1;
 		/* checksum */
 		if (dlen != 2) {
-			fprintf(stderr,"missing checksum\n");
+			diag("missing checksum");
 			return -1;
 		}
+
+		private->n_sz = n.size;
+		private->d_sz = d.size;
+		private->n = n.data;
+		private->d = d.data;
 	}
 
-	public = malloc(sizeof(*public) + n.size + e.size);
+	public->n_sz = n.size;
+	public->e_sz = e.size;
+	public->n = n.data;
+	public->e = e.data;
+
+	return 0;
+}
+
+static int parse_key(u8 *data, int dlen,
+		     struct rsa_public_key **_public,
+		     struct rsa_private_key **_private)
+{
+	struct rsa_public_key *public, pv;
+	struct rsa_private_key *private, sv;
+
+	stats_bytes(STATS_PARSE, dlen);
+	if (rfc4880_key_view(data, dlen, &pv, _private ? &sv : 0))
+		return -1;
+
+	public = malloc(sizeof(*public) + pv.n_sz + pv.e_sz);
 	if (!public)
 		return -1;
 
-	public->n_sz = n.size;
-	public->e_sz = e.size;
+	public->n_sz = pv.n_sz;
+	public->e_sz = pv.e_sz;
 	public->n = (u8*) (public + 1);
-	public->e = public->n + n.size;
-	memcpy(public->n, n.data, n.size);
-	memcpy(public->e, e.data, e.size);
+	public->e = public->n + pv.n_sz;
+	memcpy(public->n, pv.n, pv.n_sz);
+	memcpy(public->e, pv.e, pv.e_sz);
 
 	if (_private) {
-		private = malloc(sizeof(*private) + n.size + d.size);
+		private = malloc(sizeof(*private) + sv.n_sz + sv.d_sz);
 		if (!private) {
 			free(public);
 			return -1;
 		}
 
-		private->n_sz = n.size;
-		private->d_sz = d.size;
+		private->n_sz = sv.n_sz;
+		private->d_sz = sv.d_sz;
 		private->n = (u8*) (private + 1);
-		private->d = private->n + n.size;
-		memcpy(private->n, n.data, n.size);
-		memcpy(private->d, d.data, d.size);
+		private->d = private->n + sv.n_sz;
+		memcpy(private->n, sv.n, sv.n_sz);
+		memcpy(private->d, sv.d, sv.d_sz);
 
 		*_private = private;
 	}
@@ -158,10 +192,75 @@ static int parse_key(u8 *data, int dlen,
 	return 0;
 }
 
-static int parse_signature(u8 *data, int dlen,
-			   struct rsa_signature **_signature)
+static u32 be32(const u8 *p)
+{
+	return ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* pick out the subpackets we care about (rfc4880 5.2.3.1); anything
+ * already found in the hashed area is not overridden by the unhashed */
+static int parse_subpackets(u8 *data, int dlen,
+			    struct rsa_signature *signature, int hashed)
+{
+	unsigned len, type;
+
+	while (dlen > 0) {
+		if (data[0] < 192) {
+			len = data[0];
+			data++;
+			dlen--;
+		} else if (data[0] < 255) {
+			if (dlen < 2)
+				return -1;
+			len = ((data[0] - 192) << 8) + data[1] + 192;
+			data += 2;
+			dlen -= 2;
+		} else {
+			if (dlen < 5)
+				return -1;
+			len = be32(data + 1);
+			data += 5;
+			dlen -= 5;
+		}
+		if (len < 1 || len > dlen)
+			return -1;
+
+		type = data[0] & 0x7f;
+		switch (type) {
+		case SUBPACKET_CREATION_TIME:
+			if (len == 5 && (hashed || !signature->created))
+				signature->created = be32(data + 1);
+			break;
+		case SUBPACKET_EXPIRATION_TIME:
+			if (len == 5 && (hashed || !signature->expires))
+				signature->expires = be32(data + 1);
+			break;
+		case SUBPACKET_ISSUER:
+			if (len == 9 && (hashed || !signature->has_issuer)) {
+				memcpy(signature->issuer, data + 1, 8);
+				signature->has_issuer = 1;
+			}
+			break;
+		case SUBPACKET_ISSUER_FINGERPRINT:
+			/* version 4 keys only */
+			if (len == 22 && data[1] == 4 &&
+			    (hashed || !signature->has_issuer_fpr)) {
+				memcpy(signature->issuer_fpr, data + 2, 20);
+				signature->has_issuer_fpr = 1;
+			}
+			break;
+		}
+		data += len;
+		dlen -= len;
+	}
+	return 0;
+}
+
+/* fill in a borrowed view of the signature in data[0:dlen]; only the
+ * 6-byte trailer is built, the hashed area is referenced in place */
+int rfc4880_signature_view(u8 *data, int dlen,
+			   struct rsa_signature *signature)
 {
-	struct rsa_signature *signature;
 	struct mpi s;
 	u8 *save = data;
 	unsigned extra, left16;
@@ -171,23 +270,23 @@ static int parse_signature(u8 *data, int dlen,
 		return -1;
 
 	if (data[0] != 4) {
-		fprintf(stderr,"cannot handle non-v4 signatures\n");
+		diag("cannot handle non-v4 signatures");
 		return -1;
 	}
 
-        /* data[1] = type */
+	signature->type = data[1];
 	switch (data[2]) {
 	case ALGO_RSA_ENCRYPT_OR_SIGN:
 	case ALGO_RSA_ENCRYPT_ONLY:
 	case ALGO_RSA_SIGN_ONLY:
 		break;
 	default:
-		fprintf(stderr,"unsupported algorithm %d\n", data[2]);
+		diag("unsupported algorithm %d", data[2]);
 		return -1;
 	}
 
 	if (data[3] != HASH_SHA1) {
-		fprintf(stderr,"unsupported hash %d\n", data[3]);
+		diag("unsupported hash %d", data[3]);
 		return -1;
 	}
 
@@ -199,6 +298,13 @@ static int parse_signature(u8 *data, int dlen,
 	if (extra > dlen)
 		return -1;
 
+	signature->created = 0;
+	signature->expires = 0;
+	signature->has_issuer = 0;
+	signature->has_issuer_fpr = 0;
+	if (parse_subpackets(data, extra, signature, 1))
+		return -1;
+
 	data += extra;
 	dlen -= extra;
 
@@ -212,6 +318,9 @@ static int parse_signature(u8 *data, int dlen,
 	if (n > dlen)
 		return -1;
 
+	if (parse_subpackets(data, n, signature, 0))
+		return -1;
+
 	data += n;
 	dlen -= n;
 
@@ -225,117 +334,463 @@ static int parse_signature(u8 *data, int dlen,
 	if (parse_mpi(&data, &dlen, &s))
 		return -1;
 
-        /* add the header and footer size (both 6 bytes) */
-	extra += 12;
+        /* the header (6 bytes) is hashed along with the subpackets */
+	extra += 6;
 
-	if (_signature) {
-		signature = malloc(sizeof(*signature) + s.size + extra);
-		if (!signature)
-			return -1;
+	signature->s_sz = s.size;
+	signature->h_sz = extra;
+	signature->left16 = left16;
+	signature->s = s.data;
+	signature->h = save;
+
+	/* footer per rfc4880 5.2.4 */
+	signature->trailer[0] = 0x04;
+	signature->trailer[1] = 0xFF;
+	signature->trailer[2] = extra >> 24;
+	signature->trailer[3] = extra >> 16;
+	signature->trailer[4] = extra >> 8;
+	signature->trailer[5] = extra;
+
+	return 0;
+}
 
-		signature->s_sz = s.size;
-		signature->h_sz = extra;
-		signature->left16 = left16;
-		signature->s = (u8*) (signature + 1);
-		signature->h = signature->s + s.size;
-		memcpy(signature->s, s.data, s.size);
-        
-		extra -= 6;
-		memcpy(signature->h, save, extra);
-        
-		/* footer per rfc4880 5.2.4 */
-		signature->h[extra + 0] = 0x04;
-		signature->h[extra + 1] = 0xFF;
-		signature->h[extra + 2] = extra >> 24;
-		signature->h[extra + 3] = extra >> 16;
-		signature->h[extra + 4] = extra >> 8;
-		signature->h[extra + 5] = extra;
-
-		*_signature = signature;
+static int parse_signature(u8 *data, int dlen,
+			   struct rsa_signature **_signature)
+{
+	struct rsa_signature *signature, sv;
+
+	stats_bytes(STATS_PARSE, dlen);
+	if (rfc4880_signature_view(data, dlen, &sv))
+		return -1;
+
+	/* only ever used to verify documents: a certification is a valid
+	 * signature too, but not one over the data it is presented with */
+	if (sv.type != SIG_BINARY_DOC && sv.type != SIG_CANONICAL_TEXT_DOC) {
+		diag("unsupported signature type %lu", sv.type);
+		return -1;
 	}
+
+	signature = malloc(sizeof(*signature) + sv.s_sz + sv.h_sz);
+	if (!signature)
+		return -1;
+
+	*signature = sv;
+	signature->s = (u8*) (signature + 1);
+	signature->h = signature->s + sv.s_sz;
+	memcpy(signature->s, sv.s, sv.s_sz);
+	memcpy(signature->h, sv.h, sv.h_sz);
+
+	*_signature = signature;
 	return 0;
 }
 
+/* hand a complete packet body to the parser for its tag */
+static int parse_packet(unsigned tag, u8 *data, int dlen,
+			struct rsa_public_key **public,
+			struct rsa_private_key **private,
+			struct rsa_signature **signature)
+{
+	switch (tag) {
+	case 2:
+		if (signature && !*signature)
+			return parse_signature(data, dlen, signature);
+		break;
+	case 5:
+		if (public && !*public)
+			return parse_key(data, dlen, public, private);
+		break;
+	case 6:
+		if (public && !*public)
+			return parse_key(data, dlen, public, 0);
+		break;
+	}
+	return 0;
+}
+
+/* are we done? */
+static int have_all(struct rsa_public_key **public,
+		    struct rsa_private_key **private,
+		    struct rsa_signature **signature)
+{
+	if (public && !*public)
+		return 0;
+	if (private && !*private)
+		return 0;
+	if (signature && !*signature)
+		return 0;
+	return 1;
+}
+
 static int parse_rfc4880(unsigned char *data, int dlen,
+			 struct rsa_public_key **public,
+			 struct rsa_private_key **private,
+			 struct rsa_signature **signature);
+
+/* the loaders keep copies of what they parse, so armored input can be
+ * decoded into a scratch buffer and dropped afterwards */
+static int parse_armored(unsigned char *data, int dlen,
 			 struct rsa_public_key **public,
 			 struct rsa_private_key **private,
 			 struct rsa_signature **signature)
 {
-	while (dlen > 0) {
-		unsigned char x;
-		x = *data++;
-		dlen--;
-		unsigned plen, ptype;
-		if (!(x & 0x80)) {
-			fprintf(stderr,"invalid packet header %02x\n", x);
+	u8 *bin;
+	u64 len;
+	int r;
+
+	if (armor_decode(data, dlen, &bin, &len))
+		return -1;
+	r = parse_rfc4880(bin, len, public, private, signature);
+	free(bin);
+	return r;
+}
+
+static int parse_rfc4880(unsigned char *data, int dlen,
+			 struct rsa_public_key **public,
+			 struct rsa_private_key **private,
+			 struct rsa_signature **signature)
+{
+	struct packet_header hdr;
+	u8 *body;
+	u64 len = dlen;
+	int r;
+
+	if (armor_detect(data, len))
+		return parse_armored(data, dlen, public, private, signature);
+
+	while ((r = packet_walk(&data, &len, &hdr, &body)) > 0) {
+		if (!body)
+			continue;
+
+		if (parse_packet(hdr.tag, body, hdr.len,
+				 public, private, signature))
 			return -1;
-		}
-		if (x & 0x40) {
-			fprintf(stderr,"cannot decode new header %02x\n", x);
+
+		if (have_all(public, private, signature))
+			return 0;
+	}
+	if (r < 0)
+		return -1;
+
+	diag("missing required elements");
+	return -1;
+}
+
+/* largest key or signature packet we are willing to buffer */
+#define MAX_PACKET_BODY (1024 * 1024)
+
+/* read the rest of the current packet into a malloc'd buffer */
+static int read_body(struct packet_reader *pr, u8 **_body, u32 *_len)
+{
+	u8 *body = 0;
+	u32 len;
+	int n = 0;
+
+	if (pr->hdr.partial || pr->hdr.indeterminate) {
+		/* length unknown up front: take what fits */
+		body = malloc(MAX_PACKET_BODY + 1);
+		if (!body)
 			return -1;
+		for (len = 0; len <= MAX_PACKET_BODY; len += n) {
+			n = packet_read(pr, body + len,
+					MAX_PACKET_BODY + 1 - len);
+			if (n <= 0)
+				break;
 		}
-		ptype = (x >> 2) & 15;
-		switch (x & 3) {
-		case 0:
-			if (dlen < 1)
-				return -1;
-			plen = data[0];
-			data++;
-			dlen--;
-			break;
-		case 1:
-			if (dlen < 2)
-				return -1;
-			plen = data[1] | (data[0] << 8);
-			data+=2;
-			dlen-=2;
-			break;
-		case 2:
-		case 3:
-			fprintf(stderr,"cannot handle length type %d\n", x & 3);
-			return -1;
+		if (n < 0)
+			goto fail;
+	} else {
+		len = pr->hdr.len;
+		if (len <= MAX_PACKET_BODY) {
+			body = malloc(len ? len : 1);
+			if (!body || packet_read_full(pr, body, len) < 0)
+				goto fail;
 		}
+	}
+	if (len > MAX_PACKET_BODY) {
+		diag("packet too large");
+		goto fail;
+	}
+	*_body = body;
+	*_len = len;
+	return 0;
 
-		if (plen > dlen)
-			return -1;
+fail:
+	free(body);
+	return -1;
+}
+
+/* like parse_rfc4880, but streams the file so that only the packets we
+ * are interested in are ever held in memory */
+static int open_rfc4880(const char *fn,
+			struct rsa_public_key **public,
+			struct rsa_private_key **private,
+			struct rsa_signature **signature)
+{
+	struct packet_reader pr;
+	struct source *src;
+	u8 *body = 0;
+	u32 len;
+	int fd, r = -1, stage;
 
-		switch (ptype) {
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		diag("failed to open '%s'", fn);
+		return -1;
+	}
+	stage = stats_enter(STATS_PARSE);
+	src = source_dearmor(source_fd(fd));
+	if (!src)
+		goto done;
+	packet_reader_init(&pr, src);
+
+	while ((r = packet_next(&pr)) > 0) {
+		r = -1;
+		switch (pr.hdr.tag) {
 		case 2:
-			if (parse_signature(data, plen, signature))
-				return -1;
-			break;
 		case 5:
-			if (parse_key(data, plen, public, private))
-				return -1;
-			break;
 		case 6:
-			if (parse_key(data, plen, public, 0))
-				return -1;
 			break;
+		default:
+			continue;
+		}
+		if (read_body(&pr, &body, &len))
+			goto done;
+		if (parse_packet(pr.hdr.tag, body, len,
+				 public, private, signature))
+			goto done;
+		free(body);
+		body = 0;
+		if (have_all(public, private, signature)) {
+			r = 0;
+			goto done;
 		}
+	}
+	if (r == 0) {
+		diag("missing required elements");
+		r = -1;
+	}
 
-		dlen -= plen;
-		data += plen;
+done:
+	free(body);
+	source_close(src);
+	close(fd);
+	stats_enter(stage);
+	return r;
+}
 
-		/* are we done? */
-		if (public && !*public)
-			continue;
-		if (private && !*private)
-			continue;
-		if (signature && !*signature)
-			continue;
+#define LITERAL_CHUNK (64 * 1024)
 
+/* decompressed data is made on a helper thread, a few chunks ahead, so
+ * that inflating and hashing run side by side */
+#define INFLATE_DEPTH 4
+#define INFLATE_CHUNK (256 * 1024)
+
+/* the contents of a compressed data packet (rfc4880 5.6) */
+static struct source *decompress(struct packet_reader *pr)
+{
+	struct source *src;
+	u8 algo;
+
+	if (packet_read_full(pr, &algo, 1) < 0)
+		return 0;
+	src = packet_source(pr);
+	switch (algo) {
+	case COMPRESSION_NONE:
+		return src;
+	case COMPRESSION_ZIP:
+		src = source_inflate(src, INFLATE_RAW);
+		break;
+	case COMPRESSION_ZLIB:
+		src = source_inflate(src, INFLATE_ZLIB);
+		break;
+	default:
+		diag("unsupported compression %d", algo);
+		source_close(src);
 		return 0;
 	}
+	if (!src)
+		return 0;
+	return source_thread(src, INFLATE_DEPTH, INFLATE_CHUNK);
+}
 
-	fprintf(stderr,"missing required elements\n");
-	return -1;
+static int read_one_pass(struct source *src, struct rfc4880_verify_ctx *ctx,
+			 struct rsa_signature **signature,
+			 void (*out)(void *cookie, const u8 *data, u32 len),
+			 void *cookie, int nested)
+{
+	struct packet_reader pr;
+	struct source *z;
+	u8 ops[13], *buf, *body = 0;
+	int passes = 0, literal = 0, n, r;
+	u32 len;
+
+	*signature = 0;
+	buf = malloc(LITERAL_CHUNK);
+	if (!buf)
+		return -1;
+
+	packet_reader_init(&pr, src);
+	while ((r = packet_next(&pr)) > 0) {
+		r = -1;
+		switch (pr.hdr.tag) {
+		case 4:
+			/* rfc4880 5.4: tells us how to hash what follows */
+			if (literal || packet_read_full(&pr, ops, sizeof(ops)) < 0)
+				goto malformed;
+			if (ops[0] != 3) {
+				diag("unsupported one-pass signature "
+					"version %d", ops[0]);
+				goto done;
+			}
+			switch (ops[1]) {
+			case SIG_BINARY_DOC:
+			case SIG_CANONICAL_TEXT_DOC:
+				break;
+			default:
+				diag("unsupported signature type %d",
+					ops[1]);
+				goto done;
+			}
+			if (ops[2] != HASH_SHA1) {
+				diag("unsupported hash %d", ops[2]);
+				goto done;
+			}
+			passes++;
+			break;
+		case 8:
+			/* the whole message, compressed */
+			if (nested || passes || literal)
+				goto malformed;
+			z = decompress(&pr);
+			if (!z)
+				goto done;
+			r = read_one_pass(z, ctx, signature, out, cookie, 1);
+			source_close(z);
+			goto done;
+		case 11:
+			/* rfc4880 5.9: format, file name and date come
+			 * first and are not part of the signed data */
+			if (!passes || literal ||
+			    packet_read_full(&pr, buf, 2) < 0 ||
+			    packet_read_full(&pr, buf, buf[1] + 4) < 0)
+				goto malformed;
+			literal = 1;
+			if (ops[1] == SIG_CANONICAL_TEXT_DOC)
+				rfc4880_verify_init_text(ctx);
+			else
+				rfc4880_verify_init(ctx);
+			while ((n = packet_read(&pr, buf, LITERAL_CHUNK)) > 0) {
+				rfc4880_verify_update(ctx, buf, n);
+				if (out)
+					out(cookie, buf, n);
+			}
+			if (n < 0)
+				goto done;
+			break;
+		case 2:
+			/* one per one-pass packet, all over the same data;
+			 * the first is as good as any */
+			if (!literal)
+				goto malformed;
+			if (*signature)
+				break;
+			if (read_body(&pr, &body, &len) ||
+			    parse_signature(body, len, signature))
+				goto done;
+			free(body);
+			body = 0;
+			/* the one-pass packet chose how the text was hashed
+			 * but is not signed; the signature must agree */
+			if ((*signature)->type != ops[1]) {
+				diag("signature type does not match "
+				     "one-pass packet");
+				goto done;
+			}
+			break;
+		}
+	}
+	if (r == 0 && !*signature) {
+		diag("missing required elements");
+		r = -1;
+	}
+	goto done;
+
+malformed:
+	diag("malformed signed message");
+	r = -1;
+done:
+	if (r) {
+		free(*signature);
+		*signature = 0;
+	}
+	free(body);
+	free(buf);
+	return r;
+}
+
+static int read_inline(struct source *src, struct rfc4880_verify_ctx *ctx,
+		       struct rsa_signature **signature,
+		       void (*out)(void *cookie, const u8 *data, u32 len),
+		       void *cookie)
+{
+	struct source *in;
+	u8 head[64];
+	int n, r;
+
+	/* look at the start to see which kind of message this is, then
+	 * put it back for the reader */
+	*signature = 0;
+	n = source_read_full(src, head, sizeof(head));
+	if (n < 0)
+		return -1;
+	in = source_prefix(src, head, n);
+	if (!in)
+		return -1;
+
+	if (armor_is_cleartext(head, n)) {
+		r = armor_read_cleartext(in, ctx, signature, out, cookie);
+		source_close(in);
+		return r;
+	}
+
+	in = source_dearmor(in);
+	if (!in)
+		return -1;
+	r = read_one_pass(in, ctx, signature, out, cookie, 0);
+	source_close(in);
+	return r;
+}
+
+int rfc4880_read_inline(struct source *src, struct rfc4880_verify_ctx *ctx,
+			struct rsa_signature **signature,
+			void (*out)(void *cookie, const u8 *data, u32 len),
+			void *cookie)
+{
+	int stage, r;
+
+	stage = stats_enter(STATS_PARSE);
+	r = read_inline(src, ctx, signature, out, cookie);
+	stats_enter(stage);
+	return r;
+}
+
+static int load_rfc4880(u8 *data, u32 len,
+			struct rsa_public_key **public,
+			struct rsa_private_key **private,
+			struct rsa_signature **signature)
+{
+	int stage, r;
+
+	stage = stats_enter(STATS_PARSE);
+	r = parse_rfc4880(data, len, public, private, signature);
+	stats_enter(stage);
+	return r;
 }
 
 int rfc4880_load_public_key(u8 *data, u32 len,
 			    struct rsa_public_key **public)
 {
-	return parse_rfc4880(data, len, public, 0, 0);
+	return load_rfc4880(data, len, public, 0, 0);
 }
 
 
@@ -343,19 +798,63 @@ int rfc4880_load_private_key(u8 *data, u32 len,
 			     struct rsa_private_key **private,
 			     struct rsa_public_key **public)
 {
-	return parse_rfc4880(data, len, public, private, 0);
+	return load_rfc4880(data, len, public, private, 0);
 }
 
 int rfc4880_load_signature(u8 *data, u32 len,
 			   struct rsa_signature **signature)
 {
-	return parse_rfc4880(data, len, 0, 0, signature);
+	return load_rfc4880(data, len, 0, 0, signature);
+}
+
+/* find the first packet with one of the given tags */
+static u8 *find_packet(u8 *data, u32 len, unsigned tag1, unsigned tag2,
+		       u32 *blen)
+{
+	struct packet_header hdr;
+	u64 left = len;
+	u8 *body;
+
+	while (packet_walk(&data, &left, &hdr, &body) > 0) {
+		if (body && (hdr.tag == tag1 || hdr.tag == tag2)) {
+			*blen = hdr.len;
+			return body;
+		}
+	}
+	diag("missing required elements");
+	return 0;
+}
+
+int rfc4880_view_public_key(u8 *data, u32 len,
+			    struct rsa_public_key *public)
+{
+	u8 *body;
+	u32 blen;
+
+	body = find_packet(data, len, 6, 5, &blen);
+	if (!body)
+		return -1;
+	return rfc4880_key_view(body, blen, public, 0);
+}
+
+int rfc4880_view_signature(u8 *data, u32 len,
+			   struct rsa_signature *signature)
+{
+	u8 *body;
+	u32 blen;
+
+	body = find_packet(data, len, 2, 2, &blen);
+	if (!body)
+		return -1;
+	return rfc4880_signature_view(body, blen, signature);
 }
 
 u8 *load_file(const char *fn, u32 *sz)
 {
 	struct stat s;
 	u8 *data = 0;
+	u32 have = 0;
+	ssize_t r;
 	int fd;
 
 	fd = open(fn, O_RDONLY);
@@ -365,14 +864,24 @@ u8 *load_file(const char *fn, u32 *sz)
 	if (fstat(fd, &s))
 		goto fail;
 
-	data = malloc(s.st_size);
-	if (!data)
+	/* refuse rather than truncate what does not fit in *sz */
+	if ((u32) s.st_size != s.st_size)
 		goto fail;
 
-	if (read(fd, data, s.st_size) != s.st_size)
+	data = malloc(s.st_size ? s.st_size : 1);
+	if (!data)
 		goto fail;
 
-	*sz = s.st_size;
+	while (have < s.st_size) {
+		r = read(fd, data + have, s.st_size - have);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			goto fail;
+		have += r;
+	}
+
+	*sz = have;
 	close(fd);
 	return data;
 
@@ -382,50 +891,303 @@ fail:
 	return 0;
 }
 
+int file_map_fd(int fd, struct file_map *fm, unsigned flags)
+{
+	struct stat s;
+	int mflags = MAP_PRIVATE;
+	void *p;
 
-int rfc4880_open_public_key(const char *fn, struct rsa_public_key **public)
+	if (fstat(fd, &s) || !S_ISREG(s.st_mode))
+		return -1;
+
+	fm->data = 0;
+	fm->size = s.st_size;
+	if (fm->size == 0)
+		return 0;
+
+#ifdef MAP_POPULATE
+	if (flags & FMAP_POPULATE)
+		mflags |= MAP_POPULATE;
+#endif
+	p = mmap(0, fm->size, PROT_READ, mflags, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	/* we walk the data front to back exactly once */
+	madvise(p, fm->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	if (flags & FMAP_HUGEPAGE)
+		madvise(p, fm->size, MADV_HUGEPAGE);
+#endif
+
+	fm->data = p;
+	return 0;
+}
+
+int file_map_open(const char *fn, struct file_map *fm, unsigned flags)
 {
-	u8 *data;
-	u32 sz;
-	int r;
+	int fd, r;
 
-	data = load_file(fn, &sz);
-	if (!data) {
-		fprintf(stderr,"failed to open '%s'\n", fn);
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
 		return -1;
-	}
-	r = rfc4880_load_public_key(data, sz, public);
-	free(data);
+	r = file_map_fd(fd, fm, flags);
+	close(fd);
 	return r;
 }
 
+void file_map_close(struct file_map *fm)
+{
+	if (fm->data)
+		munmap(fm->data, fm->size);
+	fm->data = 0;
+	fm->size = 0;
+}
+
+int rfc4880_open_public_key(const char *fn, struct rsa_public_key **public)
+{
+	return open_rfc4880(fn, public, 0, 0);
+}
+
 int rfc4880_open_signature(const char *fn, struct rsa_signature **signature)
 {
-	u8 *data;
-	u32 sz;
-	int r;
+	return open_rfc4880(fn, 0, 0, signature);
+}
 
-	data = load_file(fn, &sz);
-	if (!data) {
-		fprintf(stderr,"failed to open '%s'\n", fn);
-		return -1;
+/* finish a copy of the message midstate with the signature's hashed
+ * header and trailer */
+static const u8 *signature_digest(const SHA_CTX *ctx, SHA_CTX *tmp,
+				  struct rsa_signature *signature)
+{
+	const u8 *digest;
+	int stage;
+
+	stage = stats_enter(STATS_HASH);
+	stats_bytes(STATS_HASH, signature->h_sz + sizeof(signature->trailer));
+	*tmp = *ctx;
+	SHA_update(tmp, signature->h, signature->h_sz);
+	SHA_update(tmp, signature->trailer, sizeof(signature->trailer));
+	digest = SHA_final(tmp);
+	stats_enter(stage);
+	return digest;
+}
+
+int rfc4880_verify_midstate(const SHA_CTX *ctx,
+			    struct rsa_public_key *public,
+			    struct rsa_signature *signature)
+{
+	const u8 *digest;
+	SHA_CTX tmp;
+
+	digest = signature_digest(ctx, &tmp, signature);
+	return rsa_verify(public, digest, signature->s, signature->s_sz);
+}
+
+int rfc4880_verify_prepared(const struct rfc4880_verify_ctx *ctx,
+			    struct rsa_prepared_key *key,
+			    struct rsa_signature *signature)
+{
+	const u8 *digest;
+	SHA_CTX tmp;
+
+	digest = signature_digest(&ctx->sha, &tmp, signature);
+	return rsa_verify_prepared(key, digest, signature->s, signature->s_sz);
+}
+
+void rfc4880_verify_init(struct rfc4880_verify_ctx *ctx)
+{
+	SHA_init(&ctx->sha);
+	ctx->text = 0;
+	ctx->cr = 0;
+}
+
+void rfc4880_verify_init_text(struct rfc4880_verify_ctx *ctx)
+{
+	rfc4880_verify_init(ctx);
+	ctx->text = 1;
+}
+
+static void hash_bytes(SHA_CTX *sha, const u8 *data, u64 len)
+{
+	/* SHA_update takes an int length */
+	while (len > 0x40000000) {
+		SHA_update(sha, data, 0x40000000);
+		data += 0x40000000;
+		len -= 0x40000000;
 	}
-	r = rfc4880_load_signature(data, sz, signature);
-	free(data);
-	return r;
+	SHA_update(sha, data, len);
+}
+
+void rfc4880_hash_message(SHA_CTX *ctx, u8 *data, u32 len)
+{
+	int stage;
+
+	stage = stats_enter(STATS_HASH);
+	stats_bytes(STATS_HASH, len);
+	SHA_init(ctx);
+	hash_bytes(ctx, data, len);
+	stats_enter(stage);
+}
+
+/* rfc4880 5.2.1: hash with every line ending as CR LF.  Text that
+ * already has CR LF endings goes through in runs as long as the input
+ * allows; only a bare LF breaks the run to slip in the missing CR */
+static void hash_text(struct rfc4880_verify_ctx *ctx, const u8 *data, u64 len)
+{
+	const u8 *run = data, *end = data + len, *nl;
+	int cr = ctx->cr;
+
+	while ((nl = memchr(data, '\n', end - data))) {
+		if (nl > data)
+			cr = nl[-1] == '\r';
+		if (!cr) {
+			hash_bytes(&ctx->sha, run, nl - run);
+			SHA_update(&ctx->sha, (const u8 *) "\r", 1);
+			run = nl;
+		}
+		cr = 0;
+		data = nl + 1;
+	}
+	if (end > data)
+		cr = end[-1] == '\r';
+	hash_bytes(&ctx->sha, run, end - run);
+	ctx->cr = cr;
+}
+
+void rfc4880_verify_update(struct rfc4880_verify_ctx *ctx,
+			   const u8 *data, u64 len)
+{
+	int stage;
+
+	stage = stats_enter(STATS_HASH);
+	stats_bytes(STATS_HASH, len);
+	if (ctx->text)
+		hash_text(ctx, data, len);
+	else
+		hash_bytes(&ctx->sha, data, len);
+	stats_enter(stage);
+}
+
+int rfc4880_verify_final(const struct rfc4880_verify_ctx *ctx,
+			 struct rsa_public_key *public,
+			 struct rsa_signature *signature)
+{
+	return rfc4880_verify_midstate(&ctx->sha, public, signature);
 }
 
 int rfc4880_verify(u8 *data, u32 len,
 		   struct rsa_public_key *public,
 		   struct rsa_signature *signature)
 {
-	struct SHA_CTX ctx;
-	const u8 *digest;
+	struct rfc4880_verify_ctx ctx;
+
+	if (signature->type == SIG_CANONICAL_TEXT_DOC)
+		rfc4880_verify_init_text(&ctx);
+	else
+		rfc4880_verify_init(&ctx);
+	rfc4880_verify_update(&ctx, data, len);
+	return rfc4880_verify_final(&ctx, public, signature);
+}
 
-	SHA_init(&ctx);
-	SHA_update(&ctx, data, len);
-	SHA_update(&ctx, signature->h, signature->h_sz);
-	digest = SHA_final(&ctx);
+/* files smaller than this are hashed in place through a mapping, or read
+ * directly; larger ones go through the pipelined reader so that I/O
+ * overlaps hashing */
+#define HASH_MAP_MAX (4 * 1024 * 1024)
+#define HASH_CHUNK (64 * 1024)
 
-	return rsa_verify(public, digest, signature->s, signature->s_sz);
+/* fault a mapping in ahead of hashing it, so that when stages are being
+ * timed the reads count as loading rather than hashing */
+static void prefault(struct file_map *fm)
+{
+	volatile const u8 *p = fm->data;
+	u64 n;
+	int stage;
+
+	stage = stats_enter(STATS_LOAD);
+	stats_bytes(STATS_LOAD, fm->size);
+	for (n = 0; n < fm->size; n += 4096)
+		(void) p[n];
+	stats_enter(stage);
+}
+
+/* the regular file fd, size bytes of it from offset 0, read in place of
+ * a mapping: a file cut short underneath us is an error, not SIGBUS */
+static int hash_pread(int fd, u64 size, struct rfc4880_verify_ctx **ctx,
+		      int n)
+{
+	u64 off = 0;
+	ssize_t r;
+	u8 *buf;
+	int i;
+
+	buf = malloc(HASH_CHUNK);
+	if (!buf)
+		return -1;
+	while (off < size) {
+		r = pread(fd, buf, size - off < HASH_CHUNK ?
+			  size - off : HASH_CHUNK, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		for (i = 0; i < n; i++)
+			rfc4880_verify_update(ctx[i], buf, r);
+		off += r;
+	}
+	free(buf);
+	return off == size ? 0 : -1;
+}
+
+int rfc4880_hash_fd(int fd, struct rfc4880_verify_ctx **ctx, int n,
+		    unsigned flags)
+{
+	struct source *src;
+	struct file_map fm;
+	struct stat s;
+	u64 left = ~(u64) 0;
+	u8 *buf;
+	int i, r;
+
+	if (fstat(fd, &s))
+		return -1;
+	if (S_ISREG(s.st_mode) && (u64) s.st_size < HASH_MAP_MAX) {
+		if (!(flags & HASH_FD_MAP) || file_map_fd(fd, &fm, 0))
+			return hash_pread(fd, s.st_size, ctx, n);
+		if (stats_active())
+			prefault(&fm);
+		for (i = 0; i < n; i++)
+			rfc4880_verify_update(ctx[i], fm.data, fm.size);
+		file_map_close(&fm);
+		return 0;
+	}
+
+	/* a regular file is read whole, as when it is mapped, and up to
+	 * the size it has now, so one that keeps growing cannot keep us
+	 * here */
+	if (S_ISREG(s.st_mode)) {
+		if (lseek(fd, 0, SEEK_SET) < 0)
+			return -1;
+		left = s.st_size;
+	}
+
+	buf = malloc(HASH_CHUNK);
+	src = source_pipeline(fd, PIPELINE_DEPTH, PIPELINE_SIZE);
+	if (!buf || !src) {
+		free(buf);
+		if (src)
+			source_close(src);
+		return -1;
+	}
+	r = 0;
+	while (left && (r = source_read(src, buf, left < HASH_CHUNK ?
+					left : HASH_CHUNK)) > 0) {
+		for (i = 0; i < n; i++)
+			rfc4880_verify_update(ctx[i], buf, r);
+		left -= r;
+	}
+	source_close(src);
+	free(buf);
+	if (r == 0 && left && S_ISREG(s.st_mode))
+		return -1;
+	return r < 0 ? -1 : 0;
 }
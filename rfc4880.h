@@ -31,6 +31,8 @@
 #ifndef _RFC4880_H_
 #define _RFC4880_H_
 
+#include "crypto.h"
+
 #define SIG_BINARY_DOC				0x00
 #define SIG_CANONICAL_TEXT_DOC			0x01
 #define SIG_STANDALONE				0x02
@@ -63,4 +65,22 @@
 #define HASH_SHA512				10
 #define HASH_SHA224				11
 
+#define COMPRESSION_NONE			0
+#define COMPRESSION_ZIP				1
+#define COMPRESSION_ZLIB			2
+#define COMPRESSION_BZIP2			3
+
+#define SUBPACKET_CREATION_TIME			2
+#define SUBPACKET_EXPIRATION_TIME		3
+#define SUBPACKET_ISSUER			16
+#define SUBPACKET_ISSUER_FINGERPRINT		33
+
+/* parse a single key (tag 5, 6 or 14) or signature (tag 2) packet body
+ * into borrowed views, see rfc4880_view_public_key() */
+int rfc4880_key_view(u8 *data, int dlen,
+		     struct rsa_public_key *public,
+		     struct rsa_private_key *private);
+int rfc4880_signature_view(u8 *data, int dlen,
+			   struct rsa_signature *signature);
+
 #endif
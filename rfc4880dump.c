@@ -30,7 +30,47 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "armor.h"
+#include "packet.h"
+#include "inflate.h"
+#include "rfc4880.h"
+
+/* metadata packets (signatures, keys, user ids) are read whole; anything
+ * bigger than this is reported and stepped over */
+#define MAX_META	(1024 * 1024)
+
+/* bodies are only ever looked at in pieces of this size or less */
+#define PEEK_SIZE	512
+
+static int json;
+
+/* -- where the packets come from -- */
+
+struct input {
+	int fd;
+	int seekable;  /* binary packets straight from a regular file */
+	u64 size;
+};
+
+static int seek_skip(void *cookie, u64 len)
+{
+	struct input *in = cookie;
+	off_t pos;
+
+	pos = lseek(in->fd, 0, SEEK_CUR);
+	if (pos < 0 || len > in->size - pos) {
+		fprintf(stderr,"truncated packet body\n");
+		return -1;
+	}
+	return lseek(in->fd, pos + len, SEEK_SET) < 0 ? -1 : 0;
+}
+
+/* -- output -- */
 
 void dump(const char *name, unsigned char *x, unsigned len)
 {
@@ -47,6 +87,97 @@ void dump(const char *name, unsigned char *x, unsigned len)
 	printf("};\n");
 }
 
+/* the length of the well-formed UTF-8 sequence at s[0:len] that starts
+ * with a byte of 0x80 or more, or 0: no overlong forms, surrogates or
+ * code points past U+10FFFF */
+static u32 utf8_len(const u8 *s, u32 len)
+{
+	u32 n, want, cp;
+
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		want = 2;
+		cp = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		want = 3;
+		cp = s[0] & 0x0f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		want = 4;
+		cp = s[0] & 0x07;
+	} else {
+		return 0;
+	}
+	if (len < want)
+		return 0;
+	for (n = 1; n < want; n++) {
+		if ((s[n] & 0xc0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (s[n] & 0x3f);
+	}
+	if ((want == 3 && cp < 0x800) || (want == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return 0;
+	return want;
+}
+
+/* user IDs are UTF-8 (rfc4880 5.11) and go through as they are; control
+ * characters, and bytes that are not part of valid UTF-8, are escaped,
+ * the latter as the code point of the same value */
+static void json_string(const u8 *s, u32 len)
+{
+	u32 n, u;
+
+	putchar('"');
+	for (n = 0; n < len; n++) {
+		if (s[n] == '"' || s[n] == '\\') {
+			printf("\\%c", s[n]);
+		} else if (s[n] < 0x20 || s[n] == 0x7f) {
+			printf("\\u%04x", s[n]);
+		} else if (s[n] < 0x80) {
+			putchar(s[n]);
+		} else if ((u = utf8_len(s + n, len - n))) {
+			fwrite(s + n, 1, u, stdout);
+			n += u - 1;
+		} else {
+			printf("\\u%04x", s[n]);
+		}
+	}
+	putchar('"');
+}
+
+static void json_hex(const char *key, const u8 *data, u32 len)
+{
+	u32 n;
+
+	printf(",\"%s\":\"", key);
+	for (n = 0; n < len; n++)
+		printf("%02x", data[n]);
+	putchar('"');
+}
+
+const char *to_packet_type(unsigned n)
+{
+	switch (n) {
+	case  1: return "public-key encrypted session key";
+	case  2: return "signature";
+	case  3: return "symmetric-key encrypted session key";
+	case  4: return "one-pass signature";
+	case  5: return "secret key";
+	case  6: return "public key";
+	case  7: return "secret subkey";
+	case  8: return "compressed data";
+	case  9: return "symmetrically encrypted data";
+	case 10: return "marker";
+	case 11: return "literal data";
+	case 12: return "trust";
+	case 13: return "user id";
+	case 14: return "public subkey";
+	case 17: return "user attribute";
+	case 18: return "encrypted and integrity protected data";
+	case 19: return "modification detection code";
+	default: return "UNKNOWN";
+	}
+}
+
 const char *to_sig_type(unsigned char n)
 {
 	switch (n) {
@@ -75,12 +206,15 @@ const char *to_pubkey_algo(unsigned char n)
 	case  1: return "RSA (Encrypt or Sign)";
 	case  2: return "RSA (Encrypt-Only)";
 	case  3: return "RSA (Sign-Only)";
-	case 16: return "Elgamal (Encrypt-Only";
+	case 16: return "Elgamal (Encrypt-Only)";
+	case 17: return "DSA";
 	case 18: return "Elliptic Curve";
 	case 19: return "ECDSA";
+	case 20: return "Elgamal (Encrypt or Sign)";
 	case 21: return "Diffie-Hellman";
+	case 22: return "EdDSA";
 	default: return "UNKNOWN";
-    }
+	}
 }
 
 const char *to_hash_algo(unsigned char n)
@@ -97,217 +231,608 @@ const char *to_hash_algo(unsigned char n)
 	}
 }
 
-int parse_mpi(unsigned char *data, int dlen)
+const char *to_compression_algo(unsigned char n)
 {
-	unsigned bits, bytes;
-	if (dlen < 2)
-		return -1;
+	switch (n) {
+	case COMPRESSION_NONE: return "uncompressed";
+	case COMPRESSION_ZIP: return "ZIP";
+	case COMPRESSION_ZLIB: return "ZLIB";
+	case COMPRESSION_BZIP2: return "BZip2";
+	default: return "UNKNOWN";
+	}
+}
 
-	bits = (data[0] << 8) | data[1];
+static u32 be32(const u8 *p)
+{
+	return ((u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* -- packet bodies -- */
 
-	bytes = (bits + 7) / 8;
+/* the size of the MPI at data[0:dlen] including its length, or -1 */
+int parse_mpi(unsigned char *data, int dlen, unsigned *bits)
+{
+	unsigned bytes;
 
-	dlen -= 2;
-	data += 2;
-	if (bytes > dlen)
+	if (dlen < 2)
+		return -1;
+	*bits = (data[0] << 8) | data[1];
+	bytes = (*bits + 7) / 8;
+	if (bytes > dlen - 2)
 		return -1;
+	return bytes + 2;
+}
 
-	printf("MPI (%d bits): %02x %02x %02x %02x ...\n",
-	       bits, data[0], data[1], data[2], data[3]);
+static void print_mpi(unsigned char *data, unsigned bits)
+{
+	unsigned n, bytes = (bits + 7) / 8;
 
-	return bytes;
+	printf("MPI (%d bits):", bits);
+	for (n = 0; n < bytes && n < 4; n++)
+		printf(" %02x", data[2 + n]);
+	printf(" ...\n");
 }
 
 int parse_key(unsigned char *data, int dlen, int secret)
 {
-	unsigned when;
-	int r;
-
-	if (data[0] != 4) {
-		printf("cannot handle non-v4 keys\n");
+	unsigned version, algo, bits, oid = 0;
+	unsigned char *p, *oidp = 0;
+	u32 created;
+	int r, n;
+
+	if (dlen < 1 || (data[0] != 3 && data[0] != 4) ||
+	    dlen < (data[0] == 3 ? 8 : 6)) {
+		if (json)
+			printf(",\"error\":\"unsupported key version\"");
+		else
+			printf("cannot handle key version %d\n",
+			       dlen ? data[0] : -1);
 		return -1;
 	}
-	when = (data[1]<<24)|(data[2]<<16)|(data[3]<<8)|data[4];
-	printf("algo: %s\n", to_pubkey_algo(data[5]));
-	data += 6;
-	dlen -= 6;
-
-	r = parse_mpi(data, dlen); /* n */
+	version = data[0];
+	created = be32(data + 1);
+	p = data + (version == 3 ? 8 : 6);
+	algo = p[-1];
+	dlen -= p - data;
+
+	/* elliptic curve keys start with the curve's OID */
+	if (algo == 18 || algo == 19 || algo == 22) {
+		if (dlen < 1 || p[0] == 0 || p[0] == 0xff || p[0] >= dlen)
+			return -1;
+		oid = p[0];
+		oidp = p + 1;
+		p += 1 + oid;
+		dlen -= 1 + oid;
+	}
+	r = parse_mpi(p, dlen, &bits);
 	if (r < 0)
 		return -1;
-	dump("rsa_n", data + 2, (((data[0]<<8)|data[1]) + 7) / 8);
-	data += r + 2;
-	dlen -= r + 2;
 
-	r = parse_mpi(data, dlen); /* e */
+	if (json) {
+		printf(",\"version\":%d,\"created\":%lu,\"algo\":%d,"
+		       "\"algo_name\":\"%s\",\"bits\":%d", version, created,
+		       algo, to_pubkey_algo(algo), bits);
+		if (oid)
+			json_hex("curve_oid", oidp, oid);
+		return 0;
+	}
+
+	printf("algo: %s\n", to_pubkey_algo(algo));
+	if (oid) {
+		printf("curve oid:");
+		for (n = 0; n < oid; n++)
+			printf(" %02x", oidp[n]);
+		printf("\n");
+	}
+	if (algo > 3) {
+		print_mpi(p, bits);
+		return 0;
+	}
+
+	print_mpi(p, bits);
+	dump("rsa_n", p + 2, r - 2);
+	p += r;
+	dlen -= r;
+
+	r = parse_mpi(p, dlen, &bits); /* e */
 	if (r < 0)
 		return -1;
-	dump("rsa_e", data + 2, (((data[0]<<8)|data[1]) + 7) / 8);
-	data += r + 2;
-	dlen -= r + 2;
+	print_mpi(p, bits);
+	dump("rsa_e", p + 2, r - 2);
+	p += r;
+	dlen -= r;
 
 	if (!secret)
 		return 0;
 
-	printf("S2K %02x\n", data[0]);
+	if (dlen < 1)
+		return -1;
+	printf("S2K %02x\n", p[0]);
 	dlen -= 1;
-	data += 1;
+	p += 1;
 
-	r = parse_mpi(data, dlen); /* d */
-	if (r < 0)
-		return -1;
-	dump("rsa_d", data + 2, (((data[0]<<8)|data[1]) + 7) / 8);
-	data += r + 2;
-	dlen -= r + 2;
-	r = parse_mpi(data, dlen); /* p */
+	r = parse_mpi(p, dlen, &bits); /* d */
 	if (r < 0)
 		return -1;
-	data += r + 2;
-	dlen -= r + 2;
-	r = parse_mpi(data, dlen); /* q */
-	if (r < 0)
-		return -1;
-	data += r + 2;
-	dlen -= r + 2;
-	r = parse_mpi(data, dlen); /* u */
-	if (r < 0)
-		return -1;
-	data += r + 2;
-	dlen -= r + 2;
+	print_mpi(p, bits);
+	dump("rsa_d", p + 2, r - 2);
+	p += r;
+	dlen -= r;
+	for (n = 0; n < 3; n++) { /* p, q, u */
+		r = parse_mpi(p, dlen, &bits);
+		if (r < 0)
+			return -1;
+		print_mpi(p, bits);
+		p += r;
+		dlen -= r;
+	}
 
-        /* checksum */
+	/* checksum */
 	if (dlen != 2)
 		return -1;
 
 	return 0;
 }
 
-void parse_signature(unsigned char *data, int dlen)
+/* the creation time and issuer subpackets (rfc4880 5.2.3.1) */
+static void json_subpackets(const u8 *data, u32 len)
+{
+	u32 n, type;
+
+	while (len > 0) {
+		if (data[0] < 192) {
+			n = data[0];
+			data += 1;
+			len -= 1;
+		} else if (data[0] < 255) {
+			if (len < 2)
+				return;
+			n = ((data[0] - 192) << 8) + data[1] + 192;
+			data += 2;
+			len -= 2;
+		} else {
+			if (len < 5)
+				return;
+			n = be32(data + 1);
+			data += 5;
+			len -= 5;
+		}
+		if (n == 0 || n > len)
+			return;
+		type = data[0] & 0x7f;
+		if (type == 2 && n == 5)
+			printf(",\"created\":%lu", be32(data + 1));
+		else if (type == 16 && n == 9)
+			json_hex("issuer", data + 1, 8);
+		else if (type == 33 && n == 22)
+			json_hex("issuer_fpr", data + 2, 20);
+		data += n;
+		len -= n;
+	}
+}
+
+static void print_subpackets(const char *what, const u8 *data, u32 len)
 {
-	unsigned char *save = data;
-	unsigned n, i;
+	u32 i;
 
-	if (data[0] != 4) {
-		printf("cannot handle non-v4 signatures\n");
-		return;
+	printf("%s subpacket data:", what);
+	for (i = 0; i < len; i++)
+		printf(" %02x", data[i]);
+	printf("\n");
+}
+
+int parse_signature(unsigned char *data, int dlen)
+{
+	unsigned char *save = data, *hashed, *unhashed;
+	unsigned type, pk, hash, nh, nu, bits;
+
+	if (dlen < 1 || (data[0] != 3 && data[0] != 4)) {
+		if (json)
+			printf(",\"error\":\"unsupported signature version\"");
+		else
+			printf("cannot handle signature version %d\n",
+			       dlen ? data[0] : -1);
+		return -1;
+	}
+
+	if (data[0] == 3) {
+		/* version, hashed length (5), type, time, key ID, algos */
+		if (dlen < 19 || data[1] != 5)
+			return -1;
+		type = data[2];
+		pk = data[15];
+		hash = data[16];
+		data += 19;
+		dlen -= 19;
+		if (parse_mpi(data, dlen, &bits) < 0)
+			return -1;
+		if (json) {
+			printf(",\"version\":3,\"sig_type\":%d,\"sig_type_name\":"
+			       "\"%s\",\"pubkey_algo\":%d,\"pubkey_algo_name\":"
+			       "\"%s\",\"hash_algo\":%d,\"hash_algo_name\":\"%s\""
+			       ",\"created\":%lu", type, to_sig_type(type), pk,
+			       to_pubkey_algo(pk), hash, to_hash_algo(hash),
+			       be32(save + 3));
+			json_hex("issuer", save + 7, 8);
+			printf(",\"bits\":%d", bits);
+			return 0;
+		}
+		printf("signature type: %s\n", to_sig_type(type));
+		printf("pubkey algo:    %s\n", to_pubkey_algo(pk));
+		printf("hash algo:      %s\n", to_hash_algo(hash));
+		printf("left16 signed hash: %02x%02x\n", data[-2], data[-1]);
+		printf("signature: %d bits\n", bits);
+		return 0;
 	}
-	printf("signature type: %s\n", to_sig_type(data[1]));
-	printf("pubkey algo:    %s\n", to_pubkey_algo(data[2]));
-	printf("hash algo:      %s\n", to_hash_algo(data[3]));
 
+	if (dlen < 6)
+		return -1;
+	type = data[1];
+	pk = data[2];
+	hash = data[3];
 	data += 4;
 	dlen -= 4;
 
-	n = (data[0] << 8) | data[1];
-	data += 2;
-	dlen -= 2;
-
-	printf("hashed subpacket data:");
-	for (i = 0; i < n; i++)
-		printf(" %02x", data[i]);
-	printf("\n");
-	data += n;
-	dlen -= n;
+	nh = (data[0] << 8) | data[1];
+	if (nh + 4 > dlen - 2)
+		return -1;
+	hashed = data + 2;
+	data += 2 + nh;
+	dlen -= 2 + nh;
 
-	printf("bytes of header data to hash: %d\n", data - save);
+	nu = (data[0] << 8) | data[1];
+	if (nu + 2 > dlen - 2)
+		return -1;
+	unhashed = data + 2;
+	data += 2 + nu;
+	dlen -= 2 + nu;
 
-	n = (data[0] << 8) | data[1];
-	data += 2;
-	dlen -= 2;
+	/* the MPIs after left16 are the signature itself */
+	if (parse_mpi(data + 2, dlen - 2, &bits) < 0)
+		return -1;
 
-	printf("unhashed subpacket data:");
-	for (i = 0; i < n; i++)
-		printf(" %02x", data[i]);
-	printf("\n");
-	data += n;
-	dlen -= n;
+	if (json) {
+		printf(",\"version\":4,\"sig_type\":%d,\"sig_type_name\":\"%s\","
+		       "\"pubkey_algo\":%d,\"pubkey_algo_name\":\"%s\","
+		       "\"hash_algo\":%d,\"hash_algo_name\":\"%s\"",
+		       type, to_sig_type(type), pk, to_pubkey_algo(pk),
+		       hash, to_hash_algo(hash));
+		json_subpackets(hashed, nh);
+		json_subpackets(unhashed, nu);
+		printf(",\"bits\":%d", bits);
+		return 0;
+	}
 
+	printf("signature type: %s\n", to_sig_type(type));
+	printf("pubkey algo:    %s\n", to_pubkey_algo(pk));
+	printf("hash algo:      %s\n", to_hash_algo(hash));
+	print_subpackets("hashed", hashed, nh);
+	printf("bytes of header data to hash: %d\n", (int) (hashed + nh - save));
+	print_subpackets("unhashed", unhashed, nu);
 	printf("left16 signed hash: %02x%02x\n", data[0], data[1]);
-	data += 2;
-	dlen -= 2;
+	printf("signature: ");
+	print_mpi(data + 2, bits);
+	return 0;
+}
 
-	n = (data[0] << 8) | data[1];
-	data += 2;
-	dlen -= 2;
+int parse_one_pass(unsigned char *data, int dlen)
+{
+	if (dlen != 13 || data[0] != 3)
+		return -1;
+	if (json) {
+		printf(",\"sig_type\":%d,\"hash_algo\":%d,\"hash_algo_name\":"
+		       "\"%s\",\"pubkey_algo\":%d", data[1], data[2],
+		       to_hash_algo(data[2]), data[3]);
+		json_hex("issuer", data + 4, 8);
+		printf(",\"nested\":%d", data[12] == 0);
+		return 0;
+	}
+	printf("signature type: %s\n", to_sig_type(data[1]));
+	printf("hash algo:      %s\n", to_hash_algo(data[2]));
+	printf("pubkey algo:    %s\n", to_pubkey_algo(data[3]));
+	printf("key id:         %02x%02x%02x%02x%02x%02x%02x%02x\n",
+	       data[4], data[5], data[6], data[7],
+	       data[8], data[9], data[10], data[11]);
+	return 0;
+}
 
-	printf("signature: %d bits: %02x %02x %02x %02x ...\n", n,
-	       data[0], data[1], data[2], data[3]);
+int parse_user_id(unsigned char *data, int dlen)
+{
+	int n;
+
+	if (json) {
+		printf(",\"user_id\":");
+		json_string(data, dlen);
+		return 0;
+	}
+	for (n = 0; n < dlen; n++)
+		printf("%c", data[n] & 127);
+	printf("\n");
+	return 0;
 }
 
-void parse(unsigned char *data, int dlen)
+/* read all of a metadata packet's body into *buf: its length, or -1 if
+ * it is malformed or larger than MAX_META */
+static int read_meta(struct packet_reader *pr, u8 **buf, u32 *max)
 {
-	unsigned n;
-	while (dlen > 0) {
-		unsigned char x;
-
-		x = *data++;
-		dlen--;
-		unsigned plen, ptype;
-		if (!(x & 0x80)) {
-			printf("invalid packet header %02x\n", x);
-			return;
-		}
-		if (x & 0x40) {
-			printf("cannot decode new header %02x\n", x);
-			return;
-		}
-		ptype = (x >> 2) & 15;
-		switch (x & 3) {
-		case 0:
-			plen = data[0];
-			data++;
-			dlen--;
-			break;
-		case 1:
-			plen = data[1] | (data[0] << 8);
-			data+=2;
-			dlen-=2;
-			break;
-		case 2:
-		case 3:
-			printf("cannot handle length type %d\n", x & 3);
-			return;
-		}
+	u32 len = 0;
+	u8 *p;
+	int r;
 
-		switch (ptype) {
-		case 2:
-			printf("\n-- signature (len %d) --\n", plen);
-			parse_signature(data, plen);
-			break;
-		case 5:
-			printf("\n-- secret key (len %d) --\n", plen);
-			parse_key(data, plen, 1);
-			break;
-		case 6:
-			printf("\n-- public key (len %d) --\n", plen);
-			parse_key(data, plen, 0);
-			break;
-		case 13:
-			printf("\n-- user id (len %d) --\n", plen);
-			for (n = 0; n < plen; n++) {
-				printf("%c", data[n] & 127);
-			}
-			printf("\n");
-			break;
-		case 14:
-			printf("\n-- public subkey (len %d) --\n", plen);
-			parse_key(data, plen, 0);
-			break;
-		default:
-			printf("-- type %d len %d --\n", ptype, plen);
+	for (;;) {
+		if (len == *max) {
+			if (*max >= MAX_META)
+				return -1;
+			*max = *max ? *max * 2 : 4096;
+			p = realloc(*buf, *max);
+			if (!p)
+				return -1;
+			*buf = p;
 		}
+		r = packet_read(pr, *buf + len, *max - len);
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			return len;
+		len += r;
+	}
+}
+
+/* -- packet sequences -- */
 
-		dlen -= plen;
-		data += plen;
+struct dumper {
+	struct input *in; /* 0 unless bodies can be seeked over */
+	u8 *buf;
+	u32 max;
+};
+
+static int dump_packets(struct dumper *d, struct source *src, int depth);
+
+static int skip_body(struct dumper *d, struct packet_reader *pr)
+{
+	if (d->in)
+		return packet_skip_by(pr, seek_skip, d->in);
+	return packet_skip(pr);
+}
+
+static int dump_literal(struct dumper *d, struct packet_reader *pr)
+{
+	u8 hdr[2 + 255 + 4];
+	int known = !pr->hdr.partial && !pr->hdr.indeterminate;
+
+	if (packet_read_full(pr, hdr, 2) < 0 ||
+	    packet_read_full(pr, hdr + 2, hdr[1] + 4) < 0)
+		return -1;
+	if (json) {
+		printf(",\"format\":");
+		json_string(hdr, 1);
+		printf(",\"filename\":");
+		json_string(hdr + 2, hdr[1]);
+		printf(",\"date\":%lu", be32(hdr + 2 + hdr[1]));
+		if (known)
+			printf(",\"data_len\":%llu", pr->left);
+	} else {
+		printf("format %c, filename '%.*s'", hdr[0] & 127,
+		       hdr[1], hdr + 2);
+		if (known)
+			printf(", %llu bytes of data", pr->left);
+		printf("\n");
 	}
+	return skip_body(d, pr);
+}
+
+static int dump_compressed(struct dumper *d, struct packet_reader *pr,
+			   int depth)
+{
+	struct source *src;
+	struct dumper inner = *d;
+	u8 algo;
+	int r;
+
+	if (packet_read_full(pr, &algo, 1) < 0)
+		return -1;
+	if (json)
+		printf(",\"algo\":%d,\"algo_name\":\"%s\"", algo,
+		       to_compression_algo(algo));
+	else
+		printf("algo: %s\n", to_compression_algo(algo));
+
+	/* look inside one level down, which is all anything produces */
+	if (depth > 0 || algo > COMPRESSION_ZLIB)
+		return skip_body(d, pr);
+
+	src = packet_source(pr);
+	if (src && algo != COMPRESSION_NONE)
+		src = source_inflate(src, algo == COMPRESSION_ZIP ?
+				     INFLATE_RAW : INFLATE_ZLIB);
+	if (!src)
+		return -1;
+	inner.in = 0;
+	if (json)
+		printf(",\"packets\":[");
+	r = dump_packets(&inner, src, depth + 1);
+	if (json)
+		printf("]");
+	d->buf = inner.buf;
+	d->max = inner.max;
+	source_close(src);
+	return r;
+}
+
+static int dump_packet(struct dumper *d, struct packet_reader *pr, int depth)
+{
+	unsigned tag = pr->hdr.tag;
+	int (*parse)(unsigned char *, int) = 0;
+	int len, r;
+
+	if (json) {
+		printf("{\"tag\":%d,\"type\":\"%s\"", tag, to_packet_type(tag));
+		if (!pr->hdr.partial && !pr->hdr.indeterminate)
+			printf(",\"len\":%llu", pr->hdr.len);
+	} else {
+		printf("\n%*s-- %s (", depth * 2, "", to_packet_type(tag));
+		if (pr->hdr.partial || pr->hdr.indeterminate)
+			printf("tag %d, len unknown) --\n", tag);
+		else
+			printf("tag %d, len %llu) --\n", tag, pr->hdr.len);
+	}
+
+	switch (tag) {
+	case 2:
+		parse = parse_signature;
+		break;
+	case 4:
+		parse = parse_one_pass;
+		break;
+	case 13:
+		parse = parse_user_id;
+		break;
+	case 5:
+	case 6:
+	case 7:
+	case 14:
+		break;
+	case 8:
+		r = dump_compressed(d, pr, depth);
+		goto done;
+	case 11:
+		r = dump_literal(d, pr);
+		goto done;
+	default:
+		r = skip_body(d, pr);
+		goto done;
+	}
+
+	len = read_meta(pr, &d->buf, &d->max);
+	if (len < 0) {
+		if (json)
+			printf(",\"error\":\"unreadable\"");
+		else
+			printf("packet unreadable or too large\n");
+		r = -1;
+		goto done;
+	}
+	if (parse)
+		r = parse(d->buf, len);
+	else
+		r = parse_key(d->buf, len, tag == 5 || tag == 7);
+	/* an odd packet is worth noting, but the rest can still be read */
+	if (r < 0 && !json)
+		printf("cannot parse %s\n", to_packet_type(tag));
+	r = 0;
+
+done:
+	if (json)
+		printf("}");
+	return r;
+}
+
+static int dump_packets(struct dumper *d, struct source *src, int depth)
+{
+	struct packet_reader pr;
+	int r, first = 1;
+
+	packet_reader_init(&pr, src);
+	while ((r = packet_next(&pr)) > 0) {
+		if (json && !first)
+			printf(",");
+		first = 0;
+		if (dump_packet(d, &pr, depth))
+			return -1;
+	}
+	return r;
+}
+
+static int dump_fd(struct dumper *d, int fd, const char *name)
+{
+	struct source *fsrc, *src;
+	struct input in;
+	struct stat st;
+	u8 c;
+	int r;
+
+	/* binary files can have bodies seeked over; armor must be decoded */
+	r = read(fd, &c, 1);
+	if (r < 0)
+		return -1;
+	fsrc = source_fd(fd);
+	if (!fsrc)
+		return -1;
+	src = source_prefix(fsrc, &c, r);
+	d->in = 0;
+	if (r && armor_detect(&c, 1)) {
+		src = source_dearmor(src);
+	} else if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		in.fd = fd;
+		in.size = st.st_size;
+		d->in = &in;
+	}
+	if (!src) {
+		source_close(fsrc);
+		return -1;
+	}
+
+	if (json) {
+		printf("{\"file\":");
+		json_string((const u8 *) name, strlen(name));
+		printf(",\"packets\":[");
+	}
+	r = dump_packets(d, src, 0);
+	if (json) {
+		printf("]");
+		if (r)
+			printf(",\"error\":\"malformed\"");
+		printf("}\n");
+	} else if (r) {
+		printf("malformed packet\n");
+	}
+
+	source_close(src);
+	source_close(fsrc);
+	return r;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: rfc4880dump [--json] [<file>...]\n"
+		"  with no files, standard input is read\n");
 }
 
 int main(int argc, char **argv)
 {
-	unsigned char buf[4096];
-	int len;
-	len = read(0, buf, 4096);
-	printf("len = %d\n", len);
-	parse(buf, len);
-	return 0;
+	struct dumper d = { 0, 0, 0 };
+	int i, fd, files = 0, status = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json")) {
+			json = 1;
+		} else if (argv[i][0] == '-' && argv[i][1]) {
+			usage();
+			return -1;
+		}
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--json"))
+			continue;
+		files++;
+		if (!strcmp(argv[i], "-")) {
+			fd = 0;
+		} else if ((fd = open(argv[i], O_RDONLY)) < 0) {
+			fprintf(stderr,"cannot open '%s'\n", argv[i]);
+			status = -1;
+			continue;
+		}
+		if (!json && argc > 2)
+			printf("%s:\n", argv[i]);
+		if (dump_fd(&d, fd, argv[i]))
+			status = -1;
+		if (fd)
+			close(fd);
+	}
+	if (!files && dump_fd(&d, 0, "-"))
+		status = -1;
+
+	free(d.buf);
+	return status;
 }
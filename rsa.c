@@ -34,30 +34,30 @@
 
 #include "crypto.h"
 #include "imath.h"
+#include "stats.h"
+#include "mont.h"
 
-static u8 message_template[256] = {
-	0x00,0x01,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
-	0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0x00,
+/* the DER DigestInfo prefix for SHA-1 (rfc3447 9.2 note 1) */
+static const u8 sha1_digest_info[15] = {
 	0x30,0x21,0x30,0x09,0x06,0x05,0x2b,0x0e,0x03,0x02,0x1a,0x05,0x00,
-	0x04,0x14,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
-	0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+	0x04,0x14,
 };
 
+/* EMSA-PKCS1-v1_5 for a k byte modulus, all but the digest itself */
+static int pkcs1_prefix(u8 *em, u32 k)
+{
+	u32 pad = k - 3 - sizeof(sha1_digest_info) - SHA_DIGEST_SIZE;
+
+	if (k < 11 + sizeof(sha1_digest_info) + SHA_DIGEST_SIZE)
+		return -1;
+	em[0] = 0x00;
+	em[1] = 0x01;
+	memset(em + 2, 0xff, pad);
+	em[2 + pad] = 0x00;
+	memcpy(em + 3 + pad, sha1_digest_info, sizeof(sha1_digest_info));
+	return 0;
+}
+
 static int _rsa_sign(unsigned rsz, mpz_t *n, mpz_t *d,
 		     const u8 *msg, u8 *sig_out)
 {
@@ -90,48 +90,13 @@ fail:
 	return r;
 }
 
-static int _rsa_verify(unsigned rsz, mpz_t *n, mpz_t *e,
-		       const u8 *sig, u8 *msg_out)
-{
-	int r = -1;
-	mpz_t m, s;
-	int sz;
-
-	mp_int_init(&m);
-	mp_int_init(&s);
-
-	if (mp_int_read_unsigned(&s, (u8*) sig, rsz))
-		goto fail;
-
-	if (mp_int_exptmod(&s, e, n, &m))
-		goto fail;
-
-	sz = mp_int_unsigned_len(&m);
-	if (sz > rsz)
-		goto fail;
-
-	memset(msg_out, 0, rsz);
-
-	if (mp_int_to_unsigned(&m, msg_out + (rsz - sz), rsz))
-		goto fail;
-
-	r = 0;
-fail:
-	mp_int_clear(&m);
-	mp_int_clear(&s);
-	return r;
-}
-
 int rsa_sign(struct rsa_private_key *private,
 	     const u8 *digest, u8 *signature_out)
 {
 	int r = -1;
 	mpz_t n, d;
-	unsigned rsz = 256;
-	u8 msg[256];
-
-	memcpy(msg, message_template, 256 - 20);
-	memcpy(msg + 256 - 20, digest, 20);
+	unsigned rsz;
+	u8 *msg = 0;
 
 	mp_int_init(&n);
 	mp_int_init(&d);
@@ -140,41 +105,222 @@ int rsa_sign(struct rsa_private_key *private,
 		goto fail;
 	if (mp_int_read_unsigned(&d, private->d, private->d_sz))
 		goto fail;
+
+	rsz = mp_int_unsigned_len(&n);
+	msg = malloc(rsz);
+	if (!msg || pkcs1_prefix(msg, rsz))
+		goto fail;
+	memcpy(msg + rsz - SHA_DIGEST_SIZE, digest, SHA_DIGEST_SIZE);
 	if (_rsa_sign(rsz, &n, &d, msg, signature_out))
 		goto fail;
 
 	r = 0;
 fail:
+	free(msg);
 	mp_int_clear(&n);
 	mp_int_clear(&d);
-	return 0;
+	return r;
+}
+
+/* s^e mod n for a single signature, checked against the encoding of
+ * digest for the modulus at hand */
+static int verify_mont(const struct mont *m, const u8 *digest,
+		       const u8 *signature, u32 slen)
+{
+	u32 k = m->bytes;
+	u8 *em, *out;
+	int r = -1, valid, stage;
+
+	if (slen > k)
+		return -1;
+	em = malloc(2 * k);
+	if (!em)
+		return -1;
+	out = em + k;
+	if (pkcs1_prefix(em, k))
+		goto done;
+
+	stage = stats_enter(STATS_EXPTMOD);
+	stats_bytes(STATS_EXPTMOD, k);
+	valid = mont_exp(m, &signature, &slen, &out, 1);
+	stats_enter(stage);
+
+	if (valid == 1 &&
+	    !memcmp(out, em, k - SHA_DIGEST_SIZE) &&
+	    !memcmp(out + k - SHA_DIGEST_SIZE, digest, SHA_DIGEST_SIZE))
+		r = 0;
+done:
+	free(em);
+	return r;
+}
+
+int rsa_prepare(struct rsa_prepared_key *key, struct rsa_public_key *public)
+{
+	int r, stage;
+
+	stage = stats_enter(STATS_BIGNUM);
+	stats_bytes(STATS_BIGNUM, public->n_sz + public->e_sz);
+	key->n_sz = public->n_sz;
+	key->borrowed = 0;
+	r = mont_init(&key->mont, public->n, public->n_sz,
+		      public->e, public->e_sz);
+	stats_enter(stage);
+	return r ? -1 : 0;
+}
+
+void rsa_prepared_clear(struct rsa_prepared_key *key)
+{
+	/* borrowed limbs belong to whoever filled them in */
+	if (key->borrowed)
+		return;
+	mont_clear(&key->mont);
+}
+
+int rsa_verify_prepared(struct rsa_prepared_key *key,
+			const u8 *digest, const u8 *signature, u32 slen)
+{
+	return verify_mont(&key->mont, digest, signature, slen);
 }
 
 int rsa_verify(struct rsa_public_key *public,
                const u8 *digest, const u8 *signature, u32 slen)
 {
-	int r = -1;
-	mpz_t n, e;
-	unsigned rsz = 256;
-	u8 msg[256];
+	struct mont m;
+	int r, stage;
 
-	mp_int_init(&n);
-	mp_int_init(&e);
+	stage = stats_enter(STATS_BIGNUM);
+	stats_bytes(STATS_BIGNUM, public->n_sz + public->e_sz);
+	r = mont_init(&m, public->n, public->n_sz, public->e, public->e_sz);
+	stats_enter(stage);
+	if (r)
+		return -1;
+	r = verify_mont(&m, digest, signature, slen);
+	mont_clear(&m);
+	return r;
+}
 
-	if (mp_int_read_unsigned(&n, public->n, public->n_sz))
-		goto fail;
-	if (mp_int_read_unsigned(&e, public->e, public->e_sz))
-		goto fail;
-	if (_rsa_verify(rsz, &n, &e, signature, msg))
-		goto fail;
-	if (memcmp(message_template, msg, 256 - 20))
-		goto fail;
-	if (memcmp(digest, msg + 256 - 20, 20))
-		goto fail;
+struct batch_ref {
+	struct rsa_public_key *key;
+	u32 i;
+};
 
-	r = 0;
-fail:
-	mp_int_clear(&n);
-	mp_int_clear(&e);
-	return r;
+/* by contents, so that copies of one key end up together */
+static int key_cmp(struct rsa_public_key *x, struct rsa_public_key *y)
+{
+	int r;
+
+	if (x == y)
+		return 0;
+	if (x->n_sz != y->n_sz)
+		return x->n_sz < y->n_sz ? -1 : 1;
+	if (x->e_sz != y->e_sz)
+		return x->e_sz < y->e_sz ? -1 : 1;
+	r = memcmp(x->n, y->n, x->n_sz);
+	return r ? r : memcmp(x->e, y->e, x->e_sz);
+}
+
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct batch_ref *x = a, *y = b;
+	int r;
+
+	r = key_cmp(x->key, y->key);
+	if (r)
+		return r;
+	return x->i < y->i ? -1 : x->i > y->i;
+}
+
+/* the items ref[0:count], all by one key */
+static int verify_group(struct batch_ref *ref, u32 count,
+			const u8 **digests, const u8 **signatures,
+			const u32 *slens, u8 *ok)
+{
+	struct rsa_public_key *key = ref[0].key;
+	const u8 *in[MONT_LANES];
+	u32 in_len[MONT_LANES];
+	u8 *em, *out[MONT_LANES];
+	struct mont m;
+	u32 n, k, i;
+	int l, lanes, valid, stage, verified = 0;
+
+	stage = stats_enter(STATS_BIGNUM);
+	stats_bytes(STATS_BIGNUM, key->n_sz + key->e_sz);
+	if (mont_init(&m, key->n, key->n_sz, key->e, key->e_sz)) {
+		stats_enter(stage);
+		return 0;
+	}
+	k = m.bytes;
+	em = malloc((MONT_LANES + 1) * k);
+	if (!em || pkcs1_prefix(em, k)) {
+		free(em);
+		mont_clear(&m);
+		stats_enter(stage);
+		return em ? 0 : -1;
+	}
+	for (l = 0; l < MONT_LANES; l++)
+		out[l] = em + (l + 1) * k;
+
+	stats_enter(STATS_EXPTMOD);
+	for (n = 0; n < count; n += lanes) {
+		lanes = count - n < MONT_LANES ? count - n : MONT_LANES;
+		for (l = 0; l < lanes; l++) {
+			in[l] = signatures[ref[n + l].i];
+			in_len[l] = slens[ref[n + l].i];
+		}
+		stats_bytes(STATS_EXPTMOD, lanes * k);
+		valid = mont_exp(&m, in, in_len, out, lanes);
+		if (valid < 0) {
+			verified = -1;
+			break;
+		}
+		for (l = 0; l < lanes; l++) {
+			i = ref[n + l].i;
+			if (!(valid >> l & 1) || in_len[l] > k ||
+			    memcmp(out[l], em, k - SHA_DIGEST_SIZE) ||
+			    memcmp(out[l] + k - SHA_DIGEST_SIZE, digests[i],
+				   SHA_DIGEST_SIZE))
+				continue;
+			ok[i / 8] |= 1 << (i % 8);
+			verified++;
+		}
+	}
+	stats_enter(stage);
+
+	free(em);
+	mont_clear(&m);
+	return verified;
+}
+
+int rsa_verify_batch(struct rsa_public_key **keys, const u8 **digests,
+		     const u8 **signatures, const u32 *slens,
+		     u32 count, u8 *ok)
+{
+	struct batch_ref *ref;
+	u32 n, end;
+	int r, verified = 0;
+
+	memset(ok, 0, (count + 7) / 8);
+	ref = malloc((count ? count : 1) * sizeof(*ref));
+	if (!ref)
+		return -1;
+	for (n = 0; n < count; n++) {
+		ref[n].key = keys[n];
+		ref[n].i = n;
+	}
+	qsort(ref, count, sizeof(*ref), batch_cmp);
+
+	for (n = 0; n < count; n = end) {
+		for (end = n + 1; end < count; end++)
+			if (key_cmp(ref[end].key, ref[n].key))
+				break;
+		r = verify_group(ref + n, end - n, digests, signatures,
+				 slens, ok);
+		if (r < 0) {
+			verified = -1;
+			break;
+		}
+		verified += r;
+	}
+	free(ref);
+	return verified;
 }
@@ -34,7 +34,7 @@
 extern "C" {
 #endif
 
-#define RSANUMBYTES 256           /* 2048 bit key length */
+#define RSANUMBYTES 512           /* room for keys up to 4096 bits */
 #define RSANUMWORDS (RSANUMBYTES / sizeof(uint32_t))
 
 typedef struct RSAPublicKey {
@@ -0,0 +1,145 @@
+/* stats.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <time.h>
+
+#include "stats.h"
+
+static __thread struct stats *current;
+
+static const char *names[STATS_STAGES] = {
+	"other", "load", "parse", "hash", "bignum", "exptmod",
+};
+
+u64 stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_begin(struct stats *st)
+{
+	u32 n;
+
+	for (n = 0; n < STATS_STAGES; n++) {
+		st->ns[n] = 0;
+		st->bytes[n] = 0;
+	}
+	st->total_ns = 0;
+	st->stage = STATS_OTHER;
+	st->start = st->mark = stats_now();
+	current = st;
+}
+
+void stats_end(struct stats *st)
+{
+	u64 now = stats_now();
+
+	st->ns[st->stage] += now - st->mark;
+	st->total_ns = now - st->start;
+	current = 0;
+}
+
+int stats_active(void)
+{
+	return current != 0;
+}
+
+int stats_enter(int stage)
+{
+	struct stats *st = current;
+	u64 now;
+	int prev;
+
+	if (!st)
+		return STATS_OTHER;
+	prev = st->stage;
+	if (stage != prev) {
+		now = stats_now();
+		st->ns[prev] += now - st->mark;
+		st->mark = now;
+		st->stage = stage;
+	}
+	return prev;
+}
+
+void stats_bytes(int stage, u64 bytes)
+{
+	if (current)
+		current->bytes[stage] += bytes;
+}
+
+const char *stats_stage_name(int stage)
+{
+	return names[stage];
+}
+
+static u32 bucket(u64 ns)
+{
+	u32 k = 0;
+
+	while (ns && k < STATS_BUCKETS - 1) {
+		ns >>= 1;
+		k++;
+	}
+	return k;
+}
+
+void stats_hist_add(struct stats_hist *h, const struct stats *st)
+{
+	u32 n;
+
+	h->count++;
+	for (n = 0; n < STATS_STAGES; n++) {
+		h->sum.ns[n] += st->ns[n];
+		h->sum.bytes[n] += st->bytes[n];
+		h->bucket[n][bucket(st->ns[n])]++;
+	}
+	h->sum.total_ns += st->total_ns;
+	h->bucket[STATS_STAGES][bucket(st->total_ns)]++;
+}
+
+u64 stats_hist_percentile(const struct stats_hist *h, int row, int pct)
+{
+	u64 want, seen = 0;
+	u32 k;
+
+	if (!h->count)
+		return 0;
+	want = (h->count * pct + 99) / 100;
+	for (k = 0; k < STATS_BUCKETS; k++) {
+		seen += h->bucket[row][k];
+		if (seen >= want)
+			break;
+	}
+	return k ? 1ULL << k : 0;
+}
@@ -0,0 +1,94 @@
+/* stats.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "crypto.h"
+
+/* where the time goes in a verification.  a thread that installs a
+ * collector with stats_begin has the monotonic time between each change
+ * of stage, and the bytes each stage handles, added up in it; on any
+ * other thread the hooks cost a thread-local load and a branch.  stages
+ * nest, so the time is exclusive: hashing done while reading a signed
+ * message counts as hashing, not parsing */
+enum {
+	STATS_OTHER,   /* none of the below: opening files, key lookup */
+	STATS_LOAD,    /* reading input, or waiting for a read-ahead thread */
+	STATS_PARSE,   /* packets, armor and compression */
+	STATS_HASH,    /* SHA-1 over the message and signature header */
+	STATS_BIGNUM,  /* reading keys and signatures into bignums */
+	STATS_EXPTMOD, /* the modular exponentiation */
+	STATS_STAGES
+};
+
+struct stats {
+	u64 ns[STATS_STAGES];
+	u64 bytes[STATS_STAGES];
+	u64 total_ns;
+
+	/* while collecting */
+	int stage;
+	u64 mark;
+	u64 start;
+};
+
+/* nanoseconds on the monotonic clock */
+u64 stats_now(void);
+
+/* clear st and collect into it on this thread until stats_end */
+void stats_begin(struct stats *st);
+void stats_end(struct stats *st);
+
+/* 1 if this thread is collecting */
+int stats_active(void);
+
+/* switch to stage, returning the stage to switch back to afterwards */
+int stats_enter(int stage);
+void stats_bytes(int stage, u64 bytes);
+
+const char *stats_stage_name(int stage);
+
+/* many verifications at once: sums, and log2 histograms of the time each
+ * one spent in each stage; bucket k counts times below 2^k ns (k > 0) */
+#define STATS_BUCKETS 40
+
+struct stats_hist {
+	u64 count;
+	struct stats sum;
+	u64 bucket[STATS_STAGES + 1][STATS_BUCKETS]; /* the last is the total */
+};
+
+void stats_hist_add(struct stats_hist *h, const struct stats *st);
+
+/* the upper bound of the bucket that the pct'th percentile falls in */
+u64 stats_hist_percentile(const struct stats_hist *h, int row, int pct);
+
+#endif
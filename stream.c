@@ -0,0 +1,606 @@
+/* stream.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "stream.h"
+#include "stats.h"
+
+int source_read_full(struct source *src, u8 *buf, u32 len)
+{
+	u32 have = 0;
+	int r;
+
+	while (have < len) {
+		r = src->read(src, buf + have, len - have);
+		if (r < 0)
+			return r;
+		if (r == 0)
+			break;
+		have += r;
+	}
+	return have;
+}
+
+void source_close(struct source *src)
+{
+	if (src)
+		src->close(src);
+}
+
+/* -- plain file descriptor -- */
+
+struct fd_source {
+	struct source src;
+	int fd;
+};
+
+static int fd_read(struct source *src, u8 *buf, u32 len)
+{
+	struct fd_source *fs = (struct fd_source *) src;
+	ssize_t r;
+	int stage;
+
+	if (len > 0x40000000)
+		len = 0x40000000;
+	stage = stats_enter(STATS_LOAD);
+	do {
+		r = read(fs->fd, buf, len);
+	} while (r < 0 && errno == EINTR);
+	if (r > 0)
+		stats_bytes(STATS_LOAD, r);
+	stats_enter(stage);
+	return r;
+}
+
+static void fd_close(struct source *src)
+{
+	free(src);
+}
+
+struct source *source_fd(int fd)
+{
+	struct fd_source *fs;
+
+	fs = malloc(sizeof(*fs));
+	if (!fs)
+		return 0;
+	fs->src.read = fd_read;
+	fs->src.close = fd_close;
+	fs->fd = fd;
+	return &fs->src;
+}
+
+/* -- bytes already read, put back in front of a source -- */
+
+struct prefix_source {
+	struct source src;
+	struct source *in;
+	u32 pos;
+	u32 len;
+	u8 data[0];
+};
+
+static int prefix_read(struct source *src, u8 *buf, u32 len)
+{
+	struct prefix_source *ps = (struct prefix_source *) src;
+
+	if (ps->pos == ps->len)
+		return source_read(ps->in, buf, len);
+	if (len > ps->len - ps->pos)
+		len = ps->len - ps->pos;
+	memcpy(buf, ps->data + ps->pos, len);
+	ps->pos += len;
+	return len;
+}
+
+static void prefix_close(struct source *src)
+{
+	free(src);
+}
+
+struct source *source_prefix(struct source *in, const u8 *data, u32 len)
+{
+	struct prefix_source *ps;
+
+	if (!in)
+		return 0;
+	ps = malloc(sizeof(*ps) + len);
+	if (!ps)
+		return 0;
+	ps->src.read = prefix_read;
+	ps->src.close = prefix_close;
+	ps->in = in;
+	ps->pos = 0;
+	ps->len = len;
+	memcpy(ps->data, data, len);
+	return &ps->src;
+}
+
+/* -- helper thread filling a ring of buffers -- */
+
+struct thread_slot {
+	u8 *data;
+	int len; /* 0 at end of input, <0 on error */
+};
+
+struct thread_source {
+	struct source src;
+	struct source *in;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	unsigned depth;
+	unsigned head;  /* next slot handed to the reader */
+	unsigned count; /* slots filled and not yet consumed */
+	u32 size;
+	u32 pos;        /* bytes of the head slot already consumed */
+	int stop;
+	u8 *buffers;
+	struct thread_slot slot[0];
+};
+
+static void *thread_main(void *arg)
+{
+	struct thread_source *ts = arg;
+	unsigned tail = 0;
+	int r;
+
+	for (;;) {
+		pthread_mutex_lock(&ts->lock);
+		while (ts->count == ts->depth && !ts->stop)
+			pthread_cond_wait(&ts->drained, &ts->lock);
+		if (ts->stop) {
+			pthread_mutex_unlock(&ts->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ts->lock);
+
+		r = source_read_full(ts->in, ts->slot[tail].data, ts->size);
+
+		pthread_mutex_lock(&ts->lock);
+		ts->slot[tail].len = r;
+		ts->count++;
+		pthread_cond_signal(&ts->filled);
+		pthread_mutex_unlock(&ts->lock);
+
+		/* the final (empty or failed) slot stays at the head forever */
+		if (r <= 0)
+			break;
+		tail = (tail + 1) % ts->depth;
+	}
+	return 0;
+}
+
+static int thread_read(struct source *src, u8 *buf, u32 len)
+{
+	struct thread_source *ts = (struct thread_source *) src;
+	struct thread_slot *s;
+	int stage;
+
+	stage = stats_enter(STATS_LOAD);
+	pthread_mutex_lock(&ts->lock);
+	while (ts->count == 0)
+		pthread_cond_wait(&ts->filled, &ts->lock);
+	pthread_mutex_unlock(&ts->lock);
+	stats_enter(stage);
+
+	s = ts->slot + ts->head;
+	if (s->len <= 0)
+		return s->len;
+
+	if (len > s->len - ts->pos)
+		len = s->len - ts->pos;
+	memcpy(buf, s->data + ts->pos, len);
+	ts->pos += len;
+	stats_bytes(STATS_LOAD, len);
+
+	if (ts->pos == s->len) {
+		ts->pos = 0;
+		ts->head = (ts->head + 1) % ts->depth;
+		pthread_mutex_lock(&ts->lock);
+		ts->count--;
+		pthread_cond_signal(&ts->drained);
+		pthread_mutex_unlock(&ts->lock);
+	}
+	return len;
+}
+
+static void thread_close(struct source *src)
+{
+	struct thread_source *ts = (struct thread_source *) src;
+
+	pthread_mutex_lock(&ts->lock);
+	ts->stop = 1;
+	pthread_cond_signal(&ts->drained);
+	pthread_mutex_unlock(&ts->lock);
+	pthread_join(ts->thread, 0);
+
+	source_close(ts->in);
+	pthread_mutex_destroy(&ts->lock);
+	pthread_cond_destroy(&ts->filled);
+	pthread_cond_destroy(&ts->drained);
+	free(ts->buffers);
+	free(ts);
+}
+
+struct source *source_thread(struct source *in, unsigned depth, u32 size)
+{
+	struct thread_source *ts;
+	unsigned n;
+
+	if (!in)
+		return 0;
+	if (size > 0x40000000)
+		size = 0x40000000;
+
+	ts = calloc(1, sizeof(*ts) + depth * sizeof(ts->slot[0]));
+	if (!ts)
+		goto fail;
+	ts->buffers = malloc(depth * size);
+	if (!ts->buffers)
+		goto fail;
+
+	ts->src.read = thread_read;
+	ts->src.close = thread_close;
+	ts->in = in;
+	ts->depth = depth;
+	ts->size = size;
+	for (n = 0; n < depth; n++)
+		ts->slot[n].data = ts->buffers + n * size;
+
+	pthread_mutex_init(&ts->lock, 0);
+	pthread_cond_init(&ts->filled, 0);
+	pthread_cond_init(&ts->drained, 0);
+	if (pthread_create(&ts->thread, 0, thread_main, ts)) {
+		pthread_mutex_destroy(&ts->lock);
+		pthread_cond_destroy(&ts->filled);
+		pthread_cond_destroy(&ts->drained);
+		goto fail;
+	}
+	return &ts->src;
+
+fail:
+	if (ts)
+		free(ts->buffers);
+	free(ts);
+	source_close(in);
+	return 0;
+}
+
+/* -- io_uring: depth reads in flight at consecutive file offsets -- */
+
+#ifdef __NR_io_uring_setup
+
+#define SLOT_IDLE	0	/* past the end of the file */
+#define SLOT_BUSY	1	/* read submitted */
+#define SLOT_DONE	2
+#define SLOT_ERROR	3
+
+struct uring_slot {
+	u8 *data;
+	u64 off;
+	u32 want;
+	u32 have;
+	int state;
+	struct iovec iov;
+};
+
+struct uring_source {
+	struct source src;
+	int ring;
+	int fd;
+	unsigned depth;
+	unsigned head;
+	u32 size;
+	u32 pos;
+	u64 next;  /* file offset of the next read to submit */
+	u64 fsize;
+
+	void *sq_ptr;
+	size_t sq_len;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	void *cq_ptr;
+	size_t cq_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	u8 *buffers;
+	struct uring_slot slot[0];
+};
+
+static int uring_enter(int ring, unsigned submit, unsigned wait)
+{
+	int r;
+
+	do {
+		r = syscall(__NR_io_uring_enter, ring, submit, wait,
+			    wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+static int uring_submit(struct uring_source *us, unsigned n)
+{
+	struct uring_slot *s = us->slot + n;
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	s->iov.iov_base = s->data + s->have;
+	s->iov.iov_len = s->want - s->have;
+
+	tail = *us->sq_tail;
+	idx = tail & *us->sq_mask;
+	sqe = us->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = us->fd;
+	sqe->addr = (unsigned long) &s->iov;
+	sqe->len = 1;
+	sqe->off = s->off + s->have;
+	sqe->user_data = n;
+	us->sq_array[idx] = idx;
+	__atomic_store_n(us->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	s->state = SLOT_BUSY;
+	if (uring_enter(us->ring, 1, 0) != 1) {
+		s->state = SLOT_ERROR;
+		return -1;
+	}
+	return 0;
+}
+
+/* hand the slot the next chunk of the file, if there is one */
+static void uring_refill(struct uring_source *us, unsigned n)
+{
+	struct uring_slot *s = us->slot + n;
+
+	if (us->next >= us->fsize) {
+		s->state = SLOT_IDLE;
+		return;
+	}
+	s->off = us->next;
+	s->want = us->size;
+	if (s->want > us->fsize - us->next)
+		s->want = us->fsize - us->next;
+	s->have = 0;
+	us->next += s->want;
+	uring_submit(us, n);
+}
+
+static void uring_reap(struct uring_source *us)
+{
+	unsigned head = *us->cq_head;
+	struct io_uring_cqe *cqe;
+	struct uring_slot *s;
+
+	while (head != __atomic_load_n(us->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = us->cqes + (head & *us->cq_mask);
+		s = us->slot + cqe->user_data;
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			uring_submit(us, cqe->user_data);
+		} else if (cqe->res < 0) {
+			s->state = SLOT_ERROR;
+		} else if (cqe->res == 0) {
+			/* file shrank underneath us */
+			s->state = SLOT_DONE;
+		} else {
+			s->have += cqe->res;
+			if (s->have < s->want)
+				uring_submit(us, cqe->user_data);
+			else
+				s->state = SLOT_DONE;
+		}
+		head++;
+		__atomic_store_n(us->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static int uring_read(struct source *src, u8 *buf, u32 len)
+{
+	struct uring_source *us = (struct uring_source *) src;
+	struct uring_slot *s = us->slot + us->head;
+	int stage;
+
+	stage = stats_enter(STATS_LOAD);
+	while (s->state == SLOT_BUSY) {
+		if (uring_enter(us->ring, 0, 1) < 0) {
+			stats_enter(stage);
+			return -1;
+		}
+		uring_reap(us);
+	}
+	stats_enter(stage);
+	if (s->state == SLOT_IDLE)
+		return 0;
+	if (s->state == SLOT_ERROR)
+		return -1;
+
+	if (len > s->have - us->pos)
+		len = s->have - us->pos;
+	memcpy(buf, s->data + us->pos, len);
+	us->pos += len;
+	stats_bytes(STATS_LOAD, len);
+
+	if (us->pos == s->have) {
+		us->pos = 0;
+		uring_refill(us, us->head);
+		us->head = (us->head + 1) % us->depth;
+	}
+	return len;
+}
+
+static void uring_close(struct source *src)
+{
+	struct uring_source *us = (struct uring_source *) src;
+	unsigned n, busy;
+
+	/* the kernel may still be writing into our buffers */
+	for (;;) {
+		uring_reap(us);
+		for (n = busy = 0; n < us->depth; n++)
+			if (us->slot[n].state == SLOT_BUSY)
+				busy++;
+		if (!busy || uring_enter(us->ring, 0, 1) < 0)
+			break;
+	}
+
+	munmap(us->sqes, us->sqes_len);
+	munmap(us->cq_ptr, us->cq_len);
+	munmap(us->sq_ptr, us->sq_len);
+	close(us->ring);
+	free(us->buffers);
+	free(us);
+}
+
+static struct source *source_uring(int fd, unsigned depth, u32 size)
+{
+	struct io_uring_params p;
+	struct uring_source *us;
+	struct stat st;
+	unsigned n;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	us = calloc(1, sizeof(*us) + depth * sizeof(us->slot[0]));
+	if (!us)
+		return 0;
+	us->ring = -1;
+	us->sq_ptr = us->cq_ptr = us->sqes = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	us->ring = syscall(__NR_io_uring_setup, depth, &p);
+	if (us->ring < 0)
+		goto fail;
+
+	us->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	us->sq_ptr = mmap(0, us->sq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, us->ring,
+			  IORING_OFF_SQ_RING);
+	if (us->sq_ptr == MAP_FAILED)
+		goto fail;
+	us->sq_tail = us->sq_ptr + p.sq_off.tail;
+	us->sq_mask = us->sq_ptr + p.sq_off.ring_mask;
+	us->sq_array = us->sq_ptr + p.sq_off.array;
+
+	us->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	us->sqes = mmap(0, us->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, us->ring, IORING_OFF_SQES);
+	if (us->sqes == MAP_FAILED)
+		goto fail;
+
+	us->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	us->cq_ptr = mmap(0, us->cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, us->ring,
+			  IORING_OFF_CQ_RING);
+	if (us->cq_ptr == MAP_FAILED)
+		goto fail;
+	us->cq_head = us->cq_ptr + p.cq_off.head;
+	us->cq_tail = us->cq_ptr + p.cq_off.tail;
+	us->cq_mask = us->cq_ptr + p.cq_off.ring_mask;
+	us->cqes = us->cq_ptr + p.cq_off.cqes;
+
+	us->buffers = malloc(depth * size);
+	if (!us->buffers)
+		goto fail;
+
+	us->src.read = uring_read;
+	us->src.close = uring_close;
+	us->fd = fd;
+	us->depth = depth;
+	us->size = size;
+	us->fsize = st.st_size;
+	for (n = 0; n < depth; n++) {
+		us->slot[n].data = us->buffers + n * size;
+		uring_refill(us, n);
+	}
+	return &us->src;
+
+fail:
+	if (us->cq_ptr != MAP_FAILED)
+		munmap(us->cq_ptr, us->cq_len);
+	if (us->sqes != MAP_FAILED)
+		munmap(us->sqes, us->sqes_len);
+	if (us->sq_ptr != MAP_FAILED)
+		munmap(us->sq_ptr, us->sq_len);
+	if (us->ring >= 0)
+		close(us->ring);
+	free(us->buffers);
+	free(us);
+	return 0;
+}
+
+#else
+
+static struct source *source_uring(int fd, unsigned depth, u32 size)
+{
+	return 0;
+}
+
+#endif
+
+struct source *source_pipeline(int fd, unsigned depth, u32 size)
+{
+	struct source *src;
+
+	if (size > 0x40000000)
+		size = 0x40000000;
+
+	src = source_uring(fd, depth, size);
+	if (src)
+		return src;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return source_thread(source_fd(fd), depth, size);
+}
@@ -0,0 +1,74 @@
+/* stream.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "crypto.h"
+
+/* a sequential byte source; input stages stack on top of each other */
+struct source {
+	/* read up to len bytes: returns count, 0 at end of input, <0 on error */
+	int (*read)(struct source *src, u8 *buf, u32 len);
+	void (*close)(struct source *src);
+};
+
+static inline int source_read(struct source *src, u8 *buf, u32 len)
+{
+	return src->read(src, buf, len);
+}
+
+/* fill buf completely: returns len, a short count at end of input,
+ * or <0 on error */
+int source_read_full(struct source *src, u8 *buf, u32 len);
+
+void source_close(struct source *src);
+
+/* plain read() on fd (the fd is not closed by source_close) */
+struct source *source_fd(int fd);
+
+/* data[0:len] (copied) followed by whatever src has left, for readers
+ * that had to look at the start of their input to decide what it is
+ * (src is not closed by source_close) */
+struct source *source_prefix(struct source *src, const u8 *data, u32 len);
+
+/* run src on a helper thread, keeping up to depth buffers of size bytes
+ * filled ahead of the reader; src is closed along with the result */
+struct source *source_thread(struct source *src, unsigned depth, u32 size);
+
+/* read fd ahead of the consumer with depth reads of size bytes in flight,
+ * through io_uring where available and a helper thread otherwise */
+struct source *source_pipeline(int fd, unsigned depth, u32 size);
+
+/* what source_pipeline is given for reading whole files */
+#define PIPELINE_DEPTH 4
+#define PIPELINE_SIZE (1024 * 1024)
+
+#endif
@@ -0,0 +1,329 @@
+/* stress.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* hammer one libpgpverify context from more and more threads at once,
+ * checking every answer, and with -s that throughput grows with the
+ * threads: the context is shared read-only, so nothing should serialize
+ * them.  the asynchronous interface is put through its paces first */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "pgpverify.h"
+
+#define ROUND_NS	300000000ULL
+#define MAX_THREADS	64
+
+/* with -s and two CPUs to run on, two threads must do at least this
+ * much better than one.  timing depends on whatever else the machine is
+ * doing, so it is left out of plain correctness runs */
+#define MIN_SPEEDUP	1.4
+
+struct worker {
+	pthread_t thread;
+	uint64_t done;
+	uint64_t errors;
+} __attribute__((aligned(64)));
+
+static struct pgpverify *pv;
+static uint8_t *msg, *sig;
+static size_t msg_len, sig_len;
+static uint64_t deadline;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t *read_file(const char *fn, size_t *len)
+{
+	uint8_t *data = 0, *p;
+	size_t have = 0, max = 0, n;
+	FILE *fp;
+
+	fp = fopen(fn, "rb");
+	if (!fp) {
+		fprintf(stderr,"cannot open '%s'\n", fn);
+		return 0;
+	}
+	for (;;) {
+		if (have == max) {
+			max = max ? max * 2 : 65536;
+			p = realloc(data, max);
+			if (!p)
+				break;
+			data = p;
+		}
+		n = fread(data + have, 1, max - have, fp);
+		if (n == 0) {
+			fclose(fp);
+			*len = have;
+			return data;
+		}
+		have += n;
+	}
+	fclose(fp);
+	free(data);
+	return 0;
+}
+
+/* mostly plain good checks, with a stream fed in odd-sized pieces, a
+ * message that must fail and a cut-off signature that must be refused,
+ * with a reason that no other thread's check has overwritten, mixed in */
+static int one(uint64_t n, const uint8_t *bad)
+{
+	struct pgpverify_stream *st;
+	size_t off, len;
+
+	switch (n % 8) {
+	case 0:
+		return pgpverify_detached(pv, bad, msg_len, sig, sig_len) ==
+			PGPVERIFY_FAILED;
+	case 1:
+		st = pgpverify_stream_new(pv, sig, sig_len);
+		if (!st)
+			return 0;
+		for (off = 0; off < msg_len; off += len) {
+			len = msg_len - off < 7 ? msg_len - off : 7;
+			pgpverify_stream_update(st, msg + off, len);
+		}
+		return pgpverify_stream_final(st) == PGPVERIFY_OK;
+	case 2:
+		return pgpverify_detached(pv, msg, msg_len, sig, sig_len / 2) ==
+			PGPVERIFY_ERROR && pgpverify_error()[0];
+	default:
+		return pgpverify_detached(pv, msg, msg_len, sig, sig_len) ==
+			PGPVERIFY_OK && !pgpverify_error()[0];
+	}
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	uint8_t *bad;
+
+	bad = malloc(msg_len);
+	if (!bad) {
+		w->errors++;
+		return 0;
+	}
+	memcpy(bad, msg, msg_len);
+	bad[msg_len / 2] ^= 1;
+
+	while (now_ns() < deadline) {
+		if (!one(w->done, bad))
+			w->errors++;
+		w->done++;
+	}
+	free(bad);
+	return 0;
+}
+
+/* the async checks: even-numbered ones good, odd ones bad */
+#define ASYNC_CHECKS	200
+#define ASYNC_DEPTH	8
+
+static uint8_t *async_bad;
+static uint64_t async_right, async_wrong;
+
+static int async_submit(struct pgpverify_async *as, uintptr_t i,
+			void (*done)(void *, int))
+{
+	return pgpverify_try_submit(as, pv, i & 1 ? async_bad : msg, msg_len,
+				    sig, sig_len, done, (void *) i);
+}
+
+static void async_result(void *cookie, int status)
+{
+	uintptr_t i = (uintptr_t) cookie;
+
+	if (status == (i & 1 ? PGPVERIFY_FAILED : PGPVERIFY_OK))
+		__atomic_add_fetch(&async_right, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&async_wrong, 1, __ATOMIC_RELAXED);
+}
+
+/* every result is delivered exactly once, by callback or through the
+ * eventfd, and a full queue turns submissions away */
+static int async_check(void)
+{
+	struct pgpverify_result res[ASYNC_DEPTH];
+	struct pgpverify_async *as;
+	struct pollfd pfd;
+	uintptr_t i;
+	int n, k, turned_away = 0;
+
+	async_bad = malloc(msg_len);
+	if (!async_bad)
+		return -1;
+	memcpy(async_bad, msg, msg_len);
+	async_bad[msg_len / 2] ^= 1;
+
+	/* callbacks: waiting for room as need be */
+	as = pgpverify_async_new(2, ASYNC_DEPTH);
+	if (!as)
+		return -1;
+	for (i = 0; i < ASYNC_CHECKS; i++)
+		if (pgpverify_submit(as, pv, i & 1 ? async_bad : msg, msg_len,
+				     sig, sig_len, async_result, (void *) i))
+			return -1;
+	pgpverify_async_free(as);
+
+	/* the eventfd: unreaped results hold their slots, so once the
+	 * queue is full nothing more goes in until some are reaped */
+	as = pgpverify_async_new(2, ASYNC_DEPTH);
+	if (!as)
+		return -1;
+	pfd.fd = pgpverify_async_fd(as);
+	pfd.events = POLLIN;
+	i = 0;
+	while (async_right + async_wrong < 2 * ASYNC_CHECKS) {
+		while (i < ASYNC_CHECKS && !async_submit(as, i, 0))
+			i++;
+		if (i < ASYNC_CHECKS) {
+			if (errno != EAGAIN)
+				return -1;
+			turned_away++;
+		}
+		if (poll(&pfd, 1, 10000) != 1)
+			break;
+		n = pgpverify_async_reap(as, res, ASYNC_DEPTH);
+		for (k = 0; k < n; k++)
+			async_result(res[k].cookie, res[k].status);
+	}
+	pgpverify_async_free(as);
+	free(async_bad);
+
+	if (async_wrong || async_right != 2 * ASYNC_CHECKS || !turned_away) {
+		fprintf(stderr,"async: %llu right, %llu wrong, %d turned away\n",
+			(unsigned long long) async_right,
+			(unsigned long long) async_wrong, turned_away);
+		return -1;
+	}
+	printf("async: %d checks by callback and by eventfd\n",
+	       2 * ASYNC_CHECKS);
+	return 0;
+}
+
+/* verifications per second from threads threads, or -1 on any error */
+static double round_of(unsigned threads)
+{
+	struct worker w[MAX_THREADS];
+	uint64_t start, done = 0, errors = 0;
+	unsigned n;
+
+	memset(w, 0, sizeof(w));
+	start = now_ns();
+	deadline = start + ROUND_NS;
+	for (n = 0; n < threads; n++)
+		if (pthread_create(&w[n].thread, 0, work, &w[n]))
+			return -1;
+	for (n = 0; n < threads; n++) {
+		pthread_join(w[n].thread, 0);
+		done += w[n].done;
+		errors += w[n].errors;
+	}
+	if (errors) {
+		fprintf(stderr,"%u threads: %llu of %llu checks wrong\n", threads,
+			(unsigned long long) errors, (unsigned long long) done);
+		return -1;
+	}
+	return done / ((now_ns() - start) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	double rate, one_rate = 0, two_rate = 0;
+	unsigned threads, cpus, max;
+	int failed = 0, scaling = 0;
+
+	if (argc == 5 && !strcmp(argv[1], "-s")) {
+		scaling = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 4) {
+		fprintf(stderr,"usage: stress [-s] <keyring> <message> <signature>\n");
+		return -1;
+	}
+	pv = pgpverify_open(argv[1], 0);
+	msg = read_file(argv[2], &msg_len);
+	sig = read_file(argv[3], &sig_len);
+	if (!pv || !msg || !sig || !msg_len) {
+		fprintf(stderr,"cannot load test inputs\n");
+		return -1;
+	}
+
+	if (async_check())
+		failed = 1;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	max = cpus < 2 ? 2 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+	printf("threads  checks/s  speedup\n");
+	for (threads = 1; !failed; threads = threads * 2 > max ? max : threads * 2) {
+		rate = round_of(threads);
+		if (rate < 0) {
+			failed = 1;
+			break;
+		}
+		if (threads == 1)
+			one_rate = rate;
+		if (threads == 2)
+			two_rate = rate;
+		printf("%7u  %8.0f  %7.2f\n", threads, rate, rate / one_rate);
+		if (threads == max)
+			break;
+	}
+
+	if (!failed && scaling && cpus >= 2 &&
+	    two_rate < one_rate * MIN_SPEEDUP) {
+		fprintf(stderr,"two threads ran at %.2fx one: not scaling\n",
+			two_rate / one_rate);
+		failed = 1;
+	}
+	if (!failed && scaling && cpus < 2)
+		printf("one CPU: scaling not checked\n");
+
+	pgpverify_close(pv);
+	free(msg);
+	free(sig);
+	printf(failed ? "stress: FAILED\n" : "stress: OK\n");
+	return failed ? -1 : 0;
+}
@@ -30,38 +30,860 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "crypto.h"
+#include "rfc4880.h"
+#include "stream.h"
+#include "pool.h"
+#include "stats.h"
 
-int main(int argc, char **argv)
+#define CHUNK_SIZE (64 * 1024)
+
+/* -p: copy the message to stdout as it is hashed */
+static int passthrough;
+
+static int write_full(int fd, const u8 *data, u32 len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, data, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        data += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static void pass_out(void *cookie, const u8 *data, u32 len)
 {
-    struct rsa_public_key *public = 0;
-    struct rsa_signature *signature = 0;
-    u8 *msg;
-    u32 msgsz;
+    int *failed = cookie;
+
+    if (!*failed && write_full(1, data, len)) {
+        fprintf(stderr,"failed to write output\n");
+        *failed = 1;
+    }
+}
 
-    if (argc != 4) {
-        fprintf(stderr,"usage: verify <message> <signature> <pubkey>\n");
+/* passing the message through means reading it in order, a fixed-size
+ * buffer at a time, whatever sort of file it is */
+static int hash_copy(int fd, struct rfc4880_verify_ctx **ctx, int n)
+{
+    struct source *src;
+    u8 *buf;
+    int i, r, failed = 0;
+
+    buf = malloc(CHUNK_SIZE);
+    src = source_pipeline(fd, PIPELINE_DEPTH, PIPELINE_SIZE);
+    if (!buf || !src) {
+        free(buf);
+        if (src)
+            source_close(src);
         return -1;
     }
+    while (!failed && (r = source_read(src, buf, CHUNK_SIZE)) > 0) {
+        for (i = 0; i < n; i++)
+            rfc4880_verify_update(ctx[i], buf, r);
+        pass_out(&failed, buf, r);
+    }
+    source_close(src);
+    free(buf);
+    return failed ? -1 : r;
+}
+
+/* the message is read once, however many (initialized) contexts it
+ * goes into */
+static int hash_message(int fd, struct rfc4880_verify_ctx **ctx, int n)
+{
+    if (passthrough)
+        return hash_copy(fd, ctx, n);
+    return rfc4880_hash_fd(fd, ctx, n, HASH_FD_MAP);
+}
+
+/* "-" is standard input, which may be a pipe */
+static int open_message(const char *fn)
+{
+    return strcmp(fn, "-") ? open(fn, O_RDONLY) : 0;
+}
+
+/* keys come from a prepared key cache when one is given and current,
+ * otherwise from parsing the keyring itself */
+struct keys {
+    struct keyring *kr;
+    struct keycache *kc;
+};
+
+static int open_keys(struct keys *keys, const char *fn, const char *cache)
+{
+    keys->kr = 0;
+    keys->kc = 0;
+
+    if (cache) {
+        keys->kc = keycache_open(cache, fn);
+        if (keys->kc)
+            return keycache_count(keys->kc) ? 0 : -1;
+    }
 
-    if ((msg = load_file(argv[1],&msgsz)) == 0) {
-        fprintf(stderr,"failed to load '%s'\n", argv[1]);
+    keys->kr = keyring_open(fn);
+    if (!keys->kr || keyring_count(keys->kr) == 0)
+        return -1;
+
+    /* a cache that cannot be rebuilt just costs us the speedup */
+    if (cache && keycache_write(cache, keys->kr, fn))
+        fprintf(stderr,"warning: cannot write key cache '%s'\n", cache);
+    return 0;
+}
+
+static int verify_keys(struct keys *keys, struct rfc4880_verify_ctx *ctx,
+                       struct rsa_signature *signature)
+{
+    if (keys->kc)
+        return rfc4880_verify_keycache(ctx, keys->kc, signature);
+    return rfc4880_verify_keyring(ctx, keys->kr, signature);
+}
+
+/* a one-pass signed message carries its own signature; the payload is
+ * hashed (and passed through) as it streams past, read ahead as for
+ * detached messages */
+static int check_inline(struct keys *keys, const char *fn)
+{
+    struct rsa_signature *signature;
+    struct rfc4880_verify_ctx ctx;
+    struct source *src;
+    int fd, r, failed = 0;
+
+    fd = open_message(fn);
+    if (fd < 0) {
+        fprintf(stderr,"failed to open '%s'\n", fn);
         return -1;
     }
-    if (rfc4880_open_signature(argv[2], &signature)) {
-        fprintf(stderr,"failed to open signature\n");
+    src = source_pipeline(fd, PIPELINE_DEPTH, PIPELINE_SIZE);
+    if (!src) {
+        if (fd)
+            close(fd);
         return -1;
     }
-    if (rfc4880_open_public_key(argv[3], &public)) {
-        fprintf(stderr,"failed to open public key\n");
+    r = rfc4880_read_inline(src, &ctx, &signature,
+                            passthrough ? pass_out : 0, &failed);
+    source_close(src);
+    if (fd)
+        close(fd);
+    if (failed) {
+        free(signature);
         return -1;
     }
-    if (rfc4880_verify(msg, msgsz, public, signature)) {
-        fprintf(stderr,"FAILED\n");
+    if (r) {
+        fprintf(stderr,"failed to read signed message '%s'\n", fn);
         return -1;
     }
 
-    fprintf(stderr,"VERIFIED\n");
+    r = verify_keys(keys, &ctx, signature);
+    free(signature);
+    return r;
+}
+
+/* --stats: what each check cost, stage by stage, on stderr as text or
+ * as a JSON object per line, summed up with histograms over a batch */
+#define REPORT_TEXT 1
+#define REPORT_JSON 2
+
+static int report;
+static struct stats_hist hist;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void json_string(const char *s)
+{
+    const u8 *p = (const u8 *) s;
+
+    fputc('"', stderr);
+    for (; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(stderr,"\\%c", *p);
+        else if (*p < 0x20 || *p >= 0x7f)
+            fprintf(stderr,"\\u%04x", *p);
+        else
+            fputc(*p, stderr);
+    }
+    fputc('"', stderr);
+}
+
+static void check_begin(struct stats *st)
+{
+    if (report)
+        stats_begin(st);
+}
+
+static void check_end(struct stats *st, const char *message,
+                      char **sigs, int nsigs, int ok)
+{
+    int i;
+
+    if (!report)
+        return;
+    stats_end(st);
+
+    pthread_mutex_lock(&report_lock);
+    if (report == REPORT_JSON) {
+        fprintf(stderr,"{\"message\":");
+        json_string(message);
+        if (nsigs) {
+            fprintf(stderr,",\"signatures\":[");
+            for (i = 0; i < nsigs; i++) {
+                if (i)
+                    fputc(',', stderr);
+                json_string(sigs[i]);
+            }
+            fputc(']', stderr);
+        }
+        fprintf(stderr,",\"result\":\"%s\",\"total_ns\":%llu",
+                ok ? "verified" : "failed", st->total_ns);
+        for (i = 0; i < STATS_STAGES; i++)
+            fprintf(stderr,",\"%s\":{\"ns\":%llu,\"bytes\":%llu}",
+                    stats_stage_name(i), st->ns[i], st->bytes[i]);
+        fprintf(stderr,"}\n");
+    } else {
+        fprintf(stderr,"%s: %.3f ms", message, st->total_ns / 1e6);
+        for (i = 0; i < STATS_STAGES; i++) {
+            fprintf(stderr,", %s %.3f ms", stats_stage_name(i),
+                    st->ns[i] / 1e6);
+            if (st->bytes[i])
+                fprintf(stderr," %llu bytes", st->bytes[i]);
+        }
+        fputc('\n', stderr);
+    }
+    stats_hist_add(&hist, st);
+    pthread_mutex_unlock(&report_lock);
+}
+
+static void report_row(const char *name, int row, u64 ns, u64 bytes)
+{
+    u32 k;
+    int first = 1;
+
+    if (report == REPORT_JSON) {
+        fprintf(stderr,",\"%s\":{\"ns\":%llu,\"bytes\":%llu,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"histogram\":[",
+                name, ns, bytes, stats_hist_percentile(&hist, row, 50),
+                stats_hist_percentile(&hist, row, 99));
+        /* [upper bound, count] for each bucket that has anything in it */
+        for (k = 0; k < STATS_BUCKETS; k++) {
+            if (!hist.bucket[row][k])
+                continue;
+            fprintf(stderr,"%s[%llu,%llu]", first ? "" : ",",
+                    k ? 1ULL << k : 1ULL, hist.bucket[row][k]);
+            first = 0;
+        }
+        fprintf(stderr,"]}");
+    } else {
+        fprintf(stderr,"  %-8s %10.3f ms  p50 < %.3f ms  p99 < %.3f ms",
+                name, ns / 1e6, stats_hist_percentile(&hist, row, 50) / 1e6,
+                stats_hist_percentile(&hist, row, 99) / 1e6);
+        if (bytes)
+            fprintf(stderr,"  %llu bytes", bytes);
+        fputc('\n', stderr);
+    }
+}
+
+/* after a batch: totals and the spread of each stage over every check */
+static void report_summary(void)
+{
+    int i;
+
+    if (!report || !hist.count)
+        return;
+    if (report == REPORT_JSON)
+        fprintf(stderr,"{\"count\":%llu", hist.count);
+    else
+        fprintf(stderr,"%llu checks:\n", hist.count);
+    report_row("total", STATS_STAGES, hist.sum.total_ns, 0);
+    for (i = 0; i < STATS_STAGES; i++)
+        report_row(stats_stage_name(i), i, hist.sum.ns[i], hist.sum.bytes[i]);
+    if (report == REPORT_JSON)
+        fprintf(stderr,"}\n");
+}
+
+/* --result-cache: messages already found good, by file identity */
+static struct resultcache *results;
+
+#define RESULTS_SLOTS (1 << 18)
+
+/* the result cache key for checking fd against signature, if there is a
+ * cache, fd is a regular file and the signer is among our keys */
+static int result_key(struct keys *keys, int fd,
+                      struct rsa_signature *signature,
+                      struct resultcache_key *key)
+{
+    struct keyring_key *signer;
+    u8 fpr[SHA_DIGEST_SIZE];
+
+    if (!results || passthrough)
+        return -1;
+    if (keys->kc) {
+        if (keycache_signer_fingerprint(keys->kc, signature, fpr))
+            return -1;
+    } else {
+        signer = keyring_find_signer(keys->kr, signature);
+        if (!signer)
+            return -1;
+        memcpy(fpr, signer->fingerprint, SHA_DIGEST_SIZE);
+    }
+    return resultcache_key(key, fd, signature, fpr);
+}
+
+/* check message against each of nsigs detached signatures, setting
+ * ok[i] for those that verify; -1 if the message itself is unreadable */
+static int check_detached(struct keys *keys, const char *message,
+                          char **sigs, int nsigs, int *ok)
+{
+    struct rsa_signature **signatures;
+    struct rfc4880_verify_ctx binary, text, *ctx[2];
+    struct resultcache_key *rkeys, now;
+    int i, n, fd, r = 0, want_binary = 0, want_text = 0;
+    char *cached;
+
+    fd = open_message(message);
+    if (fd < 0) {
+        fprintf(stderr,"failed to load '%s'\n", message);
+        return -1;
+    }
+
+    /* signatures first, to learn whether the message is wanted as
+     * binary, canonical text or both, or not at all if every one of
+     * them is known good */
+    signatures = calloc(nsigs, sizeof(*signatures));
+    rkeys = calloc(nsigs, sizeof(*rkeys));
+    cached = calloc(nsigs, 1);
+    if (!signatures || !rkeys || !cached) {
+        r = -1;
+        goto done;
+    }
+    for (i = 0; i < nsigs; i++) {
+        ok[i] = 0;
+        if (rfc4880_open_signature(sigs[i], &signatures[i])) {
+            fprintf(stderr,"failed to open signature '%s'\n", sigs[i]);
+            signatures[i] = 0;
+            continue;
+        }
+        if (!result_key(keys, fd, signatures[i], &rkeys[i])) {
+            cached[i] = 1;
+            if (resultcache_lookup(results, &rkeys[i])) {
+                ok[i] = 1;
+                continue;
+            }
+        }
+        if (signatures[i]->type == SIG_CANONICAL_TEXT_DOC)
+            want_text = 1;
+        else
+            want_binary = 1;
+    }
+    if (!want_binary && !want_text)
+        goto done;
+
+    /* the message is hashed once no matter how many signatures */
+    rfc4880_verify_init(&binary);
+    rfc4880_verify_init_text(&text);
+    n = 0;
+    if (want_binary)
+        ctx[n++] = &binary;
+    if (want_text)
+        ctx[n++] = &text;
+    if (hash_message(fd, ctx, n)) {
+        fprintf(stderr,"failed to load '%s'\n", message);
+        r = -1;
+        goto done;
+    }
+
+    for (i = 0; i < nsigs; i++) {
+        if (!signatures[i] || ok[i])
+            continue;
+        ok[i] = !verify_keys(keys, signatures[i]->type ==
+                             SIG_CANONICAL_TEXT_DOC ? &text : &binary,
+                             signatures[i]);
+        /* only if the file did not change while it was being read */
+        if (ok[i] && cached[i] &&
+            !result_key(keys, fd, signatures[i], &now) &&
+            !memcmp(&now, &rkeys[i], sizeof(now)))
+            resultcache_store(results, &rkeys[i]);
+    }
+
+done:
+    if (signatures)
+        for (i = 0; i < nsigs; i++)
+            free(signatures[i]);
+    free(signatures);
+    free(rkeys);
+    free(cached);
+    if (fd)
+        close(fd);
+    return r;
+}
+
+/* --batch: a manifest of "<message> <signature>" lines, or just
+ * "<signed-message>" for one-pass signed messages, checked in parallel
+ * against one set of keys with a result line for each */
+struct batch_item {
+    char *message;
+    char *signature; /* 0 for a one-pass signed message */
+};
+
+struct batch {
+    struct keys *keys;
+    struct batch_item *items;
+    u64 count;
+    u64 failed;
+    pthread_mutex_t lock; /* result lines and the failed count */
+};
+
+static int load_manifest(struct batch *b, const char *fn)
+{
+    struct batch_item *items = 0, *item;
+    char *line = 0, *message, *signature, *save;
+    size_t cap = 0;
+    u64 max = 0;
+    FILE *fp;
+
+    fp = fopen(fn, "r");
+    if (!fp) {
+        fprintf(stderr,"failed to open manifest '%s'\n", fn);
+        return -1;
+    }
+    b->count = 0;
+    while (getline(&line, &cap, fp) >= 0) {
+        message = strtok_r(line, " \t\r\n", &save);
+        if (!message || message[0] == '#')
+            continue;
+        signature = strtok_r(0, " \t\r\n", &save);
+        if (b->count == max) {
+            max = max ? max * 2 : 1024;
+            item = realloc(items, max * sizeof(*items));
+            if (!item)
+                goto fail;
+            items = item;
+        }
+        item = items + b->count;
+        item->message = strdup(message);
+        item->signature = signature ? strdup(signature) : 0;
+        if (!item->message || (signature && !item->signature))
+            goto fail;
+        b->count++;
+    }
+    free(line);
+    fclose(fp);
+    b->items = items;
     return 0;
+
+fail:
+    fprintf(stderr,"out of memory reading manifest\n");
+    free(line);
+    fclose(fp);
+    b->items = items;
+    return -1;
+}
+
+static void batch_one(void *arg, u64 i)
+{
+    struct batch *b = arg;
+    struct batch_item *item = b->items + i;
+    struct stats st;
+    int ok;
+
+    check_begin(&st);
+    if (item->signature) {
+        if (check_detached(b->keys, item->message, &item->signature, 1, &ok))
+            ok = 0;
+    } else {
+        ok = !check_inline(b->keys, item->message);
+    }
+    check_end(&st, item->message, &item->signature,
+              item->signature ? 1 : 0, ok);
+
+    pthread_mutex_lock(&b->lock);
+    if (item->signature)
+        printf("%s %s: %s\n", item->message, item->signature,
+               ok ? "VERIFIED" : "FAILED");
+    else
+        printf("%s: %s\n", item->message, ok ? "VERIFIED" : "FAILED");
+    if (!ok)
+        b->failed++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int verify_batch(struct keys *keys, const char *manifest,
+                        unsigned threads)
+{
+    struct batch b;
+    int r;
+    u64 i;
+
+    b.keys = keys;
+    b.failed = 0;
+    pthread_mutex_init(&b.lock, 0);
+    r = load_manifest(&b, manifest);
+
+    /* every item wants the same keys: work their bignums out once */
+    if (!r && keys->kr && keyring_prepare(keys->kr))
+        fprintf(stderr,"warning: cannot prepare keys\n");
+
+    if (!r) {
+        r = pool_for(threads, b.count, batch_one, &b);
+        fflush(stdout);
+        fprintf(stderr,"%llu verified, %llu failed\n",
+                b.count - b.failed, b.failed);
+        report_summary();
+    }
+
+    for (i = 0; i < b.count; i++) {
+        free(b.items[i].message);
+        free(b.items[i].signature);
+    }
+    free(b.items);
+    pthread_mutex_destroy(&b.lock);
+    return r || b.failed ? -1 : 0;
+}
+
+/* -r: every X beside an X.sig (or X.asc) under a directory; the walk
+ * itself runs on the pool, a task per directory and per pair, so files
+ * of any mix of sizes keep every worker busy */
+struct tree {
+    struct keys *keys;
+    u64 count;
+    u64 failed;
+    pthread_mutex_t lock; /* result lines and counts */
+};
+
+struct tree_job {
+    struct tree *tree;
+    char *path;      /* directory, or message */
+    char *signature; /* 0 for a directory */
+};
+
+static void tree_task(struct pool *pool, void *arg);
+
+/* whatever could not be looked at counts against the tree: a check
+ * that skipped part of it must not pass */
+static void tree_fail(struct tree *tree)
+{
+    pthread_mutex_lock(&tree->lock);
+    tree->count++;
+    tree->failed++;
+    pthread_mutex_unlock(&tree->lock);
+}
+
+static void tree_spawn(struct pool *pool, struct tree *tree, char *path,
+                       char *signature)
+{
+    struct tree_job *job;
+
+    job = malloc(sizeof(*job));
+    if (job) {
+        job->tree = tree;
+        job->path = path;
+        job->signature = signature;
+        if (!pool_spawn(pool, tree_task, job))
+            return;
+    }
+    fprintf(stderr,"out of memory at '%s'\n", path);
+    tree_fail(tree);
+    free(job);
+    free(path);
+    free(signature);
+}
+
+static char *join(const char *dir, const char *name, u32 trim)
+{
+    u32 dlen = strlen(dir), nlen = strlen(name) - trim;
+    char *p;
+
+    p = malloc(dlen + 1 + nlen + 1);
+    if (!p)
+        return 0;
+    memcpy(p, dir, dlen);
+    p[dlen] = '/';
+    memcpy(p + dlen + 1, name, nlen);
+    p[dlen + 1 + nlen] = 0;
+    return p;
+}
+
+static void tree_dir(struct pool *pool, struct tree *tree, const char *path)
+{
+    struct dirent *de;
+    struct stat st;
+    char *child, *message;
+    u32 len;
+    int type;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr,"cannot open directory '%s'\n", path);
+        tree_fail(tree);
+        return;
+    }
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        child = join(path, de->d_name, 0);
+        if (!child) {
+            fprintf(stderr,"out of memory in '%s'\n", path);
+            tree_fail(tree);
+            break;
+        }
+        type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            /* not every filesystem fills in d_type */
+            if (lstat(child, &st))
+                type = DT_UNKNOWN;
+            else if (S_ISDIR(st.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+        }
+        if (type == DT_DIR) {
+            tree_spawn(pool, tree, child, 0);
+            continue;
+        }
+        len = strlen(de->d_name);
+        message = 0;
+        if (type == DT_REG && len > 4 &&
+            (!strcmp(de->d_name + len - 4, ".sig") ||
+             !strcmp(de->d_name + len - 4, ".asc"))) {
+            message = join(path, de->d_name, 4);
+            if (!message) {
+                fprintf(stderr,"out of memory at '%s'\n", child);
+                tree_fail(tree);
+            }
+        }
+        if (message && !stat(message, &st) && S_ISREG(st.st_mode)) {
+            tree_spawn(pool, tree, message, child);
+            continue;
+        }
+        free(message);
+        free(child);
+    }
+    closedir(dir);
+}
+
+static void tree_task(struct pool *pool, void *arg)
+{
+    struct tree_job *job = arg;
+    struct tree *tree = job->tree;
+    struct stats st;
+    int ok;
+
+    if (!job->signature) {
+        tree_dir(pool, tree, job->path);
+    } else {
+        check_begin(&st);
+        if (check_detached(tree->keys, job->path, &job->signature, 1, &ok))
+            ok = 0;
+        check_end(&st, job->path, &job->signature, 1, ok);
+        pthread_mutex_lock(&tree->lock);
+        printf("%s: %s\n", job->path, ok ? "VERIFIED" : "FAILED");
+        tree->count++;
+        if (!ok)
+            tree->failed++;
+        pthread_mutex_unlock(&tree->lock);
+    }
+    free(job->path);
+    free(job->signature);
+    free(job);
+}
+
+static int verify_tree(struct keys *keys, const char *root, unsigned threads)
+{
+    struct tree tree;
+    struct pool *pool;
+    char *path;
+
+    tree.keys = keys;
+    tree.count = 0;
+    tree.failed = 0;
+    pthread_mutex_init(&tree.lock, 0);
+
+    if (keys->kr && keyring_prepare(keys->kr))
+        fprintf(stderr,"warning: cannot prepare keys\n");
+
+    pool = pool_create(threads);
+    path = strdup(root);
+    if (!pool || !path) {
+        free(path);
+        pool_destroy(pool);
+        return -1;
+    }
+    tree_spawn(pool, &tree, path, 0);
+    pool_destroy(pool);
+
+    fflush(stdout);
+    fprintf(stderr,"%llu verified, %llu failed\n",
+            tree.count - tree.failed, tree.failed);
+    if (tree.count == 0)
+        fprintf(stderr,"no signed files under '%s'\n", root);
+    report_summary();
+    pthread_mutex_destroy(&tree.lock);
+    return tree.failed || tree.count == 0 ? -1 : 0;
+}
+
+static int verify_inline(struct keys *keys, const char *fn)
+{
+    struct stats st;
+    int ok;
+
+    check_begin(&st);
+    ok = !check_inline(keys, fn);
+    check_end(&st, fn, 0, 0, ok);
+    fprintf(stderr, ok ? "VERIFIED\n" : "FAILED\n");
+    return ok ? 0 : -1;
+}
+
+static int verify_detached(struct keys *keys, const char *message,
+                           char **sigs, int nsigs)
+{
+    struct stats st;
+    int i, r, *ok, failed = 0;
+
+    ok = calloc(nsigs, sizeof(*ok));
+    if (!ok)
+        return -1;
+    check_begin(&st);
+    r = check_detached(keys, message, sigs, nsigs, ok);
+    for (i = 0; i < nsigs; i++)
+        if (!ok[i])
+            failed++;
+    check_end(&st, message, sigs, nsigs, !r && !failed);
+    if (r) {
+        free(ok);
+        return -1;
+    }
+    for (i = 0; i < nsigs; i++) {
+        if (nsigs > 1)
+            fprintf(stderr,"%s: ", sigs[i]);
+        fprintf(stderr, ok[i] ? "VERIFIED\n" : "FAILED\n");
+    }
+    free(ok);
+    return failed ? -1 : 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,"usage: verify [-c <keycache>] [-p] <message> <signature>... <keyring>\n"
+            "       verify [-c <keycache>] [-p] -i <signed-message> <keyring>\n"
+            "       verify [-c <keycache>] [-j <threads>] --batch <manifest> <keyring>\n"
+            "       verify [-c <keycache>] [-j <threads>] -r <directory> <keyring>\n"
+            "  a message of - is read from standard input\n"
+            "  -p  copy the message to standard output as it is checked\n"
+            "  -r  check every X that has an X.sig or X.asc beside it\n"
+            "  --result-cache <file>\n"
+            "      skip messages that have not changed since they last verified\n"
+            "  --stats[=text|json]\n"
+            "      report the time and bytes each stage of each check took\n");
+}
+
+static const struct option options[] = {
+    { "batch", required_argument, 0, 'b' },
+    { "result-cache", required_argument, 0, 'R' },
+    { "stats", optional_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+    struct keys keys;
+    const char *cache = 0, *manifest = 0, *results_fn = 0;
+    unsigned threads = 0;
+    struct resultcache_stats st;
+    int c, r, nsigs, inline_sig = 0, recursive = 0;
+
+    while ((c = getopt_long(argc, argv, "c:ij:pr", options, 0)) != -1) {
+        switch (c) {
+        case 'b':
+            manifest = optarg;
+            break;
+        case 'R':
+            results_fn = optarg;
+            break;
+        case 'S':
+            if (!optarg || !strcmp(optarg, "text")) {
+                report = REPORT_TEXT;
+            } else if (!strcmp(optarg, "json")) {
+                report = REPORT_JSON;
+            } else {
+                usage();
+                return -1;
+            }
+            break;
+        case 'c':
+            cache = optarg;
+            break;
+        case 'i':
+            inline_sig = 1;
+            break;
+        case 'j':
+            threads = strtoul(optarg, 0, 0);
+            break;
+        case 'p':
+            passthrough = 1;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if ((inline_sig || manifest || recursive) ?
+        argc != (manifest ? 2 : 3) : argc < 4) {
+        usage();
+        return -1;
+    }
+    if (((manifest || recursive) && (passthrough || inline_sig)) ||
+        (manifest && recursive)) {
+        usage();
+        return -1;
+    }
+    nsigs = argc - 3;
+
+    if (open_keys(&keys, argv[argc - 1], cache)) {
+        fprintf(stderr,"failed to open public key\n");
+        return -1;
+    }
+
+    if (results_fn) {
+        results = resultcache_open(results_fn, RESULTS_SLOTS);
+        if (!results)
+            fprintf(stderr,"warning: cannot open result cache '%s'\n",
+                    results_fn);
+    }
+
+    if (manifest)
+        r = verify_batch(&keys, manifest, threads);
+    else if (recursive)
+        r = verify_tree(&keys, argv[1], threads);
+    else if (inline_sig)
+        r = verify_inline(&keys, argv[1]);
+    else
+        r = verify_detached(&keys, argv[1], argv + 2, nsigs);
+
+    if (results) {
+        resultcache_stats(results, &st);
+        fprintf(stderr,"result cache: %llu hits, %llu misses "
+                "(%llu hits, %llu misses in all)\n", st.hits, st.misses,
+                st.total_hits, st.total_misses);
+        resultcache_close(results);
+    }
+    return r;
 }
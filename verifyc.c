@@ -0,0 +1,303 @@
+/* verifyc.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "crypto.h"
+#include "verifyd.h"
+
+/* a client for exercising verifyd: sends the same request count times
+ * from each of threads connections and reports round-trip latency */
+
+static const char *socket_path;
+static const char *message;
+static u8 *sig;
+static u32 sig_len;
+static int by_path;
+static unsigned count = 1;
+
+static uint64_t *latency; /* per request, every thread's in turn */
+static unsigned failed;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* send the header, with pass (if not -1) riding along, then the rest */
+static int send_request(int conn, struct verifyd_request *req, int pass,
+			const void *path, const void *data)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov[3];
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = req;
+	iov[0].iov_len = sizeof(*req);
+	iov[1].iov_base = (void *) path;
+	iov[1].iov_len = req->path_len;
+	iov[2].iov_base = (void *) data;
+	iov[2].iov_len = req->sig_len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	if (pass >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		CMSG_FIRSTHDR(&msg)->cmsg_level = SOL_SOCKET;
+		CMSG_FIRSTHDR(&msg)->cmsg_type = SCM_RIGHTS;
+		CMSG_FIRSTHDR(&msg)->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msg)), &pass, sizeof(int));
+	}
+
+	/* small enough that a stream socket takes it in one go */
+	if (sendmsg(conn, &msg, MSG_NOSIGNAL) !=
+	    (ssize_t) (sizeof(*req) + req->path_len + req->sig_len))
+		return -1;
+	return 0;
+}
+
+static int recv_reply(int conn, struct verifyd_reply *reply)
+{
+	u32 have = 0;
+	ssize_t r;
+
+	while (have < sizeof(*reply)) {
+		r = recv(conn, (u8 *) reply + have, sizeof(*reply) - have, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		have += r;
+	}
+	return 0;
+}
+
+static void *client(void *arg)
+{
+	uint64_t *lat = arg, t0;
+	struct verifyd_request req;
+	struct verifyd_reply reply;
+	unsigned n, bad = 0;
+	int conn, fd;
+
+	conn = connect_to(socket_path);
+	if (conn < 0) {
+		fprintf(stderr,"cannot connect to '%s'\n", socket_path);
+		pthread_mutex_lock(&lock);
+		failed += count;
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	req.magic = VERIFYD_MAGIC;
+	req.op = by_path ? VERIFYD_PATH : VERIFYD_FD;
+	req.path_len = by_path ? strlen(message) : 0;
+	req.sig_len = sig_len;
+	for (n = 0; n < count; n++) {
+		t0 = now_ns();
+		fd = -1;
+		if (!by_path && (fd = open(message, O_RDONLY)) < 0) {
+			fprintf(stderr,"cannot open '%s'\n", message);
+			bad += count - n;
+			break;
+		}
+		if (send_request(conn, &req, fd, message, sig) ||
+		    recv_reply(conn, &reply)) {
+			fprintf(stderr,"lost connection to verifyd\n");
+			if (fd >= 0)
+				close(fd);
+			bad += count - n;
+			break;
+		}
+		if (fd >= 0)
+			close(fd);
+		lat[n] = now_ns() - t0;
+		if (reply.status != VERIFYD_VERIFIED)
+			bad++;
+	}
+	close(conn);
+
+	pthread_mutex_lock(&lock);
+	failed += bad;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static int stats(void)
+{
+	struct verifyd_request req = { VERIFYD_MAGIC, VERIFYD_STATS, 0, 0 };
+	struct verifyd_reply reply;
+	int conn;
+
+	conn = connect_to(socket_path);
+	if (conn < 0) {
+		fprintf(stderr,"cannot connect to '%s'\n", socket_path);
+		return -1;
+	}
+	if (send_request(conn, &req, -1, 0, 0) || recv_reply(conn, &reply)) {
+		close(conn);
+		return -1;
+	}
+	close(conn);
+	printf("%llu requests, p50 %.1f us, p99 %.1f us\n",
+	       (unsigned long long) reply.count, reply.p50_ns / 1e3,
+	       reply.p99_ns / 1e3);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: verifyc [-n <count>] [-t <threads>] [-p] <socket> <message> <signature>\n"
+		"       verifyc -s <socket>\n"
+		"  -p  send the message's path rather than an open fd\n"
+		"  -s  print the server's request count and latency\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = 1, n, total;
+	pthread_t *tids;
+	int c, want_stats = 0;
+	u64 sum = 0;
+
+	while ((c = getopt(argc, argv, "n:t:ps")) != -1) {
+		switch (c) {
+		case 'n':
+			count = strtoul(optarg, 0, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, 0, 0);
+			break;
+		case 'p':
+			by_path = 1;
+			break;
+		case 's':
+			want_stats = 1;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (want_stats) {
+		if (argc - optind != 1) {
+			usage();
+			return -1;
+		}
+		socket_path = argv[optind];
+		return stats();
+	}
+	if (argc - optind != 3 || count == 0 || threads == 0) {
+		usage();
+		return -1;
+	}
+	socket_path = argv[optind];
+	message = argv[optind + 1];
+	if (by_path && strlen(message) > VERIFYD_MAX_PATH) {
+		fprintf(stderr,"message path too long\n");
+		return -1;
+	}
+	sig = load_file(argv[optind + 2], &sig_len);
+	if (!sig || sig_len > VERIFYD_MAX_SIG) {
+		fprintf(stderr,"failed to open signature '%s'\n",
+			argv[optind + 2]);
+		return -1;
+	}
+
+	total = threads * count;
+	latency = calloc(total, sizeof(*latency));
+	tids = malloc(threads * sizeof(*tids));
+	if (!latency || !tids)
+		return -1;
+	for (n = 0; n < threads; n++)
+		if (pthread_create(&tids[n], 0, client, latency + n * count))
+			return -1;
+	for (n = 0; n < threads; n++)
+		pthread_join(tids[n], 0);
+
+	if (total > 1) {
+		qsort(latency, total, sizeof(*latency), cmp_u64);
+		for (n = 0; n < total; n++)
+			sum += latency[n];
+		printf("%u requests, mean %.1f us, p50 %.1f us, p99 %.1f us\n",
+		       total, sum / 1e3 / total, latency[total / 2] / 1e3,
+		       latency[(u64) total * 99 / 100] / 1e3);
+	}
+	fprintf(stderr, failed ? "FAILED\n" : "VERIFIED\n");
+	free(tids);
+	free(latency);
+	free(sig);
+	return failed ? -1 : 0;
+}
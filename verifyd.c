@@ -0,0 +1,452 @@
+/* verifyd.c
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "crypto.h"
+#include "rfc4880.h"
+#include "pool.h"
+#include "verifyd.h"
+
+/* keys stay resident and prepared for the life of the server */
+static struct keyring *keyring;
+static struct keycache *keycache;
+
+static int listen_fd;
+static int epoll_fd;
+static struct pool *pool;
+
+/* latencies of the most recent requests, for the percentiles */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t count;
+	uint64_t ns[VERIFYD_WINDOW];
+} stats = { PTHREAD_MUTEX_INITIALIZER, 0, { 0 } };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(uint64_t ns)
+{
+	pthread_mutex_lock(&stats.lock);
+	stats.ns[stats.count++ % VERIFYD_WINDOW] = ns;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void percentiles(struct verifyd_reply *reply)
+{
+	uint64_t *ns;
+	u32 n;
+
+	reply->count = 0;
+	reply->p50_ns = 0;
+	reply->p99_ns = 0;
+	ns = malloc(sizeof(stats.ns));
+	if (!ns)
+		return;
+
+	pthread_mutex_lock(&stats.lock);
+	reply->count = stats.count;
+	n = stats.count < VERIFYD_WINDOW ? stats.count : VERIFYD_WINDOW;
+	memcpy(ns, stats.ns, n * sizeof(*ns));
+	pthread_mutex_unlock(&stats.lock);
+
+	if (n) {
+		qsort(ns, n, sizeof(*ns), cmp_u64);
+		reply->p50_ns = ns[n / 2];
+		reply->p99_ns = ns[(u64) n * 99 / 100];
+	}
+	free(ns);
+}
+
+/* read exactly len bytes by the deadline, taking the first fd that
+ * arrives alongside them (if passed is not 0) and closing any others,
+ * however many each message carries; returns 1, 0 at a clean end of the
+ * connection, -1 on error or when the client is too slow */
+static int recv_full(int fd, void *buf, u32 len, int *passed,
+		     uint64_t deadline)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	u32 have = 0, i, count;
+	ssize_t r;
+	int *fds;
+
+	while (have < len) {
+		iov.iov_base = (u8 *) buf + have;
+		iov.iov_len = len - have;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (r == 0 && have == 0) ? 0 : -1;
+		have += r;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			fds = (int *) CMSG_DATA(cmsg);
+			count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < count; i++) {
+				if (passed && *passed < 0)
+					*passed = fds[i];
+				else
+					close(fds[i]);
+			}
+		}
+		if (have < len && now_ns() > deadline)
+			return -1;
+	}
+	return 1;
+}
+
+static int send_full(int fd, const void *buf, u32 len)
+{
+	u32 have = 0;
+	ssize_t r;
+
+	while (have < len) {
+		r = send(fd, (const u8 *) buf + have, len - have, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		have += r;
+	}
+	return 0;
+}
+
+static int check(int fd, u8 *sig, u32 sig_len)
+{
+	struct rsa_signature *signature = 0;
+	struct rfc4880_verify_ctx ctx, *pctx = &ctx;
+	int r;
+
+	if (rfc4880_load_signature(sig, sig_len, &signature))
+		return VERIFYD_ERROR;
+	if (signature->type == SIG_CANONICAL_TEXT_DOC)
+		rfc4880_verify_init_text(&ctx);
+	else
+		rfc4880_verify_init(&ctx);
+
+	if (rfc4880_hash_fd(fd, &pctx, 1, 0))
+		r = VERIFYD_ERROR;
+	else if (keycache)
+		r = rfc4880_verify_keycache(&ctx, keycache, signature) ?
+			VERIFYD_FAILED : VERIFYD_VERIFIED;
+	else
+		r = rfc4880_verify_keyring(&ctx, keyring, signature) ?
+			VERIFYD_FAILED : VERIFYD_VERIFIED;
+	free(signature);
+	return r;
+}
+
+/* only regular files: they end, and are read no further than the size
+ * they have when we start.  a pipe or socket could hold a worker for as
+ * long as the client likes */
+static int bounded(int fd)
+{
+	struct stat s;
+
+	return fstat(fd, &s) == 0 && S_ISREG(s.st_mode);
+}
+
+/* answer one request on a connection that has become readable; returns
+ * 0 to wait for the next, -1 to hang up */
+static int serve(int conn, char *path, char *sig)
+{
+	struct verifyd_request req;
+	struct verifyd_reply reply;
+	uint64_t t0, deadline;
+	int fd = -1, r;
+
+	t0 = now_ns();
+	deadline = t0 + (uint64_t) VERIFYD_TIMEOUT * 1000000000;
+	r = recv_full(conn, &req, sizeof(req), &fd, deadline);
+	if (r <= 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	memset(&reply, 0, sizeof(reply));
+	if (req.magic != VERIFYD_MAGIC ||
+	    req.path_len > VERIFYD_MAX_PATH ||
+	    req.sig_len > VERIFYD_MAX_SIG ||
+	    recv_full(conn, path, req.path_len, 0, deadline) != 1 ||
+	    recv_full(conn, sig, req.sig_len, 0, deadline) != 1) {
+		/* out of step with the client: drop it */
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	path[req.path_len] = 0;
+
+	/* only a VERIFYD_FD request may bring a file with it: any other
+	 * is refused (op 0 is no request at all) */
+	if (fd >= 0 && req.op != VERIFYD_FD)
+		req.op = 0;
+
+	switch (req.op) {
+	case VERIFYD_PATH:
+		/* not blocking on a FIFO, which is refused below anyway */
+		fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+		/* fall through */
+	case VERIFYD_FD:
+		reply.status = fd < 0 || !bounded(fd) ? VERIFYD_ERROR :
+			check(fd, (u8 *) sig, req.sig_len);
+		break;
+	case VERIFYD_STATS:
+		percentiles(&reply);
+		break;
+	default:
+		reply.status = VERIFYD_ERROR;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (req.op != VERIFYD_STATS)
+		record(now_ns() - t0);
+	return send_full(conn, &reply, sizeof(reply));
+}
+
+/* wait for the connection's next request; the event fires once, so no
+ * other worker picks the connection up while this one has it */
+static int watch(int conn, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.fd = conn;
+	return epoll_ctl(epoll_fd, op, conn, &ev);
+}
+
+/* one request, on a pool worker: an idle connection holds no thread */
+static void request(struct pool *pool, void *arg)
+{
+	int conn = (intptr_t) arg;
+	char *buf;
+
+	(void) pool;
+	/* a request's path, with room to terminate it, and signature */
+	buf = malloc(VERIFYD_MAX_PATH + 1 + VERIFYD_MAX_SIG);
+	if (!buf || serve(conn, buf, buf + VERIFYD_MAX_PATH + 1) ||
+	    watch(conn, EPOLL_CTL_MOD))
+		close(conn);
+	free(buf);
+}
+
+static void accept_all(void)
+{
+	struct timeval tv = { VERIFYD_TIMEOUT, 0 };
+	int conn;
+
+	for (;;) {
+		conn = accept(listen_fd, 0, 0);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept");
+			return;
+		}
+		/* no one wait on a client can hold a worker longer */
+		if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+		    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ||
+		    watch(conn, EPOLL_CTL_ADD))
+			close(conn);
+	}
+}
+
+/* hand each request to the pool as it becomes readable */
+static void *dispatch(void *arg)
+{
+	struct epoll_event ev[64];
+	int i, n;
+
+	(void) arg;
+	for (;;) {
+		n = epoll_wait(epoll_fd, ev, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == listen_fd)
+				accept_all();
+			else if (pool_spawn(pool, request,
+					    (void *) (intptr_t) ev[i].data.fd))
+				close(ev[i].data.fd);
+		}
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,"usage: verifyd [-c <keycache>] [-j <threads>] <socket> <keyring>\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	struct verifyd_reply reply;
+	struct epoll_event ev;
+	const char *cache = 0, *path, *keys;
+	unsigned threads = 0;
+	pthread_t tid;
+	sigset_t set;
+	int c, sig;
+
+	while ((c = getopt(argc, argv, "c:j:")) != -1) {
+		switch (c) {
+		case 'c':
+			cache = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, 0, 0);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+		return -1;
+	}
+	path = argv[optind];
+	keys = argv[optind + 1];
+	if (threads == 0)
+		threads = pool_cpus();
+
+	if (cache)
+		keycache = keycache_open(cache, keys);
+	if (!keycache) {
+		keyring = keyring_open(keys);
+		if (!keyring || keyring_count(keyring) == 0) {
+			fprintf(stderr,"failed to open public key\n");
+			return -1;
+		}
+		if (cache && keycache_write(cache, keyring, keys))
+			fprintf(stderr,"warning: cannot write key cache '%s'\n",
+				cache);
+		if (keyring_prepare(keyring))
+			fprintf(stderr,"warning: cannot prepare keys\n");
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr,"socket path too long\n");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			   0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(listen_fd, 128)) {
+		fprintf(stderr,"cannot listen on '%s': %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	/* the workers never see these; main waits for them below */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, 0);
+
+	pool = pool_create(threads);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	if (!pool || epoll_fd < 0 ||
+	    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) ||
+	    pthread_create(&tid, 0, dispatch, 0)) {
+		fprintf(stderr,"cannot start worker threads\n");
+		return -1;
+	}
+	pthread_detach(tid);
+	fprintf(stderr,"verifyd: listening on %s with %u threads\n",
+		path, threads);
+
+	sigwait(&set, &sig);
+	unlink(path);
+	percentiles(&reply);
+	fprintf(stderr,"verifyd: %llu requests, p50 %.1f us, p99 %.1f us\n",
+		(unsigned long long) reply.count, reply.p50_ns / 1e3,
+		reply.p99_ns / 1e3);
+	return 0;
+}
@@ -0,0 +1,78 @@
+/* verifyd.h
+ *
+ * Copyright 2011 Brian Swetland. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY,
+ * OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _VERIFYD_H_
+#define _VERIFYD_H_
+
+#include <stdint.h>
+
+/* the verifyd protocol: over a Unix stream socket, any number of
+ * requests, each answered in turn by a reply; all fields are in host
+ * byte order since both ends are on the same machine */
+
+#define VERIFYD_MAGIC	0x56524659	/* "VRFY" */
+
+#define VERIFYD_PATH	1	/* check the message at the path that follows */
+#define VERIFYD_FD	2	/* check the message fd sent along (SCM_RIGHTS) */
+#define VERIFYD_STATS	3	/* report on the requests served so far */
+
+#define VERIFYD_MAX_PATH	4096
+#define VERIFYD_MAX_SIG		(64 * 1024)
+
+/* seconds a request may take to arrive in full, and a reply to be taken;
+ * a client that is slower is hung up on */
+#define VERIFYD_TIMEOUT		5
+
+/* followed by path_len bytes of path (VERIFYD_PATH only) and sig_len
+ * bytes of detached signature, binary or armored */
+struct verifyd_request {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t path_len;
+	uint32_t sig_len;
+};
+
+#define VERIFYD_VERIFIED	0
+#define VERIFYD_FAILED		1	/* the signature does not check out */
+#define VERIFYD_ERROR		2	/* unreadable message or signature */
+
+struct verifyd_reply {
+	uint32_t status;
+	uint32_t reserved;
+	/* VERIFYD_STATS: requests served and latency percentiles over
+	 * (at most) the most recent VERIFYD_WINDOW of them */
+	uint64_t count;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+};
+
+#define VERIFYD_WINDOW	65536
+
+#endif